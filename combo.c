@@ -9,8 +9,12 @@
 #include <avr/pgmspace.h>
 
 #include "key.h"
+#include "midi.h"
+#include "sysex.h"
 #include "combo.h"
+#include "eeprom.h"
 #include "random.h"
+#include "constants.h"
 
 // COMBOS
 //
@@ -25,45 +29,26 @@
 //
 // Combos retain a NoteOn while the final key is depressed and emit a NoteUp
 // when it is released.
-
-
-// Types ----------------------------------------------------------------------
-
-typedef struct combo_state {
-    uint8_t  state_num;        // these rules apply to state N
-    uint8_t  key;              // index of the key + which keystate to test
-    uint8_t  next_state;       // next state transition
-    combo_action_t action;     // action on this transition
-} combo_state_t;
+//
+// These are the default combos. They can be replaced with your own over
+// SysEx (see sysExCmdCombo() below), up to COMBO_MAX_SEQUENCES sequences of
+// keys pressed one after the other and COMBO_MAX_CHORDS sets of keys held
+// down together, each sending a note of your choice.
+//
+// Sequences are recognized by a state machine driven by key presses, with
+// one state for each step of each sequence, numbered from 1, plus state 0
+// for no keys yet. A sequence's steps are numbered one after the other,
+// except for the keys it starts with that an earlier sequence starts with
+// too: those share the earlier sequence's steps, and the rest branch off
+// the last one shared. So the way on from a state is either the next
+// step, or the first step of a sequence branching off there, which takes
+// a handful of compares for each key press. A press with no way on from
+// the current state is tried again from state 0, so a sequence can start
+// on a key that broke another one. Key releases don't affect sequences.
 
 
 // Globals ---------------------------------------------------------------------
 
-// Top two bits of the key index tell us which keystate to test.
-#define KEYMASK  0xF0
-#define KEYDOWN  0x10
-#define KEYUP    0x20
-
-uint8_t g_combos_enable;
-
-// count and list of active states.
-static uint8_t combo_state;
-
-// State Offset Table
-// records for state N starts at offset M in the state table.
-const uint8_t state_offset[] PROGMEM = {
-    0,
-    4, 5, 6, 7,
-    8, 9, 10, 11,
-    12, 13, 14,
-    16, 17, 18, 19, 20, 21,
-    22, 23, 24, 25, 26, 27, 28, 29, 30,
-    32, 33, 34, 35, 36,
-    38, 39,
-    41, 42, 43
-};
-
-// State Transition Table
 // Key numbers are:
 //     +-----------+
 //     | 0  1  2  3|
@@ -72,162 +57,343 @@ const uint8_t state_offset[] PROGMEM = {
 //     |12 13 14 15|
 //     +-----------+
 //
-const combo_state_t state_table[] PROGMEM = {
-//          state  key           next action
-/*  0 */   {  0,   12 | KEYDOWN,   1,  COMBO_NONE },  // combo A
-/*  1 */   {  0,    9 | KEYDOWN,   5,  COMBO_NONE },  // combo B
-/*  2 */   {  0,    8 | KEYDOWN,   9,  COMBO_NONE },  // combo D
-/*  3 */   {  0,    4 | KEYDOWN,  18,  COMBO_NONE },  // combo E
-
-/*  4 */   {  1,   13 | KEYDOWN,   2,  COMBO_NONE },  // combo A
-/*  5 */   {  2,   14 | KEYDOWN,   3,  COMBO_NONE },
-/*  6 */   {  3,   15 | KEYDOWN,   4,  COMBO_A_DOWN },
-/*  7 */   {  4,   15 | KEYUP,     0,  COMBO_A_RELEASE },
-
-/*  8 */   {  5,   10 | KEYDOWN,   6,  COMBO_NONE }, // combo B
-/*  9 */   {  6,    5 | KEYDOWN,   7,  COMBO_NONE },
-/* 10 */   {  7,    6 | KEYDOWN,   8,  COMBO_C_DOWN },
-/* 11 */   {  8,    6 | KEYUP,     0,  COMBO_C_RELEASE },
-
-/* 12 */   {  9,    8 | KEYUP,    10,  COMBO_NONE },  // combo D
-/* 13 */   { 10,    9 | KEYDOWN,  11,  COMBO_NONE },
-/* 14 */   { 11,    9 | KEYUP,    12,  COMBO_NONE },
-/* 15 */   { 11,   10 | KEYDOWN,   6,  COMBO_NONE }, // --> combo C
-/* 16 */   { 12,   10 | KEYDOWN,  13,  COMBO_NONE },
-/* 17 */   { 13,   10 | KEYUP,    14,  COMBO_NONE },
-/* 18 */   { 14,   10 | KEYDOWN,  15,  COMBO_NONE },
-/* 19 */   { 15,   10 | KEYUP,    16,  COMBO_NONE },
-/* 20 */   { 16,   11 | KEYDOWN,  17,  COMBO_D_DOWN },
-/* 21 */   { 17,   11 | KEYUP,     0,  COMBO_D_RELEASE },
-
-/* 22 */   { 18,    4 | KEYUP,    19, COMBO_NONE }, // combo E
-/* 23 */   { 19,    4 | KEYDOWN,  20, COMBO_NONE },
-/* 24 */   { 20,    4 | KEYUP,    21, COMBO_NONE },
-/* 25 */   { 21,   12 | KEYDOWN,  22, COMBO_NONE },
-/* 26 */   { 22,   12 | KEYUP,    23, COMBO_NONE },
-/* 27 */   { 23,   12 | KEYDOWN,  24, COMBO_NONE },
-/* 28 */   { 24,   12 | KEYUP,    25, COMBO_NONE },
-/* 29 */   { 25,    8 | KEYDOWN,  26, COMBO_NONE },
-/* 30 */   { 26,    8 | KEYUP,    27, COMBO_NONE },
-/* 31 */   { 26,   10 | KEYDOWN,   6, COMBO_NONE }, // --> combo C
-/* 32 */   { 27,    9 | KEYDOWN,  28, COMBO_NONE },
-/* 33 */   { 28,    9 | KEYUP,    29, COMBO_NONE },
-/* 34 */   { 29,    8 | KEYDOWN,  30, COMBO_NONE },
-/* 35 */   { 30,    8 | KEYUP,    31, COMBO_NONE },
-/* 36 */   { 31,    9 | KEYDOWN,  32, COMBO_NONE },
-/* 37 */   { 31,   10 | KEYDOWN,  13, COMBO_NONE }, // --> combo D
-/* 38 */   { 32,    9 | KEYUP,    33, COMBO_NONE },
-/* 39 */   { 33,   11 | KEYDOWN,  34, COMBO_NONE },
-/* 40 */   { 33,    9 | KEYDOWN,  11, COMBO_NONE }, // --> combo D
-/* 41 */   { 34,   11 | KEYUP,    35, COMBO_NONE },
-/* 42 */   { 35,   10 | KEYDOWN,  36, COMBO_E_DOWN },
-/* 43 */   { 36,   10 | KEYUP,     0, COMBO_E_RELEASE },
-
+// Keys of the default sequences A, C, D and E, one per step.
+static const uint8_t default_steps[23] PROGMEM = {
+    12, 13, 14, COMBO_ACCEPT|15,                     //  1: A
+    9, 10, 5, COMBO_ACCEPT|6,                        //  5: C
+    8, 9, 10, 10, COMBO_ACCEPT|11,                   //  9: D
+    4, 4, 12, 12, 8, 9, 8, 9, 11, COMBO_ACCEPT|10,   // 14: E
 };
 
+// First step of each default sequence. None of them share any steps.
+static const uint8_t default_start[4] PROGMEM = { 1, 5, 9, 14 };
+
+// Notes sent by the default sequences.
+static const uint8_t default_notes[4] PROGMEM = { 8, 10, 11, 12 };
+
+uint8_t g_combos_enable;
+uint8_t g_combo_note;
+
+// Are we using combos uploaded over SysEx? If so the sequences live in the
+// EEPROM, otherwise they're the defaults in program memory.
+static bool s_combo_user = false;
+static uint8_t s_sequence_count;
+
+// The chords, copied into RAM from whichever combos are in use.
+static uint8_t s_chord_count;
+static uint16_t s_chord_mask[COMBO_MAX_CHORDS];
+static uint8_t s_chord_note[COMBO_MAX_CHORDS];
+
+// Current state of the sequence state machine.
+static uint8_t combo_state;
+
+// The combo being held down, and the key that will release it.
+static bool s_combo_held = false;
+static uint16_t s_combo_release_key = 0;
+
+// SysEx command constants
+#define COMBO_SYSEX_BEGIN   0x0  // Start a new set of combos.
+#define COMBO_SYSEX_ADD_SEQ 0x1  // note, key, key, ...
+#define COMBO_SYSEX_CHORD   0x2  // note, mask bits 0-6, 7-13, 14-15
+#define COMBO_SYSEX_COMMIT  0x3  // Start using the new combos.
+#define COMBO_SYSEX_DEFAULT 0x4  // Go back to the default combos.
+
+// Value of EE_COMBO_VALID when the EEPROM holds a complete set of combos.
+#define COMBO_VALID_MAGIC 0xC0
+
+
 // Functions -------------------------------------------------------------------
 
-void combo_setup(void)
+// Read the sequences, from the EEPROM if "user" is set (for uploaded
+// combos, whether or not they're in use yet), otherwise from the defaults.
+//
+static uint8_t combo_start(const bool user, const uint8_t sequence)
+{
+    if (user) return eeprom_read(EE_COMBO_START + sequence);
+    return pgm_read_byte(&default_start[sequence]);
+}
+
+static uint8_t combo_branch(const bool user, const uint8_t sequence)
+{
+    if (user) return eeprom_read(EE_COMBO_BRANCH + sequence);
+    return 0;
+}
+
+static uint8_t combo_step(const bool user, const uint8_t state)
+{
+    if (user) return eeprom_read(EE_COMBO_STEPS + state - 1);
+    return pgm_read_byte(&default_steps[state - 1]);
+}
+
+// Find the way on from a state for a key, or 0 if there isn't one.
+//
+static uint8_t combo_transition(const bool user,
+                                const uint8_t sequences,
+                                const uint8_t state,
+                                const uint8_t key)
+{
+    // Carry on along the sequence. A state with no next step completes a
+    // combo, so is never the current state.
+    if (state && (combo_step(user, state + 1) & ~COMBO_ACCEPT) == key) {
+        return state + 1;
+    }
+    // Branch off into another sequence.
+    for (uint8_t i=0; i<sequences; ++i) {
+        if (combo_branch(user, i) != state) continue;
+        uint8_t start = combo_start(user, i);
+        if ((combo_step(user, start) & ~COMBO_ACCEPT) == key) return start;
+    }
+    return 0;
+}
+
+// Load the combos, from the EEPROM if a valid set has been uploaded,
+// otherwise the defaults. The chords are needed on every key event, so
+// they're copied into RAM.
+//
+void combo_load(void)
 {
-    // init the state machine at state 0.
     combo_state = 0;
+    s_combo_held = false;
+    s_combo_user = (eeprom_read(EE_COMBO_VALID) == COMBO_VALID_MAGIC);
+
+    if (s_combo_user) {
+        s_sequence_count = eeprom_read(EE_COMBO_SEQUENCES);
+        s_chord_count = eeprom_read(EE_COMBO_CHORDS);
+        for (uint8_t i=0; i<s_chord_count; ++i) {
+            uint16_t address = EE_COMBO_CHORD + i*3;
+            s_chord_mask[i] = eeprom_read(address) |
+                              (eeprom_read(address + 1) << 8);
+            s_chord_note[i] = eeprom_read(address + 2);
+        }
+    } else {
+        s_sequence_count = sizeof(default_start);
+        // Default combo B: the four keys of the second row from the bottom.
+        s_chord_count = 1;
+        s_chord_mask[0] = 0x0f00;
+        s_chord_note[0] = 9;
+    }
 }
 
+// Feed a key event into the combo recognizer.
+//
+// Returns COMBO_DOWN when a combo has been completed and COMBO_RELEASE when
+// the last key pressed for it is released, with the note to send in
+// g_combo_note. While a combo is held no other combos are recognized.
+//
 combo_action_t combo_recognize(const uint16_t keydown,
                                const uint16_t keyup,
                                const uint16_t keystate)
 {
-    uint8_t combo_next_state = 0;
-    static combo_action_t combo_action = COMBO_NONE;
-    static uint16_t combo_release_key = 0;
-
     // quick out of there's no keys pressed.
     if (keydown == 0 && keyup == 0) {
         return COMBO_NONE;
     }
 
-    // Check for ComboB, as the keys can be pressed in any order.
-    if (keystate == 0x0f00 && combo_action != COMBO_B_DOWN) {
-        combo_action = COMBO_B_DOWN;
-        // Record the final key pressed to complete this combo, defined as
-        // the right most bit of the instantaneous keydown bitmask.
-        uint16_t keydown_bit = rightmost_bit_16(keydown);
-        if (keydown_bit == 0) {
-            // the keydown wasn't found inside this mask.
-            // *** THIS SHOULD NEVER HAPPEN ***
-            combo_action = COMBO_NONE;
-        } else {
-            combo_release_key = keydown_bit;
-            combo_action = COMBO_B_DOWN;
+    // If a combo has fired, check for the combo release keyup.
+    if (s_combo_held) {
+        if (!(keystate & s_combo_release_key)) {
+            // the release key is unset, reset the state machine to zero.
+            s_combo_held = false;
+            combo_state = 0;
+            return COMBO_RELEASE;
         }
-        return combo_action;
+        return COMBO_NONE;
+    }
+    if (keydown == 0) {
+        return COMBO_NONE;
     }
 
-    // If the previous keypress caused a Combo to fire, check for the combo
-    // release keyup.
-    if (combo_action != COMBO_NONE && combo_action <= COMBO_E_DOWN) {
-        if (!(keystate & combo_release_key)) {
-            // the release key is unset, reset the state machine to zero.
-            combo_state = 0;
-            // emit a keyup event.
-            combo_action = combo_action + (COMBO_A_RELEASE - COMBO_A_DOWN);
-            return combo_action;
-        } else {
-            // combo_action stays the same but we tell the combo scanner to
-            // do nothing.
-            return COMBO_NONE;
+    // The final key pressed is the one that releases the combo, defined as
+    // the right most bit of the instantaneous keydown bitmask.
+    uint16_t keydown_bit = rightmost_bit_16(keydown);
+
+    // Check for chords, where the keys can be pressed in any order.
+    for (uint8_t i=0; i<s_chord_count; ++i) {
+        if (keystate == s_chord_mask[i]) {
+            g_combo_note = s_chord_note[i];
+            s_combo_release_key = keydown_bit;
+            s_combo_held = true;
+            return COMBO_DOWN;
         }
     }
 
-    // loop over the rules for this state attempting to transition.
-    uint8_t offset = pgm_read_byte(&(state_offset[combo_state]));
-    combo_state_t *rule = state_table + offset;
-    while(pgm_read_byte(&(rule->state_num)) == combo_state) {
-        uint8_t keyrule = pgm_read_byte(&(rule->key));
-
-        // break the keyrule into type of test and bit to test.
-        uint8_t keytest = keyrule & 0xf0;
-        uint8_t keybit = keyrule & 0x0f;
-
-        // setup the key test.
-        uint16_t keymask = 0;
-        if (keytest == KEYDOWN) {
-            keymask = keydown;
-        } else if (keytest == KEYUP) {
-            keymask = keyup;
-        } else {
-            keymask = keystate;
+    // Uploaded sequences are read from the EEPROM, which has to wait out
+    // any write that is running, up to 3.4ms. Settings are only saved away
+    // from play, so rather than hold up the key give up on the sequence.
+    if (s_combo_user && eeprom_busy()) {
+        combo_state = 0;
+        return COMBO_NONE;
+    }
+
+    // Step the sequence state machine once for each key pressed.
+    uint16_t pressed = keydown;
+    while (pressed) {
+        uint16_t bit = rightmost_bit_16(pressed);
+        pressed &= ~bit;
+        uint8_t key = bit_index_16(bit);
+
+        uint8_t next = combo_transition(s_combo_user, s_sequence_count,
+                                        combo_state, key);
+        if (next == 0 && combo_state != 0) {
+            // The sequence was broken, see if this key starts another one.
+            next = combo_transition(s_combo_user, s_sequence_count, 0, key);
         }
 
-        // execute the keytest.
-        if ((1 << keybit) & keymask) {
-            // transition was successful.
-            combo_next_state = pgm_read_byte(&(rule->next_state));
-            combo_action = pgm_read_byte(&(rule->action));
-            // no more rule following.
-            break;
-        } else {
-            // rule failed, reset to zero.
-            combo_next_state = 0;
-            combo_action = COMBO_NONE;
+        if (next && (combo_step(s_combo_user, next) & COMBO_ACCEPT)) {
+            // The combo is the last sequence starting at or before here.
+            uint8_t combo = s_sequence_count;
+            while (combo_start(s_combo_user, --combo) > next) {}
+            if (s_combo_user) {
+                g_combo_note = eeprom_read(EE_COMBO_NOTES + combo);
+            } else {
+                g_combo_note = pgm_read_byte(&default_notes[combo]);
+            }
+            s_combo_release_key = bit;
+            s_combo_held = true;
+            combo_state = 0;
+            return COMBO_DOWN;
+        }
+        combo_state = next;
+    }
+
+    return COMBO_NONE;
+}
+
+
+// SysEx combo upload ----------------------------------------------------------
+//
+// New combos are compiled straight into the EEPROM as they arrive:
+//
+//   BEGIN      marks the stored combos invalid and empties them.
+//   ADD_SEQ    follows the keys the sequence starts with along the steps
+//              already added, and adds steps for the rest.
+//   CHORD      appends a chord.
+//   COMMIT     marks the stored combos valid and starts using them.
+//   DEFAULT    marks the stored combos invalid, going back to the defaults.
+//
+// The defaults stay in use until COMMIT. Each message is answered with a
+// status byte, zero for success. A message that fails changes nothing.
+//
+// A message makes at most COMBO_MAX_STEPS + 5 writes, which fit in the
+// EEPROM queue, so it never has to wait on the EEPROM. Until the last
+// message's writes have been saved the reply is BUSY, and the message should
+// be sent again.
+
+#define COMBO_STATUS_OK    0x0
+#define COMBO_STATUS_FULL  0x1  // Out of sequences or chords.
+#define COMBO_STATUS_CLASH 0x2  // Sequence is a prefix of another one.
+#define COMBO_STATUS_ERROR 0x3  // Malformed message.
+#define COMBO_STATUS_BUSY  0x4  // Still saving the last message.
+
+// Send the status reply for a combo command.
+//
+static void combo_send_status(const uint8_t command, const uint8_t status)
+{
+    uint8_t payload[] = {0xf0, 0x00, MANUFACTURER_ID >> 8,
+                         MANUFACTURER_ID & 0x7f,
+                         SYSEX_COMMAND_COMBO,
+                         0x01, // 0x0 = request, 0x1 = response
+                         command, status,
+                         0xf7};
+    midi_stream_sysex(sizeof(payload), payload);
+}
+
+// Add a sequence of key presses to the combos in the EEPROM.
+//
+static uint8_t combo_add_sequence(const uint8_t note,
+                                  const uint8_t* keys,
+                                  const uint8_t count)
+{
+    uint8_t sequences = eeprom_read(EE_COMBO_SEQUENCES);
+
+    if (count == 0 || count > COMBO_MAX_STEPS) return COMBO_STATUS_ERROR;
+    if (sequences >= COMBO_MAX_SEQUENCES) return COMBO_STATUS_FULL;
+
+    // Follow the keys shared with the sequences already added. Nothing is
+    // written until the sequence is known to fit, so one that doesn't
+    // leaves the combos as they were.
+    uint8_t state = 0;
+    uint8_t i = 0;
+    for (; i<count; ++i) {
+        uint8_t next = combo_transition(true, sequences, state, keys[i] & 0x0f);
+        if (next == 0) break;
+        // Either this sequence or another would fire before the other
+        // could.
+        if (i == count - 1 || (combo_step(true, next) & COMBO_ACCEPT)) {
+            return COMBO_STATUS_CLASH;
         }
-        rule++;
+        state = next;
     }
 
-    combo_state = combo_next_state;
+    // The rest of the keys are new steps, branching off the last one
+    // shared. There's room for every step of every sequence.
+    uint8_t steps = eeprom_read(EE_COMBO_STEP_COUNT);
+    eeprom_write(EE_COMBO_START + sequences, steps + 1);
+    eeprom_write(EE_COMBO_BRANCH + sequences, state);
+    for (; i<count; ++i) {
+        uint8_t step = keys[i] & 0x0f;
+        if (i == count - 1) step |= COMBO_ACCEPT;
+        eeprom_write(EE_COMBO_STEPS + steps++, step);
+    }
+    eeprom_write(EE_COMBO_STEP_COUNT, steps);
+    eeprom_write(EE_COMBO_NOTES + sequences, note & 0x7f);
+    eeprom_write(EE_COMBO_SEQUENCES, sequences + 1);
+    return COMBO_STATUS_OK;
+}
 
-    // If we've found a state with an action, record the combo release key.
-    if (combo_action != COMBO_NONE) {
-        uint16_t keydown_bit = rightmost_bit_16(keydown);
-        if (keydown_bit == 0) {
-            // the keydown wasn't found inside this mask.
-            combo_release_key = 0;
+// Handle the combo SysEx command.
+//
+void sysExCmdCombo(SysEx_t* sysex, uint8_t* payload)
+{
+    uint8_t size = sysex_payload_size(sysex);
+    uint8_t command = payload[0];
+    uint8_t status = COMBO_STATUS_OK;
+
+    if (eeprom_busy()) {
+        status = COMBO_STATUS_BUSY;
+    } else if (command == COMBO_SYSEX_BEGIN) {
+        // The counts mark everything else empty.
+        eeprom_write(EE_COMBO_VALID, 0x00);
+        eeprom_write(EE_COMBO_SEQUENCES, 0);
+        eeprom_write(EE_COMBO_CHORDS, 0);
+        eeprom_write(EE_COMBO_STEP_COUNT, 0);
+        // Use the defaults until the new combos are complete.
+        combo_load();
+    } else if (command == COMBO_SYSEX_ADD_SEQ && size >= 3) {
+        status = combo_add_sequence(payload[1], &payload[2], size - 2);
+    } else if (command == COMBO_SYSEX_CHORD && size == 5) {
+        uint8_t chords = eeprom_read(EE_COMBO_CHORDS);
+        uint16_t mask = payload[2] | ((uint16_t)payload[3] << 7) |
+                        ((uint16_t)payload[4] << 14);
+        if (chords >= COMBO_MAX_CHORDS) {
+            status = COMBO_STATUS_FULL;
+        } else if (mask == 0) {
+            status = COMBO_STATUS_ERROR;
         } else {
-            combo_release_key = keydown_bit;
+            uint16_t address = EE_COMBO_CHORD + chords*3;
+            eeprom_write(address, mask & 0xff);
+            eeprom_write(address + 1, mask >> 8);
+            eeprom_write(address + 2, payload[1] & 0x7f);
+            eeprom_write(EE_COMBO_CHORDS, chords + 1);
         }
+    } else if (command == COMBO_SYSEX_COMMIT) {
+        eeprom_write(EE_COMBO_VALID, COMBO_VALID_MAGIC);
+        combo_load();
+    } else if (command == COMBO_SYSEX_DEFAULT) {
+        eeprom_write(EE_COMBO_VALID, 0x00);
+        combo_load();
+    } else {
+        status = COMBO_STATUS_ERROR;
     }
 
-    return combo_action;
+    combo_send_status(command, status);
+}
+
+void combo_setup(void)
+{
+    // init the state machine at state 0.
+    combo_load();
+    sysex_install(SYSEX_COMMAND_COMBO, sysExCmdCombo);
 }
 
 // -----------------------------------------------------------------------------
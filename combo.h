@@ -28,28 +28,32 @@
 
 // Types ----------------------------------------------------------------------
 
-// event keyups are DOWN + 5
+// What combo_recognize() found. The note of the combo is in g_combo_note.
 typedef enum combo_action {
-    COMBO_NONE,
-    COMBO_A_DOWN = 1,
-    COMBO_B_DOWN,
-    COMBO_C_DOWN,
-    COMBO_D_DOWN,
-    COMBO_E_DOWN,
-    COMBO_A_RELEASE = 6,
-    COMBO_B_RELEASE,
-    COMBO_C_RELEASE,
-    COMBO_D_RELEASE,
-    COMBO_E_RELEASE,
+    COMBO_NONE,     // Nothing to do.
+    COMBO_DOWN,     // A combo was completed, send a NoteOn.
+    COMBO_RELEASE,  // The last key of the combo was released, send NoteOff.
 } combo_action_t;
 
+// Constants ------------------------------------------------------------------
+
+#define COMBO_MAX_SEQUENCES 8   // Key sequence combos.
+#define COMBO_MAX_CHORDS    4   // Keys-held-together combos.
+#define COMBO_MAX_STEPS     16  // Keys in a single sequence.
+
+// Sequence steps hold the key to press, with the top bit set on the last
+// step of a sequence.
+#define COMBO_ACCEPT 0x80
+
 // Globals ---------------------------------------------------------------------
 
 extern uint8_t g_combos_enable;
+extern uint8_t g_combo_note;  // Note of the last combo recognized.
 
 // Functions -------------------------------------------------------------------
 
 void combo_setup(void);
+void combo_load(void);
 combo_action_t combo_recognize(const uint16_t keydown,
                                const uint16_t keyup,
                                const uint16_t keystate);
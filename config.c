@@ -2,6 +2,7 @@
 #include <util/delay.h>
 #include <string.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 
 #include "config.h"
 #include "sysex.h"
@@ -14,15 +15,16 @@
 #include "eeprom.h"
 #include "expansion.h"
 #include "combo.h"
+#include "fader.h"
+#include "profile.h"
 #include "jumptoboot.h"
 
-// SysEx command constants
-#define SYSEX_COMMAND_PUSH_CONF 0x1
-#define SYSEX_COMMAND_PULL_CONF 0x2
-#define SYSEX_COMMAND_SYSTEM    0x3
-
 uint8_t g_auto_update = 0;
 
+// Counts every change of the settings, so a config tool can tell whether
+// a unit has the settings it last sent. Kept in the EEPROM.
+static uint16_t s_config_revision = 0;
+
 // Command structure
 typedef struct {
         // Message data                TAG
@@ -37,8 +39,53 @@ typedef struct {
         uint8_t combos;             // 8
         uint8_t multiplexer;        // 9 Not supported by Pro
 		uint8_t rotate;             // 10
+        uint8_t debounceMode;       // 11
+        uint8_t debouncePress;      // 12
+        uint8_t debounceRelease;    // 13
+        uint8_t faderSmoothing;     // 14
+        uint8_t faderFast;          // 15
+        uint8_t faderHysteresis;    // 16
+        uint8_t faderInterval;      // 17
+        uint8_t faderCurve[4];      // 18..21
 } tvtable_t;
-#define TV_TABLE_SIZE 11
+#define TV_TABLE_SIZE 22
+
+// Where each tag is saved in the EEPROM. Zero for the tags that the Pro
+// doesn't support, address zero is the layout version and never a setting.
+static const uint8_t s_tv_address[TV_TABLE_SIZE] PROGMEM = {
+    EE_MIDI_CHANNEL, EE_MIDI_VELOCITY, EE_KEY_KEYPRESS_LED, EE_KEY_FOURBANKS,
+    0, 0, EE_AUTO_UPDATE, EE_DEVICE_MODE, EE_COMBOS_ENABLE, 0,
+    EE_ROTATE_ENABLE, EE_DEBOUNCE_MODE, EE_DEBOUNCE_PRESS, EE_DEBOUNCE_RELEASE,
+    EE_FADER_SMOOTHING, EE_FADER_FAST, EE_FADER_HYSTERESIS, EE_FADER_INTERVAL,
+    EE_FADER_CURVE + 0, EE_FADER_CURVE + 1, EE_FADER_CURVE + 2, EE_FADER_CURVE + 3,
+};
+
+// The values each tag accepts, checked by a batch set.
+static const uint8_t s_tv_min[TV_TABLE_SIZE] PROGMEM = {
+    1, 0, 0, FOURBANKS_OFF,
+    0, 0, 0, TRAKTOR, 0, 0,
+    0, DEBOUNCE_MODE_BUFFER, 1, 1,
+    0, 0, 0, 0,
+    0, 0, 0, 0,
+};
+static const uint8_t s_tv_max[TV_TABLE_SIZE] PROGMEM = {
+    16, 127, 1, FOURBANKS_EXTERNAL,
+    0, 0, 1, ABLETON, 1, 0,
+    1, DEBOUNCE_MODE_COUNTER, DEBOUNCE_WINDOW_MAX, DEBOUNCE_WINDOW_MAX,
+    FADER_SMOOTHING_MAX, 127, 127, 127,
+    FADER_CURVES - 1, FADER_CURVES - 1, FADER_CURVES - 1, FADER_CURVES - 1,
+};
+
+static bool tv_tag_supported(const uint8_t tag)
+{
+    return tag < TV_TABLE_SIZE && pgm_read_byte(&s_tv_address[tag]);
+}
+
+static bool tv_value_valid(const uint8_t tag, const uint8_t value)
+{
+    return value >= pgm_read_byte(&s_tv_min[tag]) &&
+           value <= pgm_read_byte(&s_tv_max[tag]);
+}
 
 void tv_table_decode(tvtable_t* table, uint8_t* buffer, uint8_t size)
 {
@@ -53,40 +100,100 @@ void tv_table_decode(tvtable_t* table, uint8_t* buffer, uint8_t size)
     }
 }
 
+// Fill a table with the settings in use, so that tags which aren't sent
+// keep their current values.
+//
+static void tv_table_get(tvtable_t* table)
+{
+    memset(table, 0, sizeof(tvtable_t));
+    table->midiChannel     = g_midi_channel + 1;
+    table->midiVelocity    = g_midi_velocity;
+    table->keypressLeds    = g_led_keypress_enable;
+    table->fourBanksMode   = g_key_fourbanks_mode;
+    table->autoUpdate      = g_auto_update;
+    table->deviceMode      = g_device_mode;
+    table->combos          = g_combos_enable;
+    table->rotate          = g_rotate_enable;
+    table->debounceMode    = g_key_debounce_mode;
+    table->debouncePress   = g_key_debounce_press;
+    table->debounceRelease = g_key_debounce_release;
+    table->faderSmoothing  = g_fader_smoothing;
+    table->faderFast       = g_fader_fast;
+    table->faderHysteresis = g_fader_hysteresis;
+    table->faderInterval   = g_fader_interval;
+    for (uint8_t i=0; i<4; ++i) table->faderCurve[i] = g_fader_curve[i];
+}
+
+static void config_revision_save(void)
+{
+    eeprom_write(EE_CONFIG_REVISION, s_config_revision & 0xff);
+    eeprom_write(EE_CONFIG_REVISION + 1, s_config_revision >> 8);
+}
+
+void config_revision_bump (void)
+{
+    ++s_config_revision;
+    config_revision_save();
+}
+
+// Switch over to the settings in a table all in one go, then save the ones
+// that changed. The writes finish in the background. The table is left
+// holding the settings in use, which the configure calls may have pulled
+// back into range.
+//
+static void tv_table_apply(tvtable_t* table)
+{
+    tvtable_t old;
+    tv_table_get(&old);
+
+    // Change settings
+    g_midi_channel        = table->midiChannel - 1;
+    g_midi_velocity       = table->midiVelocity;
+    g_led_keypress_enable = table->keypressLeds;
+	g_key_fourbanks_mode  = table->fourBanksMode;
+    g_auto_update         = table->autoUpdate;
+    g_device_mode        = table->deviceMode;
+    g_combos_enable       = table->combos;
+	g_rotate_enable       = table->rotate;
+    g_key_debounce_mode    = table->debounceMode;
+    g_key_debounce_press   = table->debouncePress;
+    g_key_debounce_release = table->debounceRelease;
+    key_debounce_configure();
+    g_fader_smoothing      = table->faderSmoothing;
+    g_fader_fast           = table->faderFast;
+    g_fader_hysteresis     = table->faderHysteresis;
+    g_fader_interval       = table->faderInterval;
+    for (uint8_t i=0; i<4; ++i) g_fader_curve[i] = table->faderCurve[i];
+    fader_configure();
+    Midifighter_Configure();
+
+    // Only write the bytes that are different, an EEPROM write takes a few
+    // milliseconds and the cells wear out.
+    tv_table_get(table);
+    bool changed = false;
+    for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+        uint8_t value = ((uint8_t*)table)[tag];
+        if (!tv_tag_supported(tag) || value == ((uint8_t*)&old)[tag]) continue;
+        // The channel tag counts from one, the EEPROM from zero.
+        if (tag == 0) value -= 1;
+        eeprom_write(pgm_read_byte(&s_tv_address[tag]), value);
+        changed = true;
+    }
+    if (changed) config_revision_bump();
+}
+
 
 void sysExCmdPushConfig (SysEx_t* sysex, uint8_t* buffer)
 {
-	// First disable watch dog as EEPROM is slow to write to
-	wdt_disable();
-	
     tvtable_t config;
+    // Older config tools don't know about the newer settings, so keep the
+    // current ones unless they are sent.
+    tv_table_get(&config);
     tv_table_decode(&config, buffer, sysex->length-5);
+    tv_table_apply(&config);
 
-    // Change settings
-    g_midi_channel        = config.midiChannel - 1;
-    g_midi_velocity       = config.midiVelocity;
-    g_led_keypress_enable = config.keypressLeds;
-	g_key_fourbanks_mode  = config.fourBanksMode;
-    g_auto_update         = config.autoUpdate;
-    g_device_mode        = config.deviceMode;
-    g_combos_enable       = config.combos;
-	g_rotate_enable       = config.rotate;
-
-    // Save to EEPROM
-    eeprom_save_edits();
-
-    // Flash LEDs to signal new configuration
-    uint16_t state = 0x000f;
-    for (uint8_t i=4; i; --i) {
-            led_set_state(state);
-            _delay_ms(75);
-            led_set_state(0x0000);
-            _delay_ms(75);
-            state <<= 4;
-    }
-	
-	// Enable watchdog again
-	wdt_enable(WDTO_120MS);
+    // Flash LEDs to signal new configuration, one row at a time.
+    led_flash(0x000f, 4);
 }
 
 void send_config_data (void)
@@ -102,6 +209,17 @@ void send_config_data (void)
                                 0x07, g_device_mode,         // Software Mode
                                 0x08, g_combos_enable,       // combos enabled or disabled
 								0x0A, g_rotate_enable,
+                                0x0B, g_key_debounce_mode,   // debounce algorithm
+                                0x0C, g_key_debounce_press,  // press window (ms)
+                                0x0D, g_key_debounce_release,// release window (ms)
+                                0x0E, g_fader_smoothing,     // fader smoothing at rest
+                                0x0F, g_fader_fast,          // fader fast move size
+                                0x10, g_fader_hysteresis,    // fader hysteresis
+                                0x11, g_fader_interval,      // fader CC interval (ms)
+                                0x12, g_fader_curve[0],      // fader response curves
+                                0x13, g_fader_curve[1],
+                                0x14, g_fader_curve[2],
+                                0x15, g_fader_curve[3],
                                 0xf7};
     midi_stream_sysex(sizeof(payload), payload);
 }
@@ -114,6 +232,73 @@ void sysExCmdPullConfig (SysEx_t* sysex, uint8_t* command)
     }
 }
 
+// Send the settings asked for by a batch get, or all of them if none were.
+//
+static void config_send_values (tvtable_t* table, uint8_t* tags, uint8_t count)
+{
+    uint8_t payload[SYSEX_HEADER_SIZE + 5 + 2 * TV_TABLE_SIZE];
+    uint8_t size = 0;
+    payload[size++] = 0xf0;
+    payload[size++] = 0x00;
+    payload[size++] = MANUFACTURER_ID >> 8;
+    payload[size++] = MANUFACTURER_ID & 0x7f;
+    payload[size++] = SYSEX_COMMAND_CONFIG;
+    payload[size++] = CONFIG_SYSEX_VALUES;
+    payload[size++] = s_config_revision >> 14;
+    payload[size++] = (s_config_revision >> 7) & 0x7f;
+    payload[size++] = s_config_revision & 0x7f;
+    for (uint8_t tag=0; tag<TV_TABLE_SIZE; ++tag) {
+        bool wanted = (count == 0);
+        for (uint8_t i=0; i<count && !wanted; ++i) wanted = (tags[i] == tag);
+        if (!wanted || !tv_tag_supported(tag)) continue;
+        payload[size++] = tag;
+        payload[size++] = ((uint8_t*)table)[tag] & 0x7f;
+    }
+    payload[size++] = 0xf7;
+    midi_stream_sysex(size, payload);
+}
+
+// Batched get and set of the settings, see config.h. Unlike a push, a set
+// only touches the tags it carries and answers with one short ack, so a
+// tool can configure a row of units without waiting on each one.
+//
+static void sysExCmdConfig (SysEx_t* sysex, uint8_t* payload)
+{
+    uint8_t size = sysex_payload_size(sysex);
+    if (size < 1) return;
+    uint8_t count = size - 1;
+
+    tvtable_t config;
+    tv_table_get(&config);
+
+    if (payload[0] == CONFIG_SYSEX_GET) {
+        config_send_values(&config, payload + 1, count);
+    } else if (payload[0] == CONFIG_SYSEX_SET) {
+        // Check the whole batch before changing anything.
+        uint8_t status = (count & 1) ? CONFIG_STATUS_BAD_TAG : CONFIG_STATUS_OK;
+        for (uint8_t i=1; i<size && status == CONFIG_STATUS_OK; i+=2) {
+            if (!tv_tag_supported(payload[i])) {
+                status = CONFIG_STATUS_BAD_TAG;
+            } else if (!tv_value_valid(payload[i], payload[i + 1])) {
+                status = CONFIG_STATUS_BAD_VALUE;
+            } else {
+                ((uint8_t*)&config)[payload[i]] = payload[i + 1];
+            }
+        }
+        if (status == CONFIG_STATUS_OK) tv_table_apply(&config);
+
+        uint8_t ack[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                                SYSEX_COMMAND_CONFIG,
+                                CONFIG_SYSEX_ACK,
+                                status,
+                                s_config_revision >> 14,
+                                (s_config_revision >> 7) & 0x7f,
+                                s_config_revision & 0x7f,
+                                0xf7};
+        midi_stream_sysex(sizeof(ack), ack);
+    }
+}
+
 void enter_bootloader_mode (void);
 void enter_menu_mode (void);
 void factory_reset (void);
@@ -122,8 +307,7 @@ void sysExCmdSystem (SysEx_t* sysex, uint8_t* command)
 {
     if (*command == 0)
     {
-        // Menu mode
-		wdt_disable();
+        // Menu mode. It runs alongside the USB, so the watchdog stays on.
         enter_menu_mode();
 
     } else if (*command == 1)
@@ -132,21 +316,68 @@ void sysExCmdSystem (SysEx_t* sysex, uint8_t* command)
 		wdt_disable();
         //enter_bootloader_mode();
 		led_set_state(0xA5A5);
+		// Don't leave settings half written.
+		eeprom_flush();
 		Jump_To_Bootloader();
     } else if (*command == 2)
     {
         // Factory reset EEPROM
-		wdt_disable();
         factory_reset();
-		wdt_enable(WDTO_120MS);
     }
 }
 
+#ifdef PROFILE
+// Send the profiler timings, one message per stage, each value split into
+// three 7-bit bytes, high bits first:
+//
+//   F0 00 mid mid 05 01 stage cycles_per_tick min[3] avg[3] max[3] F7
+//
+void send_profile_data (void)
+{
+    for (uint8_t i=0; i<PROFILE_STAGES; ++i) {
+        // The key read interrupt updates its entry behind our back.
+        uint8_t sreg = SREG;
+        cli();
+        profile_stat_t stat = g_profile[i];
+        SREG = sreg;
+
+        uint16_t avg = stat.count ? stat.total / stat.count : 0;
+        if (!stat.count) stat.min = 0;
+        uint8_t payload[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                                    SYSEX_COMMAND_PROFILE,
+                                    0x01, // 0x0 = request, 0x1 = response
+                                    i, TIMER_TICK_CYCLES,
+                                    stat.min >> 14, (stat.min >> 7) & 0x7f, stat.min & 0x7f,
+                                    avg >> 14, (avg >> 7) & 0x7f, avg & 0x7f,
+                                    stat.max >> 14, (stat.max >> 7) & 0x7f, stat.max & 0x7f,
+                                    0xf7};
+        midi_stream_sysex(sizeof(payload), payload);
+    }
+}
+
+void sysExCmdProfile (SysEx_t* sysex, uint8_t* command)
+{
+    if (*command == 0x0) { // Received request
+        send_profile_data();
+    } else if (*command == 0x2) { // Start timing again from scratch
+        profile_reset();
+    }
+}
+#endif // PROFILE
+
 
 void config_setup (void)
 {
+    // Erased EEPROM reads as revision 0xffff, the next change makes it zero.
+    s_config_revision = eeprom_read(EE_CONFIG_REVISION) |
+        (eeprom_read(EE_CONFIG_REVISION + 1) << 8);
+
     // Install SysEx command handlers
     sysex_install(SYSEX_COMMAND_PUSH_CONF, sysExCmdPushConfig);
     sysex_install(SYSEX_COMMAND_PULL_CONF, sysExCmdPullConfig);
     sysex_install(SYSEX_COMMAND_SYSTEM,    sysExCmdSystem);
+    sysex_install(SYSEX_COMMAND_CONFIG,    sysExCmdConfig);
+#ifdef PROFILE
+    sysex_install(SYSEX_COMMAND_PROFILE,   sysExCmdProfile);
+#endif
 }
@@ -23,11 +23,40 @@
 #ifndef _CONFIG_H_INCLUDED
 #define _CONFIG_H_INCLUDED
 
+// Batched settings, SysEx command 0xB. A get lists the tags wanted (none for
+// all of them) and is answered with the revision and the tag value pairs:
+//
+//   F0 00 mid mid 0B 00 tag ... F7
+//   F0 00 mid mid 0B 01 rev[3] tag value ... F7
+//
+// A set carries tag value pairs for just the settings to change. Either all
+// of them are applied or, if any tag is unknown or any value is out of range,
+// none are. The ack gives the status and the revision after the change:
+//
+//   F0 00 mid mid 0B 02 tag value ... F7
+//   F0 00 mid mid 0B 03 status rev[3] F7
+//
+// The tags are the same as for SYSEX_COMMAND_PUSH_CONF.
+#define CONFIG_SYSEX_GET      0x0
+#define CONFIG_SYSEX_VALUES   0x1
+#define CONFIG_SYSEX_SET      0x2
+#define CONFIG_SYSEX_ACK      0x3
+
+#define CONFIG_STATUS_OK        0x0
+#define CONFIG_STATUS_BAD_TAG   0x1  // Nothing was changed.
+#define CONFIG_STATUS_BAD_VALUE 0x2  // Nothing was changed.
+
 // SysEx functions -----------------------------------------------
 
 void config_setup (void);
 
 void send_config_data (void);
+
+// Count a change of the settings, made somewhere other than over SysEx.
+void config_revision_bump (void);
+
+// Pick the task handlers for the settings, see midifighterpro.c.
+void Midifighter_Configure(void);
 extern uint8_t g_auto_update;
 
 #endif // _SYSEX_H_INCLUDED
@@ -27,6 +27,34 @@
 
 #define DEBOUNCE_BUFFER_SIZE 10
 
+// Debounce modes
+#define DEBOUNCE_MODE_BUFFER  0  // AND together the whole debounce buffer
+#define DEBOUNCE_MODE_COUNTER 1  // Vertical counters, asymmetric windows
+
+// Key scan rate, set with -DKEY_SCAN_HZ=. The debounce windows are in
+// milliseconds whatever the rate, so faster scans need longer counters.
+#ifndef KEY_SCAN_HZ
+#define KEY_SCAN_HZ 1000
+#endif
+#if KEY_SCAN_HZ == 1000
+#define KEY_SCAN_SHIFT 0
+#elif KEY_SCAN_HZ == 2000
+#define KEY_SCAN_SHIFT 1
+#elif KEY_SCAN_HZ == 4000
+#define KEY_SCAN_SHIFT 2
+#else
+#error "KEY_SCAN_HZ must be 1000, 2000 or 4000"
+#endif
+#define KEY_SCANS_PER_MS (1 << KEY_SCAN_SHIFT)
+
+// Once the host is sending Start Of Frame packets, the scan that finishes
+// each millisecond is locked to this long before the next USB frame starts
+// (see key_frame_sync()).
+#define KEY_FRAME_LEAD_US 200
+
+#define DEBOUNCE_PLANES     (4 + KEY_SCAN_SHIFT)  // Bits per vertical counter
+#define DEBOUNCE_WINDOW_MAX 15  // Longest debounce window (ms)
+
 #define SPI_MISO   _BV(PB3)  // SPI master in slave out
 #define SPI_MOSI   _BV(PB2)  // SPI master out slave in
 #define SPI_CLOCK  _BV(PB1)  // SPI clock pin
@@ -46,6 +74,11 @@
 #define EXP_KEY_CLOCK _BV(PD2)  // digital port 1 (shared out)
 #define EXP_LED_CLOCK _BV(PD2)  // digital port 1 (shared out)
 
+// Select lines of the analog multiplexers, digital port 1..3 as a 3-bit
+// number (see MULTIPLEX_ANALOG in expansion.h).
+#define EXP_MUX_SELECT (_BV(PD2) | _BV(PD3) | _BV(PD4))
+#define EXP_MUX_SELECT_SHIFT 2
+
 // #define EXP_DIGITAL0 _BV(PD2)  // Expansion port digital pin 1
 // #define EXP_DIGITAL1 _BV(PD3)  // Expansion port digital pin 2
 // #define EXP_DIGITAL2 _BV(PD4)  // Expansion port digital pin 3
@@ -72,7 +105,7 @@
 // Should be the date of this firmware release, in hex, in the following format: 0xYYYYMMDD
 #define DEVICE_VERSION  0x20120816
 
-#define EEPROM_VERSION  6  // Increment this when the eeprom layout requires
+#define EEPROM_VERSION  9  // Increment this when the eeprom layout requires
                            // resetting to the factory default.
 
 // EEPROM memory locations of persistent settings
@@ -89,6 +122,33 @@
 #define EE_COMBOS_ENABLE       0x000a  // Combos enabled (1-bit)
 #define EE_MULTIPLEXER_ENABLE  0x000b  // Multiplexer connected to A1 and D1,D2,D3 (1-bit)
 #define EE_ROTATE_ENABLE       0x000c  // Enables device rotation 
+#define EE_DEBOUNCE_MODE       0x000d  // Key debounce algorithm (0..1)
+#define EE_DEBOUNCE_PRESS      0x000e  // Samples before a press (1..15)
+#define EE_DEBOUNCE_RELEASE    0x000f  // Samples before a release (1..15)
+#define EE_FADER_SMOOTHING     0x0010  // Fader average shift at rest (0..6)
+#define EE_FADER_FAST          0x0011  // Fader move that speeds up the average
+#define EE_FADER_HYSTERESIS    0x0012  // Fader hysteresis in ADC counts
+#define EE_FADER_INTERVAL      0x0013  // Minimum ms between fader CCs
+#define EE_FADER_CURVE         0x0014  // Response curve of each port (NUM_ANALOG_PORTS)
+#define EE_CONFIG_REVISION     0x0018  // Settings changes, see config.c (2 bytes)
+
+// EEPROM memory locations of the reset counters (0x20..0x23), see telemetry.c
+#define EE_TELEMETRY_WDT_RESETS 0x0020  // Watchdog resets (2 bytes)
+#define EE_TELEMETRY_BOR_RESETS 0x0022  // Brown-out resets (2 bytes)
+
+// EEPROM memory locations of the combo definitions (0x30..0xd7), see combo.c
+#define EE_COMBO_VALID         0x0030  // Combos below are complete (magic)
+#define EE_COMBO_SEQUENCES     0x0031  // Number of key sequences
+#define EE_COMBO_CHORDS        0x0032  // Number of chords
+#define EE_COMBO_STEP_COUNT    0x0033  // Number of sequence steps in use
+#define EE_COMBO_NOTES         0x0034  // Note of each sequence (8 bytes)
+#define EE_COMBO_START         0x003c  // First new step of each sequence (8)
+#define EE_COMBO_BRANCH        0x0044  // Step each sequence branches off (8)
+#define EE_COMBO_CHORD         0x004c  // Mask lo, hi and note of each chord (12)
+#define EE_COMBO_STEPS         0x0058  // Key of each sequence step (128 bytes)
+
+// EEPROM memory location of the custom fader curve (0x180..0x1ff), see fader.c
+#define EE_FADER_CURVE_TABLE   0x0180  // CC value for each fader value (128)
 
 // SysEx MIDI message manufacturer ID
 #define MANUFACTURER_ID 0x0179
@@ -32,44 +32,149 @@
 #include "constants.h"
 #include "config.h"
 #include "combo.h"
+#include "fader.h"
 
 // EEPROM functions ------------------------------------------------------------
 
-// Write an 8-bit value to EEPROM memory.
+// Writing a byte takes the EEPROM about 3.4ms, far too long to sit waiting
+// for while there are keys to read, so writes are queued and the EE_READY
+// interrupt starts each one as the last finishes. A byte that already holds
+// the value being written is skipped, so saving every setting only costs
+// the time of the ones that changed.
+
+typedef struct {
+    uint16_t address;
+    uint8_t data;
+} eeprom_write_t;
+
+#define EEPROM_QUEUE_MASK (EEPROM_QUEUE_SIZE - 1)
+
+static eeprom_write_t s_queue[EEPROM_QUEUE_SIZE];
+static volatile uint8_t s_queue_head = 0;  // Next free slot.
+static volatile uint8_t s_queue_tail = 0;  // Oldest write not yet started.
+
+// Start the oldest queued write that changes anything. Must be called with
+// interrupts disabled and the EEPROM idle. Returns false if the queue ran
+// out before anything needed writing.
+//
+static bool eeprom_queue_service(void)
+{
+    while (s_queue_tail != s_queue_head) {
+        eeprom_write_t* write = &s_queue[s_queue_tail];
+        s_queue_tail = (s_queue_tail + 1) & EEPROM_QUEUE_MASK;
+        // Compare with what is there already.
+        EEAR = write->address;
+        EECR |= (1<<EERE);
+        if (EEDR == write->data) continue;
+        EEDR = write->data;
+        // Write logical one to EEMPE (Master Program Enable) to allow us to
+        // write, then within 4 cycles initiate the eeprom write by writing
+        // to the EEPE (Program Enable) strobe.
+        EECR |= (1<<EEMPE);
+        EECR |= (1<<EEPE);
+        return true;
+    }
+    return false;
+}
+
+// The EEPROM is ready for another write. This keeps firing for as long as
+// EERIE is set and no write is running, so turn it off once the queue is
+// empty.
+//
+ISR(EE_READY_vect)
+{
+    if (!eeprom_queue_service()) {
+        EECR &= ~(1<<EERIE);
+    }
+}
+
+// Queue an 8-bit value to be written to EEPROM memory. Returns straight
+// away unless the queue is full, in which case it waits for room.
 //
 void eeprom_write(uint16_t address, uint8_t data)
 {
-    // Wait for completion of previous write
-    while(EECR & (1<<EEPE)) {}
-    // Set up Address and Data Registers
-    EEAR = address & 0x0fff; // mask out 512 bytes
-    EEDR = data;
-    // This next critical section cannot have an interrupt occur between the
-    // two writes or the write will fail and we will lose the information,
-    // so disable all interrupts for a moment.
-    cli();
-    // Write logical one to EEMPE (Master Program Enable) to allow us to
-    // write.
-    EECR |= (1<<EEMPE);
-    // Then within 4 cycles, initiate the eeprom write by writing to the
-    // EEPE (Program Enable) strobe.
-    EECR |= (1<<EEPE);
-    // Reenable interrupts.
-    sei();
+    address &= 0x0fff; // mask out 512 bytes
+    for (;;) {
+        uint8_t sreg = SREG;
+        cli();
+        uint8_t next = (s_queue_head + 1) & EEPROM_QUEUE_MASK;
+        if (next != s_queue_tail) {
+            s_queue[s_queue_head].address = address;
+            s_queue[s_queue_head].data = data;
+            s_queue_head = next;
+            EECR |= (1<<EERIE);
+            SREG = sreg;
+            return;
+        }
+        // Full. If interrupts were off when we were called nothing else is
+        // going to make room, so push the next write through ourselves.
+        if (!(sreg & (1<<SREG_I))) {
+            while(EECR & (1<<EEPE)) {}
+            eeprom_queue_service();
+        }
+        SREG = sreg;
+        // Otherwise the interrupt makes room as each write ends.
+        while(EECR & (1<<EEPE)) {}
+    }
 }
 
-// Read an 8-bit value from EEPROM memory.
+// Read an 8-bit value from EEPROM memory, including any write to it that
+// is still waiting in the queue.
 //
 uint8_t eeprom_read(uint16_t address)
 {
-    // Wait for completion of previous write
+    address &= 0x0fff;
+    uint8_t sreg = SREG;
+    cli();
+
+    // The newest queued write to this address is what it will hold.
+    uint8_t i = s_queue_head;
+    while (i != s_queue_tail) {
+        i = (i - 1) & EEPROM_QUEUE_MASK;
+        if (s_queue[i].address == address) {
+            uint8_t data = s_queue[i].data;
+            SREG = sreg;
+            return data;
+        }
+    }
+
+    // The EEPROM can't be read while a write is running. Hold off the
+    // queue while we wait (with interrupts on) or the interrupt would start
+    // the next write the moment this one finished.
+    uint8_t queued = EECR & (1<<EERIE);
+    EECR &= ~(1<<EERIE);
+    SREG = sreg;
     while(EECR & (1<<EEPE)) {}
+    cli();
     // Set up address register
     EEAR = address;
     // Start eeprom read by writing EERE (Read Enable)
     EECR |= (1<<EERE);
+    uint8_t data = EEDR;
+    EECR |= queued;
+    SREG = sreg;
     // Return data from Data Register
-    return EEDR;
+    return data;
+}
+
+// Are there writes still to finish?
+//
+bool eeprom_busy(void)
+{
+    return s_queue_tail != s_queue_head || (EECR & (1<<EEPE));
+}
+
+// Wait for every queued write to reach the EEPROM, e.g. before a reset or
+// jumping to the bootloader.
+//
+void eeprom_flush(void)
+{
+    while (eeprom_busy()) {
+        // With interrupts off the EE_READY interrupt can't do it for us.
+        if (!(SREG & (1<<SREG_I)) && !(EECR & (1<<EEPE))) {
+            eeprom_queue_service();
+        }
+    }
 }
 
 
@@ -87,6 +192,11 @@ void eeprom_setup(void)
     // If our EEPROM layout has changed, reset everything.
     if (eeprom_read(EE_EEPROM_VERSION) != EEPROM_VERSION) {
         eeprom_factory_reset();
+
+        // Flash to signal the reset, once the LEDs are running.
+        led_anim_push(0xffff, 0, 100, 0);
+        led_anim_push(0x0000, 0, 100, 0);
+        led_anim_push(0xffff, 0, 100, 0);
     }
 
     // Read the EEPROM into the global settings.
@@ -102,10 +212,21 @@ void eeprom_setup(void)
     g_combos_enable = eeprom_read(EE_COMBOS_ENABLE);
     //g_multiplexer_enable = eeprom_read(EE_MULTIPLEXER_ENABLE);
 	g_rotate_enable = eeprom_read(EE_ROTATE_ENABLE);
+    g_key_debounce_mode = eeprom_read(EE_DEBOUNCE_MODE);
+    g_key_debounce_press = eeprom_read(EE_DEBOUNCE_PRESS);
+    g_key_debounce_release = eeprom_read(EE_DEBOUNCE_RELEASE);
+    g_fader_smoothing = eeprom_read(EE_FADER_SMOOTHING);
+    g_fader_fast = eeprom_read(EE_FADER_FAST);
+    g_fader_hysteresis = eeprom_read(EE_FADER_HYSTERESIS);
+    g_fader_interval = eeprom_read(EE_FADER_INTERVAL);
+    for (uint8_t i=0; i<NUM_ANALOG_PORTS; ++i) {
+        g_fader_curve[i] = eeprom_read(EE_FADER_CURVE + i);
+    }
 }
 
 // Used by the menu system, if we have edited any of the global values then
-// save them off to the EEPROM.
+// save them off to the EEPROM. The writes are queued and only the settings
+// that changed are written, so this returns almost at once.
 //
 void eeprom_save_edits(void)
 {
@@ -120,6 +241,16 @@ void eeprom_save_edits(void)
     eeprom_write(EE_COMBOS_ENABLE, g_combos_enable);
     //eeprom_write(EE_MULTIPLEXER_ENABLE, g_multiplexer_enable);
 	eeprom_write(EE_ROTATE_ENABLE, g_rotate_enable);
+    eeprom_write(EE_DEBOUNCE_MODE, g_key_debounce_mode);
+    eeprom_write(EE_DEBOUNCE_PRESS, g_key_debounce_press);
+    eeprom_write(EE_DEBOUNCE_RELEASE, g_key_debounce_release);
+    eeprom_write(EE_FADER_SMOOTHING, g_fader_smoothing);
+    eeprom_write(EE_FADER_FAST, g_fader_fast);
+    eeprom_write(EE_FADER_HYSTERESIS, g_fader_hysteresis);
+    eeprom_write(EE_FADER_INTERVAL, g_fader_interval);
+    for (uint8_t i=0; i<NUM_ANALOG_PORTS; ++i) {
+        eeprom_write(EE_FADER_CURVE + i, g_fader_curve[i]);
+    }
 }
 
 // Return the EEPROM values to their factory default values, erasing any
@@ -132,6 +263,7 @@ void eeprom_factory_reset(void)
 
     eeprom_write(EE_EEPROM_VERSION,      EEPROM_VERSION); // This layout version
     eeprom_write(EE_FIRST_BOOT_CHECK,    0xff); // No h/w check on first boot
+    eeprom_write(EE_COMBO_VALID,         0x00); // Default combos
 
     // Reset the global variables to their default versions, as they were
     // read with their old values before the factory reset happened and they
@@ -150,16 +282,18 @@ void eeprom_factory_reset(void)
     g_combos_enable = 1;                    // Combos (on)
     //g_multiplexer_enable = 0;               // Multiplexer (off)
 	g_rotate_enable = 0;
-    // Save changes
+    g_key_debounce_mode = DEBOUNCE_MODE_COUNTER;  // Vertical counters
+    g_key_debounce_press = 1;               // Press on first sample (1ms)
+    g_key_debounce_release = 10;            // Release after 10ms stable
+    g_fader_smoothing = 3;                  // Fader average 1/8 at rest
+    g_fader_fast = 16;                      // Speed up on moves of 16+
+    g_fader_hysteresis = 4;                 // Half a CC step of hysteresis
+    g_fader_interval = 2;                   // At most one CC per 2ms
+    for (uint8_t i=0; i<NUM_ANALOG_PORTS; ++i) {
+        g_fader_curve[i] = FADER_CURVE_LINEAR;  // Straight line curves
+    }
+    // Save changes. The callers flash the LEDs to signal success.
     eeprom_save_edits();
-
-    // Flash to signal success.
-    led_set_state(0xffff);
-    _delay_ms(100);
-    led_set_state(0x0000);
-    _delay_ms(100);
-    led_set_state(0xffff);
-    _delay_ms(100);
 }
 
 // -----------------------------------------------------------------------------
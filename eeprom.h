@@ -23,10 +23,25 @@
 #ifndef _EEPROM_H_INCLUDED
 #define _EEPROM_H_INCLUDED
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+
+// Writes waiting for the EEPROM, see eeprom_write(). There's room for the
+// biggest batch, a factory reset and its revision bump (24 writes), so
+// saving the settings never has to wait.
+#define EEPROM_QUEUE_SIZE 32  // Must be a power of two.
+
+// Interrupt service routine ---------------------------------------------------
+
+ISR(EE_READY_vect);
+
 // EEPROM functions -----------------------------------------------
 
 void eeprom_write(uint16_t address, uint8_t data);
 uint8_t eeprom_read(uint16_t address);
+bool eeprom_busy(void);
+void eeprom_flush(void);
 void eeprom_factory_reset(void);
 void eeprom_setup(void);
 void eeprom_save_edits(void);
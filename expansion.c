@@ -20,8 +20,10 @@
 //
 // rgreen 2009-11-24
 
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
 #include "modeldefs.h"  // NOTE: include this first.
 
@@ -42,11 +44,50 @@ uint8_t g_exp_key_prev_state;
 uint8_t g_exp_key_down;
 uint8_t g_exp_key_up;
 
+// Vertical counter debounce state for the expansion port inputs, sharing
+// the debounce windows used for the main keys.
+static debounce_t s_exp_key_debounce;
+
 // Array of previous ADC values for the analog reads, each one the full
 // 10-bit range so we can track the lower bits and add hysteresis into
-// the value changes.
+// the value changes. Kept up to date by the background scan, see
+// exp_adc_fetch().
 uint16_t g_exp_analog_prev[NUM_ANALOG];
 
+// Background ADC scan state. The scan is kicked off from the key read timer
+// interrupt and then stepped one SPI byte at a time by the SPI transfer
+// complete interrupt. Each visit to an input takes EXP_ADC_SAMPLES readings
+// and publishes their average for the main loop, see exp_adc_visit_next()
+// for which input gets visited.
+#if NUM_ANALOG > 16
+typedef uint32_t exp_adc_mask_t;
+#elif NUM_ANALOG > 8
+typedef uint16_t exp_adc_mask_t;
+#else
+typedef uint8_t exp_adc_mask_t;
+#endif
+
+static volatile uint8_t s_adc_input = 0;     // input being converted
+static volatile uint8_t s_adc_byte = 0;      // byte of the 3-byte transfer
+static uint8_t s_adc_topbyte;                // first data byte received
+static uint8_t s_adc_samples = 0;            // readings in the accumulator
+static uint16_t s_adc_accum = 0;             // running sum of this visit
+static uint8_t s_adc_visits = 0;             // visits left this millisecond
+static uint8_t s_adc_wait[NUM_ANALOG];       // ms until each input is due
+static uint8_t s_adc_active[NUM_ANALOG];     // fast visits left after a move
+
+// Expansion port LEDs. The main loop sets the state it wants and the key
+// read interrupt shifts it out straight after reading the keys, as the two
+// chains share the clock and data lines.
+static volatile uint8_t s_exp_led_state = 0;  // wanted by the main loop
+#ifndef MULTIPLEX_ANALOG
+static uint8_t s_exp_led_sent = 0xff;         // last shifted out
+#endif
+
+// Inputs with a new average in g_exp_analog_prev[] since the main loop last
+// looked, one bit each.
+static volatile exp_adc_mask_t s_adc_fresh = 0;
+
 
 // Functions -----------------------------------------------------------------
 
@@ -66,6 +107,7 @@ void exp_setup()
     for (uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
         g_exp_key_debounce_buffer[i] = 0;
     }
+    memset(&s_exp_key_debounce, 0, sizeof(s_exp_key_debounce));
 
     // Setup ADC
     // ---------
@@ -74,20 +116,87 @@ void exp_setup()
     DDRB |= ADC_SELECT;
     // Start with the ADC chip disabled (pin high)
     PORTB |= ADC_SELECT;
-    // Read the four analog ports to generate an initial set of "previous"
+#ifdef MULTIPLEX_ANALOG
+    // The multiplexer select lines are driven by the ADC scan instead.
+    DDRD |= EXP_MUX_SELECT;
+#endif
+    // Read the analog inputs to generate an initial set of "previous"
     // values that we will be testing against.
     for (uint8_t i=0; i<NUM_ANALOG; ++i) {
         g_exp_analog_prev[i] = exp_adc_read(i);
     }
 
+    // Start the background scan with nothing due, spreading the first
+    // visits out so that they don't all fall on the same millisecond.
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
+        s_adc_wait[i] = i % EXP_ADC_FAST_MS;
+        s_adc_active[i] = 0;
+    }
+    s_adc_samples = 0;
+    s_adc_accum = 0;
+    s_adc_input = NUM_ANALOG - 1;
+    s_adc_fresh = 0;
+
 }
 
+#ifndef MULTIPLEX_ANALOG
+// Shift a state out to the expansion port LEDs' 74HC595. Only called from
+// the key read interrupt, so nothing else can be using the lines.
+//
+static void exp_write_leds(uint8_t state)
+{
+    // set the EXP_LED_BIT to an output, no pullup.
+    DDRD |= EXP_LED_BIT;
+
+    // Start with the latch low.
+    PORTD &= ~EXP_LED_LATCH;
+    // Start with the clock high.
+    PORTD |= EXP_LED_CLOCK;
+
+    // loop over external keys setting their LEDs.
+    uint8_t bit = 0x80;
+    for (uint8_t i=0; i<8; ++i) {
+        // set an LED
+        if (state & bit) {
+            PORTD |= EXP_LED_BIT;
+        } else {
+            PORTD &= ~EXP_LED_BIT;
+        }
+
+        // clock the bit into the LED controller on a falling edge.
+        PORTD &= ~EXP_LED_CLOCK;
+        PORTD |= EXP_LED_CLOCK;
+
+        // next bit
+        bit >>= 1;
+    }
+
+    // latch the result with a rising edge
+    PORTD |= EXP_LED_LATCH;
+    // leave the latch low
+    PORTD &= ~EXP_LED_LATCH;
+
+    s_exp_led_sent = state;
+}
+#endif
+
 // This function is designed to be used inside the key-read interrupt
 // service routine, so it has to be as fast as possible and make no
-// assumptions about the state of any hardware it uses.
+// assumptions about the state of any hardware it uses. Returns the
+// debounced state of the inputs.
 //
-void exp_buffer_digital_inputs(void)
+// The expansion LEDs are updated here too, in the same visit to the port,
+// but only when exp_set_key_led() has asked for something new. The
+// debounce buffer only takes a sample when ms_tick is set, so it covers the
+// same time at any scan rate.
+//
+uint8_t exp_buffer_digital_inputs(bool ms_tick)
 {
+#ifdef MULTIPLEX_ANALOG
+    // The lines belong to the multiplexers, there are no keys or LEDs.
+    (void)ms_tick;
+    return 0;
+#else
     // Where to write the next value in the ring buffer.
     static uint8_t ext_buffer_pos = 0;
 
@@ -119,6 +228,11 @@ void exp_buffer_digital_inputs(void)
         bit >>= 1;
     }
 
+    uint8_t leds = s_exp_led_state;
+    if (leds != s_exp_led_sent) {
+        exp_write_leds(leds);
+    }
+
 #ifdef REORDER_EXT_KEYS
     // Reorder bits | 3 | 1 | into  | 1 | 2 |
     //              | 4 | 2 |       | 3 | 4 |
@@ -130,8 +244,19 @@ void exp_buffer_digital_inputs(void)
     value = temp;
 #endif
 
-    g_exp_key_debounce_buffer[ext_buffer_pos] = value;
-    ext_buffer_pos = (ext_buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+    if (g_key_debounce_mode == DEBOUNCE_MODE_COUNTER) {
+        return (uint8_t)key_debounce_update(&s_exp_key_debounce, value);
+    }
+    if (ms_tick) {
+        g_exp_key_debounce_buffer[ext_buffer_pos] = value;
+        ext_buffer_pos = (ext_buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+    }
+    uint8_t state = 0xff;
+    for (uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
+        state &= g_exp_key_debounce_buffer[i];
+    }
+    return state;
+#endif
 }
 
 // Generate a debounced read of the digital input ports. For more on how
@@ -139,6 +264,12 @@ void exp_buffer_digital_inputs(void)
 //
 uint8_t exp_key_read(void)
 {
+    if (g_key_debounce_mode == DEBOUNCE_MODE_COUNTER) {
+        // Only the low byte of the counter state is used, so this read
+        // can't be torn by the interrupt.
+        g_exp_key_state = (uint8_t)s_exp_key_debounce.state;
+        return g_exp_key_state;
+    }
     g_exp_key_state = 0xff;
     for(uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
         g_exp_key_state &= g_exp_key_debounce_buffer[i];
@@ -162,7 +293,21 @@ void exp_key_calc(void)
 
 // Analog ---------------------------------------------------------------------
 
-// Get the 10-bit value from one of the four analog channels.
+// Point the multiplexers at an input. The plain ports don't care.
+//
+static inline void exp_mux_select(uint8_t input)
+{
+#ifdef MULTIPLEX_ANALOG
+    if (input < EXP_MUX_PORTS * EXP_MUX_INPUTS) {
+        PORTD = (PORTD & ~EXP_MUX_SELECT) |
+            ((input % EXP_MUX_INPUTS) << EXP_MUX_SELECT_SHIFT);
+    }
+#else
+    (void)input;
+#endif
+}
+
+// Get the 10-bit value from one of the analog inputs.
 // The SPI protocol consists of sending and receiving three bytes:
 //
 //             S E N D            R E A D
@@ -180,8 +325,12 @@ void exp_key_calc(void)
 //  a-j = the 10 bit ADC value, note the leading zero.
 //  .   = don't care, do not use, could be anything.
 //
-uint16_t exp_adc_read(uint8_t channel)
+uint16_t exp_adc_read(uint8_t input)
 {
+    // Wait for any background conversion to finish and keep the scanner
+    // off the bus until we're done.
+    spi_acquire();
+
     // Disable the LED controller by making sure it's latch is low. The LED
     // and ADC chips share the same SPI data and clock lines, so it's
     // essential to make sure the LED driver is not listening to the data
@@ -190,7 +339,8 @@ uint16_t exp_adc_read(uint8_t channel)
 
     // single channel reads only (no differential) and we select the ADC
     // channel here.
-    uint8_t byte2 = 0b10000000 | ((channel & 0x03) << 4);
+    uint8_t byte2 = 0b10000000 | ((EXP_ANALOG_PORT(input) & 0x03) << 4);
+    exp_mux_select(input);
 
     // Enable the ADC chip by bringing the select line low.
     PORTB &= ~ADC_SELECT;
@@ -202,71 +352,216 @@ uint16_t exp_adc_read(uint8_t channel)
     uint8_t lowbyte = spi_transmit(0b00000000);
     // Put the ADC chip back into hibernation by pulling the select pin high.
     PORTB |= ADC_SELECT;
+    spi_release();
     // Mask out the "don't care" bits and return the 10-bit value including
     // the leading zero at bit 11.
     return ((topbyte & 0x07) << 8) | lowbyte;
 }
 
-// ---------------------------------------------------------------------------
+// Pick the next input to visit, while this millisecond's budget lasts.
+// Inputs come round in turn once their wait is over, and an input that is
+// being moved goes ahead of the ones that are merely due, so turning a knob
+// isn't held up by all the others sitting still. Returns false if there's
+// nothing to do.
+//
+static bool exp_adc_visit_next(void)
+{
+    if (!s_adc_visits) return false;
+
+    uint8_t input = s_adc_input;
+    uint8_t due = NUM_ANALOG;
+    for (uint8_t n=0; n<NUM_ANALOG; ++n) {
+        if (++input >= NUM_ANALOG) input = 0;
+        if (s_adc_wait[input]) continue;
+        if (s_adc_active[input]) {
+            due = input;
+            break;
+        }
+        if (due == NUM_ANALOG) due = input;
+    }
+    if (due == NUM_ANALOG) return false;
 
-void exp_set_key_led(uint8_t state)
+    --s_adc_visits;
+    s_adc_input = due;
+    return true;
+}
+
+// Start a conversion of the input being visited. The three byte exchange
+// is the same as exp_adc_read() above, except each byte is sent from the
+// SPI transfer complete interrupt so the CPU never waits on the bus. The
+// wake up byte gives a multiplexer time to settle.
+//
+static void exp_adc_convert(void)
 {
-    // Turn off interrupts because the external LEDs and the external Key
-    // Read lines share the same clock lines. An interrupt in the middle of
-    // this sequence will give you corrupt LEDs.
-    cli();
+    exp_mux_select(s_adc_input);
+    PORTB &= ~ADC_SELECT;
+    s_adc_byte = 0;
+    SPDR = 0b00000001;
+}
 
-	// The only device configuration which uses reordering of the external key
-	// is Serato, if rotate is enabled then we dont want to reorder the keys
-if(!g_rotate_enable)
+// Start the background conversions for this millisecond, or resume a visit
+// that was interrupted by the main loop claiming the SPI bus. This is
+// called from the key read interrupt once per millisecond.
+//
+void exp_adc_scan_start(void)
 {
-	
-#ifdef REORDER_EXT_KEYS
-    // Reorder bits | 1 | 2 | into  | 3 | 1 |
-    //              | 3 | 4 |       | 4 | 2 |
-    uint8_t temp = 0;
-    temp |= state & 0x1 ? 0x04 : 0;
-    temp |= state & 0x2 ? 0x01 : 0;
-    temp |= state & 0x4 ? 0x08 : 0;
-    temp |= state & 0x8 ? 0x02 : 0;
-    state = temp;
-#endif
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
+        if (s_adc_wait[i]) --s_adc_wait[i];
+    }
+    s_adc_visits = EXP_ADC_VISITS;
+
+    // Leave the bus alone if the main loop wants it or if the last round is
+    // somehow still running.
+    if (g_spi_foreground || g_spi_background) return;
+    if (!s_adc_samples && !exp_adc_visit_next()) return;
+    g_spi_background = true;
+
+    // Make sure the LED driver isn't listening, then start converting.
+    PORTB &= ~LED_LATCH;
+    SPCR |= _BV(SPIE);
+    exp_adc_convert();
 }
 
+// A visit has its readings. Publish the average, and work out how soon the
+// input should be visited again.
+//
+static void exp_adc_visit_done(void)
+{
+    uint8_t input = s_adc_input;
+    uint16_t value = s_adc_accum / EXP_ADC_SAMPLES;
+    s_adc_accum = 0;
+    s_adc_samples = 0;
+
+    uint16_t prev = g_exp_analog_prev[input];
+    uint16_t moved = (value > prev) ? value - prev : prev - value;
+    if (moved >= EXP_ADC_ACTIVE_COUNTS) {
+        s_adc_active[input] = EXP_ADC_ACTIVE_VISITS;
+    } else if (s_adc_active[input]) {
+        --s_adc_active[input];
+    }
 
-    // set the EXP_LED_BIT to an output, no pullup.
-    DDRD |= EXP_LED_BIT;
+    bool fast = s_adc_active[input] ||
+        input >= EXP_MUX_PORTS * EXP_MUX_INPUTS ||
+        (EXP_ADC_FAST_MUXED & ((uint32_t)1 << input));
+    s_adc_wait[input] = fast ? EXP_ADC_FAST_MS : EXP_ADC_SLOW_MS;
 
-    // Start with the latch low.
-    PORTD &= ~EXP_LED_LATCH;
-    // Start with the clock high.
-    PORTD |= EXP_LED_CLOCK;
+    // The newest value always wins, whether or not the main loop has
+    // collected the last one.
+    g_exp_analog_prev[input] = value;
+    s_adc_fresh |= (exp_adc_mask_t)1 << input;
+}
 
-    // loop over external keys setting their LEDs.
-    uint8_t bit = 0x80;
-    for (uint8_t i=0; i<8; ++i) {
-        // set an LED
-        if (state & bit) {
-            PORTD |= EXP_LED_BIT;
-        } else {
-            PORTD &= ~EXP_LED_BIT;
-        }
+// SPI transfer complete interrupt, stepping the background ADC scan.
+//
+ISR(SPI_STC_vect)
+{
+    uint8_t received = SPDR;
 
-        // clock the bit into the LED controller on a falling edge.
-        PORTD &= ~EXP_LED_CLOCK;
-        PORTD |= EXP_LED_CLOCK;
+    if (s_adc_byte == 0) {
+        // Wake up byte sent, now select single-channel-read of the channel.
+        s_adc_byte = 1;
+        SPDR = 0b10000000 | ((EXP_ANALOG_PORT(s_adc_input) & 0x03) << 4);
+        return;
+    }
+    if (s_adc_byte == 1) {
+        // Top bits are in, shift in the remaining values.
+        s_adc_topbyte = received;
+        s_adc_byte = 2;
+        SPDR = 0b00000000;
+        return;
+    }
 
-        // next bit
-        bit >>= 1;
+    // Conversion complete. Put the ADC chip back into hibernation, which
+    // has to stay high for a short while before the next conversion - the
+    // bookkeeping below covers that.
+    PORTB |= ADC_SELECT;
+    s_adc_accum += ((s_adc_topbyte & 0x07) << 8) | received;
+    if (++s_adc_samples == EXP_ADC_SAMPLES) {
+        exp_adc_visit_done();
     }
 
-    // latch the result with a rising edge
-    PORTD |= EXP_LED_LATCH;
-    // leave the latch low
-    PORTD &= ~EXP_LED_LATCH;
+    if (!g_spi_foreground && (s_adc_samples || exp_adc_visit_next())) {
+        // Next reading of this visit, or the next visit.
+        exp_adc_convert();
+        return;
+    }
+
+    // Either this millisecond's visits are done or the main loop wants the
+    // bus. Release it either way, an unfinished visit resumes on the next
+    // timer tick.
+    SPCR &= ~_BV(SPIE);
+    g_spi_background = false;
+}
+
+// Collect a new averaged value from the background scan. Returns the
+// input it came from, or EXP_ADC_NONE if every input's value has already
+// been collected.
+//
+uint8_t exp_adc_fetch(uint16_t* value)
+{
+    uint8_t sreg = SREG;
+    cli();
+    exp_adc_mask_t fresh = s_adc_fresh;
+    if (!fresh) {
+        SREG = sreg;
+        return EXP_ADC_NONE;
+    }
+    uint8_t input = 0;
+    while (!(fresh & 1)) {
+        fresh >>= 1;
+        ++input;
+    }
+    s_adc_fresh &= ~((exp_adc_mask_t)1 << input);
+    *value = g_exp_analog_prev[input];
+    SREG = sreg;
+    return input;
+}
+
+// ---------------------------------------------------------------------------
+
+// The expansion port LED states, looked up as wired or reordered for the
+// Serato layout. The reordering was generated from Python using:
+//
+//    [sum(b for m, b in ((1, 4), (2, 1), (4, 8), (8, 2)) if n & m)
+//     for n in range(16)]
+//
+static const uint8_t exp_led_as_wired_table[16] PROGMEM = {
+    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
+    0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf
+};
+
+#ifdef REORDER_EXT_KEYS
+static const uint8_t exp_led_reorder_table[16] PROGMEM = {
+    0x0, 0x4, 0x1, 0x5, 0x8, 0xc, 0x9, 0xd,
+    0x2, 0x6, 0x3, 0x7, 0xa, 0xe, 0xb, 0xf
+};
+#endif
+
+static const uint8_t* s_exp_led_table = exp_led_as_wired_table;
+
+// Pick the LED order whenever the rotate setting changes. The only device
+// configuration which uses reordering of the external keys is Serato, and
+// if rotate is enabled then we don't want to reorder them.
+//
+void exp_orient_configure(void)
+{
+    s_exp_led_table = exp_led_as_wired_table;
+#ifdef REORDER_EXT_KEYS
+    if (!g_rotate_enable) {
+        // Reorder bits | 1 | 2 | into  | 3 | 1 |
+        //              | 3 | 4 |       | 4 | 2 |
+        s_exp_led_table = exp_led_reorder_table;
+    }
+#endif
+}
 
-    // Turn interrupts back on now we're leaving the critical section.
-    sei();
+// Set the expansion port LEDs. They are shifted out by the key read
+// interrupt on its next tick, so there's no need to turn interrupts off
+// here and nothing waits.
+//
+void exp_set_key_led(uint8_t state)
+{
+    s_exp_led_state = pgm_read_byte(&s_exp_led_table[state & 0x0f]);
 }
 
 // ----------------------------------------------------------------------------
@@ -28,12 +28,29 @@
 
 // global values -------------------------------------------------------------
 
+// The four analog ports can each have an 8 way multiplexer in front of
+// them, counting up from A1. The multiplexers share the select lines on
+// digital pins D1..D3, so the digital expansion port can't be used at the
+// same time. With all four fitted there are 32 inputs.
+#define NUM_ANALOG_PORTS 4
+#define EXP_MUX_INPUTS 8  // Inputs behind each multiplexer.
+
 #ifdef MULTIPLEX_ANALOG
-   #define NUM_ANALOG 11
+   #ifndef EXP_MUX_PORTS
+      #define EXP_MUX_PORTS 1
+   #endif
 #else
-   #define NUM_ANALOG 4
+   #define EXP_MUX_PORTS 0
 #endif
 
+// Analog inputs, numbered through the multiplexed ports first and then the
+// plain ones: 11 for the usual single multiplexer on A1.
+#define NUM_ANALOG (EXP_MUX_PORTS * EXP_MUX_INPUTS + NUM_ANALOG_PORTS - EXP_MUX_PORTS)
+
+// The analog port that an input is read through.
+#define EXP_ANALOG_PORT(input) ((input) < EXP_MUX_PORTS * EXP_MUX_INPUTS ? \
+    (input) / EXP_MUX_INPUTS : (input) - EXP_MUX_PORTS * (EXP_MUX_INPUTS - 1))
+
 // Key states for the expansion port inputs.
 extern uint8_t g_exp_key_debounce_buffer[];
 extern uint8_t g_exp_key_state;
@@ -45,17 +62,50 @@ extern uint8_t g_exp_key_up;
 // 10-bit range.
 extern uint16_t g_exp_analog_prev[NUM_ANALOG];
 
+// ADC scheduling. Each visit to an input takes EXP_ADC_SAMPLES readings in
+// a row and publishes their average. Faders are visited every
+// EXP_ADC_FAST_MS, trim knobs every EXP_ADC_SLOW_MS, and any input that has
+// just moved by EXP_ADC_ACTIVE_COUNTS or more is treated as a fader for its
+// next EXP_ADC_ACTIVE_VISITS visits. At most EXP_ADC_VISITS visits are made
+// per millisecond, which bounds the time spent on the bus however many
+// inputs there are.
+#define EXP_ADC_SAMPLES 4
+#define EXP_ADC_FAST_MS 4
+#define EXP_ADC_SLOW_MS 32
+#define EXP_ADC_ACTIVE_COUNTS 8
+#define EXP_ADC_ACTIVE_VISITS 64
+#ifndef EXP_ADC_VISITS
+   #if EXP_MUX_PORTS
+      #define EXP_ADC_VISITS 2
+   #else
+      #define EXP_ADC_VISITS 1
+   #endif
+#endif
+
+// The plain ports are taken to be faders and the multiplexed inputs trim
+// knobs. Set bits here, one per input, for multiplexed inputs that should
+// be visited as often as faders.
+#ifndef EXP_ADC_FAST_MUXED
+   #define EXP_ADC_FAST_MUXED 0
+#endif
+
+// Returned by exp_adc_fetch() when there are no new values.
+#define EXP_ADC_NONE 0xff
+
 // functions -----------------------------------------------------------------
 
 void exp_setup(void);
 
-void exp_buffer_digital_inputs(void);
+uint8_t exp_buffer_digital_inputs(bool ms_tick);
 uint8_t exp_key_read(void);
 void exp_key_calc(void);
 
+void exp_orient_configure(void);
 void exp_set_key_led(uint8_t state);
 
-uint16_t exp_adc_read(uint8_t channel);
+uint16_t exp_adc_read(uint8_t input);
+void exp_adc_scan_start(void);
+uint8_t exp_adc_fetch(uint16_t* value);
 
 // ---------------------------------------------------------------------------
 
@@ -0,0 +1,326 @@
+// Fader filtering for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "constants.h"
+#include "expansion.h"
+#include "fader.h"
+#include "key.h"
+#include "midi.h"
+#include "sysex.h"
+#include "eeprom.h"
+
+// Globals ---------------------------------------------------------------------
+
+fader_t g_fader[NUM_ANALOG];
+
+// NOTE: These are debug values, the actual settings are read from the
+// EEPROM during startup.
+uint8_t g_fader_smoothing = 3;
+uint8_t g_fader_fast = 16;
+uint8_t g_fader_hysteresis = 4;
+uint8_t g_fader_interval = 2;
+uint8_t g_fader_curve[NUM_ANALOG_PORTS] = {FADER_CURVE_LINEAR, FADER_CURVE_LINEAR,
+                                           FADER_CURVE_LINEAR, FADER_CURVE_LINEAR};
+
+static void sysExCmdCurve(SysEx_t* sysex, uint8_t* payload);
+
+
+// Functions -------------------------------------------------------------------
+
+// Start the filters from the analog values read by exp_setup(), so the
+// first pass doesn't generate a burst of CCs.
+//
+void fader_setup(void)
+{
+    fader_configure();
+    sysex_install(SYSEX_COMMAND_CURVE, sysExCmdCurve);
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
+        g_fader[i].average = g_exp_analog_prev[i] << FADER_FRACTION_BITS;
+        g_fader[i].value = (uint8_t)(g_exp_analog_prev[i] >> 3);
+        g_fader[i].sent_tick = 0;
+    }
+}
+
+// Keep the filter settings within usable ranges. Call this whenever the
+// settings change.
+//
+void fader_configure(void)
+{
+    if (g_fader_smoothing > FADER_SMOOTHING_MAX) {
+        g_fader_smoothing = FADER_SMOOTHING_MAX;
+    }
+    g_fader_fast &= 0x7f;
+    g_fader_hysteresis &= 0x7f;
+    g_fader_interval &= 0x7f;
+
+    // The custom curve can only be used once one has been uploaded. Until
+    // then its last value still reads as erased EEPROM.
+    bool custom = eeprom_read(EE_FADER_CURVE_TABLE + 127) <= 0x7f;
+    for (uint8_t i=0; i<NUM_ANALOG_PORTS; ++i) {
+        if (g_fader_curve[i] >= FADER_CURVES ||
+            (g_fader_curve[i] == FADER_CURVE_CUSTOM && !custom)) {
+            g_fader_curve[i] = FADER_CURVE_LINEAR;
+        }
+    }
+}
+
+// Run a new 10-bit sample through the filter for an analog input. Returns
+// true if the 7-bit value in g_fader[channel].value has changed and should
+// be sent.
+//
+// The filter has three stages:
+//
+//  1. An exponential moving average. The average moves 1/2^n of the way
+//     to each sample, where n starts at g_fader_smoothing and drops by one
+//     each time the distance doubles past g_fader_fast. A resting fader
+//     gets heavy smoothing while a fast move is followed within a couple of
+//     samples.
+//
+//  2. Hysteresis on the 7-bit value. Each value covers 8 counts of the
+//     10-bit range, and the average has to leave that range by more than
+//     g_fader_hysteresis counts before the value changes. Noise sitting on
+//     the boundary between two values can't make it flicker.
+//
+//  3. A minimum interval between values. A change arriving less than
+//     g_fader_interval ms after the last value is held back and sent once
+//     the interval has passed. So is a change while the EEPROM is saving,
+//     when the fader uses the custom curve: reading the curve would have to
+//     wait out up to 3.4ms for the write.
+//
+bool fader_update(const uint8_t channel, const uint16_t sample)
+{
+    fader_t* fader = &g_fader[channel];
+
+    // Inverted sliders can read one past the top of the range.
+    uint16_t clamped = (sample > 1023) ? 1023 : sample;
+
+    // 1. Adaptive moving average.
+    int16_t difference = (int16_t)(clamped << FADER_FRACTION_BITS) -
+                         (int16_t)fader->average;
+    uint16_t distance = (difference < 0 ? -difference : difference) >>
+                        FADER_FRACTION_BITS;
+    uint8_t shift = g_fader_smoothing;
+    uint16_t threshold = g_fader_fast;
+    while (shift > 0 && distance >= threshold) {
+        --shift;
+        threshold <<= 1;
+    }
+    fader->average += difference >> shift;
+
+    // 2. Hysteresis on the 7-bit value.
+    int16_t average = fader->average >> FADER_FRACTION_BITS;
+    int16_t low = (fader->value << 3) - g_fader_hysteresis;
+    int16_t high = (fader->value << 3) + 7 + g_fader_hysteresis;
+    uint8_t value = fader->value;
+    if (average < low || average > high) {
+        value = (uint8_t)(average >> 3);
+    }
+    if (value == fader->value) return false;
+
+    // 3. Rate limit.
+    uint16_t now = key_tick();
+    if ((uint16_t)(now - fader->sent_tick) < g_fader_interval) return false;
+    if (g_fader_curve[EXP_ANALOG_PORT(channel)] == FADER_CURVE_CUSTOM &&
+        eeprom_busy()) {
+        return false;
+    }
+
+    fader->value = value;
+    fader->sent_tick = now;
+    return true;
+}
+
+// Response curves -------------------------------------------------------------
+
+// The 7-bit fader values turned into CC values, one table per curve so
+// sending a CC costs a single table read. Each table has the dead zone of
+// three values at either end built in. Generated from Python using:
+//
+//    def remap(v, f, t, lo, hi):
+//        return lo if v < f else hi if v > t else lo + (v-f)*(hi-lo)//(t-f)
+//    linear = [remap(v, 3, 124, 0, 127) for v in range(128)]
+//    log = [round(127*math.log10(1 + 9*l/127)) for l in linear]
+//    exp = [round(127*(10**(l/127) - 1)/9) for l in linear]
+//    cut = [min(127, 16*l) for l in linear]
+//    split = [remap(v, 64, 124, 0, 105) for v in range(64, 128)]
+//
+static const uint8_t fader_curve_table[FADER_CURVE_CUSTOM][128] PROGMEM = {
+    { // FADER_CURVE_LINEAR
+          0,   0,   0,   0,   1,   2,   3,   4,
+          5,   6,   7,   8,   9,  10,  11,  12,
+         13,  14,  15,  16,  17,  18,  19,  20,
+         22,  23,  24,  25,  26,  27,  28,  29,
+         30,  31,  32,  33,  34,  35,  36,  37,
+         38,  39,  40,  41,  43,  44,  45,  46,
+         47,  48,  49,  50,  51,  52,  53,  54,
+         55,  56,  57,  58,  59,  60,  61,  62,
+         64,  65,  66,  67,  68,  69,  70,  71,
+         72,  73,  74,  75,  76,  77,  78,  79,
+         80,  81,  82,  83,  85,  86,  87,  88,
+         89,  90,  91,  92,  93,  94,  95,  96,
+         97,  98,  99, 100, 101, 102, 103, 104,
+        106, 107, 108, 109, 110, 111, 112, 113,
+        114, 115, 116, 117, 118, 119, 120, 121,
+        122, 123, 124, 125, 127, 127, 127, 127
+    },
+    { // FADER_CURVE_LOG
+          0,   0,   0,   0,   4,   7,  11,  14,
+         17,  20,  22,  25,  27,  30,  32,  34,
+         36,  38,  40,  42,  44,  45,  47,  49,
+         52,  53,  55,  56,  58,  59,  60,  62,
+         63,  64,  65,  66,  68,  69,  70,  71,
+         72,  73,  74,  75,  77,  78,  79,  80,
+         81,  82,  83,  83,  84,  85,  86,  87,
+         88,  88,  89,  90,  91,  91,  92,  93,
+         94,  95,  96,  96,  97,  98,  98,  99,
+        100, 100, 101, 102, 102, 103, 103, 104,
+        105, 105, 106, 106, 108, 108, 109, 109,
+        110, 110, 111, 111, 112, 112, 113, 113,
+        114, 114, 115, 115, 116, 116, 117, 117,
+        118, 119, 119, 119, 120, 120, 121, 121,
+        122, 122, 123, 123, 123, 124, 124, 125,
+        125, 125, 126, 126, 127, 127, 127, 127
+    },
+    { // FADER_CURVE_EXP
+          0,   0,   0,   0,   0,   1,   1,   1,
+          1,   2,   2,   2,   3,   3,   3,   3,
+          4,   4,   4,   5,   5,   5,   6,   6,
+          7,   7,   8,   8,   8,   9,   9,  10,
+         10,  11,  11,  12,  12,  13,  13,  13,
+         14,  15,  15,  16,  17,  17,  18,  18,
+         19,  20,  20,  21,  21,  22,  23,  23,
+         24,  25,  26,  26,  27,  28,  29,  29,
+         31,  32,  33,  33,  34,  35,  36,  37,
+         38,  39,  40,  41,  42,  43,  44,  45,
+         46,  47,  48,  49,  52,  53,  54,  55,
+         57,  58,  59,  61,  62,  63,  65,  66,
+         68,  69,  71,  72,  74,  76,  77,  79,
+         82,  84,  86,  88,  90,  91,  93,  95,
+         97,  99, 101, 104, 106, 108, 110, 112,
+        115, 117, 120, 122, 127, 127, 127, 127
+    },
+    { // FADER_CURVE_CUT
+          0,   0,   0,   0,  16,  32,  48,  64,
+         80,  96, 112, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127,
+        127, 127, 127, 127, 127, 127, 127, 127
+    }
+};
+
+// The second CC range in Traktor mode, from the top half of the travel.
+//
+static const uint8_t fader_split_table[64] PROGMEM = {
+      0,   1,   3,   5,   7,   8,  10,  12,
+     14,  15,  17,  19,  21,  22,  24,  26,
+     28,  29,  31,  33,  35,  36,  38,  40,
+     42,  43,  45,  47,  49,  50,  52,  54,
+     56,  57,  59,  61,  63,  64,  66,  68,
+     70,  71,  73,  75,  77,  78,  80,  82,
+     84,  85,  87,  89,  91,  92,  94,  96,
+     98,  99, 101, 103, 105, 105, 105, 105
+};
+
+// Turn the 7-bit value of a fader into a CC value through its curve. The
+// inputs behind a multiplexer share the curve of their port.
+//
+uint8_t fader_curve(const uint8_t channel, const uint8_t value)
+{
+    uint8_t curve = g_fader_curve[EXP_ANALOG_PORT(channel)];
+    if (curve == FADER_CURVE_CUSTOM) {
+        return eeprom_read(EE_FADER_CURVE_TABLE + (value & 0x7f)) & 0x7f;
+    }
+    return pgm_read_byte(&fader_curve_table[curve][value & 0x7f]);
+}
+
+// The second CC range, zero for the bottom half of the travel.
+//
+uint8_t fader_split(const uint8_t value)
+{
+    if (value < 64) return 0;
+    return pgm_read_byte(&fader_split_table[(value - 64) & 0x3f]);
+}
+
+// Send back part of the custom curve:
+//
+//   F0 00 mid mid 08 01 start values... F7
+//
+static void fader_send_curve(uint8_t start, uint8_t count)
+{
+    uint8_t payload[6 + 1 + FADER_CURVE_SYSEX_CHUNK + 1] =
+        {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+         SYSEX_COMMAND_CURVE,
+         0x01, // 0x0 = request, 0x1 = response
+         start};
+    if (count > FADER_CURVE_SYSEX_CHUNK) count = FADER_CURVE_SYSEX_CHUNK;
+    if (count > 128 - start) count = 128 - start;
+    for (uint8_t i=0; i<count; ++i) {
+        payload[7 + i] = eeprom_read(EE_FADER_CURVE_TABLE + start + i) & 0x7f;
+    }
+    payload[7 + count] = 0xf7;
+    midi_stream_sysex(8 + count, payload);
+}
+
+// Handle the curve SysEx command. The custom curve is read and written a
+// chunk at a time, so each message fits the SysEx buffer:
+//
+//   F0 00 mid mid 08 00 start count F7      read "count" values
+//   F0 00 mid mid 08 02 start values... F7  write values from "start"
+//
+// Both are answered with the values now held, see fader_send_curve().
+//
+static void sysExCmdCurve(SysEx_t* sysex, uint8_t* payload)
+{
+    uint8_t size = sysex_payload_size(sysex);
+    if (size < 2) return;
+    uint8_t start = payload[1] & 0x7f;
+
+    if (payload[0] == FADER_CURVE_SYSEX_READ && size >= 3) {
+        fader_send_curve(start, payload[2]);
+    } else if (payload[0] == FADER_CURVE_SYSEX_WRITE) {
+        uint8_t count = size - 2;
+        for (uint8_t i=0; i<count && start + i < 128; ++i) {
+            eeprom_write(EE_FADER_CURVE_TABLE + start + i, payload[2 + i] & 0x7f);
+        }
+        // The custom curve may have just become usable.
+        fader_configure();
+        fader_send_curve(start, count);
+    }
+}
+
+// ----------------------------------------------------------------------------
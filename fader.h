@@ -0,0 +1,78 @@
+// Fader filtering for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _FADER_H_INCLUDED
+#define _FADER_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "expansion.h"
+
+// Types ----------------------------------------------------------------------
+
+// Filter state for one analog input.
+typedef struct {
+    uint16_t average;    // Moving average, 10.5 fixed point.
+    uint8_t value;       // 7-bit value last reported.
+    uint16_t sent_tick;  // Key tick when the value was last reported.
+} fader_t;
+
+// Number of fractional bits in the moving average.
+#define FADER_FRACTION_BITS 5
+
+// Largest moving average shift, alpha = 1/64.
+#define FADER_SMOOTHING_MAX 6
+
+// Response curves, picked for each fader with g_fader_curve[].
+#define FADER_CURVE_LINEAR 0  // Straight line, the default.
+#define FADER_CURVE_LOG    1  // Rises quickly, then levels off.
+#define FADER_CURVE_EXP    2  // Rises slowly, then quickly.
+#define FADER_CURVE_CUT    3  // Cuts in to full within a few values.
+#define FADER_CURVE_CUSTOM 4  // Uploaded by SysEx, kept in the EEPROM.
+#define FADER_CURVES       5
+
+// Curve SysEx commands, see sysExCmdCurve().
+#define FADER_CURVE_SYSEX_READ  0x0
+#define FADER_CURVE_SYSEX_WRITE 0x2
+#define FADER_CURVE_SYSEX_CHUNK 24   // Most values in one reply.
+
+// Globals ---------------------------------------------------------------------
+
+extern fader_t g_fader[NUM_ANALOG];
+
+// Filter settings.
+extern uint8_t g_fader_smoothing;   // Average shift at rest (0..6)
+extern uint8_t g_fader_fast;        // Move size that speeds the average up
+extern uint8_t g_fader_hysteresis;  // Extra counts needed to change value
+extern uint8_t g_fader_interval;    // Minimum ms between values
+extern uint8_t g_fader_curve[NUM_ANALOG_PORTS];  // Curve of each port
+
+// Functions -------------------------------------------------------------------
+
+void fader_setup(void);
+void fader_configure(void);
+bool fader_update(const uint8_t channel, const uint16_t sample);
+uint8_t fader_curve(const uint8_t channel, const uint8_t value);
+uint8_t fader_split(const uint8_t value);
+
+// ----------------------------------------------------------------------------
+
+#endif // _FADER_H_INCLUDED
@@ -27,9 +27,11 @@
 #include "modeldefs.h"  // NOTE: include this first.
 
 #include "key.h"
+#include "profile.h"
 #include "random.h"
 #include "constants.h"
 #include "expansion.h"
+#include "telemetry.h"
 
 // Globals ---------------------------------------------------------------------
 
@@ -40,11 +42,60 @@ uint8_t g_device_mode;
 uint8_t g_rotate_enable;
 
 uint16_t g_key_debounce_buffer[DEBOUNCE_BUFFER_SIZE]; // The debounce buffer
+uint8_t g_key_debounce_mode = DEBOUNCE_MODE_COUNTER; // Which debouncer?
+uint8_t g_key_debounce_press = 1;    // Samples before a press is reported.
+uint8_t g_key_debounce_release = 10; // Samples before a release is reported.
 uint16_t g_key_state = 0;      // Current state of the keys after debounce.
 uint16_t g_key_prev_state = 0; // State of the keys when last polled.
 uint16_t g_key_up = 0;         // Key was released since last poll.
 uint16_t g_key_down = 0;       // Key was pressed since last poll.
 
+volatile uint16_t g_key_tick = 0;  // Key read ticks since startup.
+uint16_t g_key_event_tick = 0;     // Tick of the most recent key event.
+volatile uint16_t g_key_edge_tick = 0;  // Tick of the latest pad edge.
+
+// The vertical counter state for the keys.
+static debounce_t s_key_debounce;
+
+// The press and release windows expanded into one word per count plane:
+// 0xffff where that bit of the window is set, 0x0000 where it isn't.
+static uint16_t s_debounce_press_plane[DEBOUNCE_PLANES];
+static uint16_t s_debounce_release_plane[DEBOUNCE_PLANES];
+
+// Key event queue. This is a single producer, single consumer ring: the
+// interrupt only ever writes the head and the main loop only the tail, so
+// no locking is needed as long as each side updates its index after the
+// event data.
+static key_event_t s_key_events[KEY_EVENT_QUEUE_SIZE];
+static volatile uint8_t s_key_event_head = 0;  // Next slot to write.
+static volatile uint8_t s_key_event_tail = 0;  // Next slot to read.
+
+// Timer0 counts at F_CPU/64 and clears when it matches OCR0A, so a scan
+// takes KEY_SCAN_HALF_TICKS/2 counts. When that isn't a whole number the
+// interrupt alternates between the two nearest periods.
+#define KEY_SCAN_HALF_TICKS (F_CPU / 32 / KEY_SCAN_HZ)
+#define KEY_SCAN_OCR (KEY_SCAN_HALF_TICKS / 2 - 1)
+// The frame lead in Timer0 counts.
+#define KEY_FRAME_LEAD_COUNTS (KEY_FRAME_LEAD_US / 4)
+#if KEY_FRAME_LEAD_COUNTS >= KEY_SCAN_OCR
+#error "KEY_FRAME_LEAD_US must be shorter than a key scan"
+#endif
+
+#if KEY_SCAN_SHIFT
+// Scans left until the next millisecond.
+static uint8_t s_key_scans = KEY_SCANS_PER_MS;
+#endif
+// Set by the scan that finishes each millisecond, see key_frame_slot_due().
+static volatile bool s_key_slot = false;
+
+// The key states as last placed in the queue.
+static uint16_t s_key_queued_state = 0;
+static uint8_t s_exp_queued_state = 0;
+
+// Keys whose change is being held back by a full queue, for the telemetry.
+static uint16_t s_key_held = 0;
+static uint8_t s_exp_key_held = 0;
+
 
 // Key Functions --------------------------------------------------
 
@@ -68,23 +119,21 @@ void key_setup(void)
 
     // Start the debounce buffer in an empty state.
     memset(g_key_debounce_buffer, 0, DEBOUNCE_BUFFER_SIZE*sizeof(uint16_t));
+    memset(&s_key_debounce, 0, sizeof(s_key_debounce));
+    key_debounce_configure();
 
-    // Setup TIMER0 to trigger an overflow interrupt 1000 times a second.
-    // Our counter is incremented every 256 / 16000000 = 0.000016 seconds.
-    // Our key debounce buffer is 10 samples, meaning we need the counter
-    // to count to x where (256*10*x)/16000000 = 0.001 seconds. This gives us
-    // A counter value of 62.5 (rounded to 62), but the counter increments
-    // from a base number to the overflow point at 255 so we need to set
-    // the counter to (255 - 62) = 193 = 0xC1.
-    //
-    // Strictly, we're polling the buttons at 1008Hz, but who's counting...
-
-    // Set the Timer0 prescaler to clock/256.
-    TCCR0B |= _BV(CS02);
-    // Setup Timer0 to count up from 192 (see calculations above).
-    TCNT0 = 0xC1;
-    // Set the Timer0 Overflow Interrupt Enable bit.
-    TIMSK0 |= _BV(TOIE0);
+    // Setup TIMER0 to trigger a compare match interrupt KEY_SCAN_HZ times
+    // a second. At clock/64 the counter is incremented every 4us, so it
+    // clears after 250 counts for a 1kHz scan, 125 for 2kHz and 62.5 for
+    // 4kHz. Clear Timer on Compare (CTC) mode restarts the count in
+    // hardware, so the period doesn't stretch with interrupt latency.
+    TCCR0A = _BV(WGM01);
+    OCR0A = KEY_SCAN_OCR;
+    TCNT0 = 0;
+    // Set the Timer0 prescaler to clock/64.
+    TCCR0B = _BV(CS01) | _BV(CS00);
+    // Set the Timer0 Compare Match A Interrupt Enable bit.
+    TIMSK0 |= _BV(OCIE0A);
     // Enable all interrupts.
     sei();
 
@@ -103,78 +152,212 @@ void key_setup(void)
 //
 void key_disable(void)
 {
-    // Zero out the Timer0 Overflow Interrupt Enable bit so interrupts will
-    // no longer be generated.
-    TIMSK0 &= ~(_BV(TOIE0));
+    // Zero out the Timer0 Compare Match A Interrupt Enable bit so interrupts
+    // will no longer be generated.
+    TIMSK0 &= ~(_BV(OCIE0A));
 }
 
 
-// The key read Interrupt Service Routine (ISR). This is called at 1008Hz
-// by Timer0 overflow interrupt and used to poll the key states and drop
-// the results into a ring buffer for later analysis by the key debouncer.
+// Turn a key read from the chips into the orientation the device is being
+// used in. The interrupt debounces the keys as they are wired, so this is
+// only needed once per debounced state rather than on every scan. Picked
+// by key_orient_configure() whenever the rotate setting changes.
+//
+static uint16_t (*s_key_orient)(uint16_t value) = rotate16_none;
+
+uint16_t key_orient(const uint16_t value)
+{
+    return s_key_orient(value);
+}
+
+void key_orient_configure(void)
+{
+    s_key_orient = rotate16_none;
+    if (!g_rotate_enable) {
+#if defined(KEYGRID_ROTATE_LEFT)
+        s_key_orient = rotate16_left;
+#elif defined(KEYGRID_ROTATE_RIGHT)
+        s_key_orient = rotate16_right;
+#endif
+    } else {
+#if !defined(KEYGRID_ROTATE_RIGHT)
+        s_key_orient = rotate16_left;
+#endif
+    }
+}
+
+// Count the key edges a full event queue is holding back (they go out
+// later, folded into one event) and the ones it loses outright: a key that
+// changes back before there is room never gets its press or release seen.
+// Only called while the queue is, or has just been, full.
+//
+static void key_count_held(const uint16_t changed, const uint8_t exp_changed,
+                           const bool full)
+{
+    uint16_t undone = s_key_held & ~changed;
+    uint8_t exp_undone = s_exp_key_held & ~exp_changed;
+    uint16_t fresh = full ? changed & ~s_key_held : 0;
+    uint8_t exp_fresh = full ? exp_changed & ~s_exp_key_held : 0;
+
+    uint8_t lost = 0;
+    uint8_t held = 0;
+    for (uint8_t i=0; i<16; ++i) {
+        uint16_t bit = 1 << i;
+        if (undone & bit) lost += 2;
+        if (fresh & bit) ++held;
+        if (i < 8) {
+            if (exp_undone & bit) lost += 2;
+            if (exp_fresh & bit) ++held;
+        }
+    }
+    TELEMETRY_ADD(key_losses, lost);
+    TELEMETRY_ADD(key_delays, held);
+
+    s_key_held = full ? changed : 0;
+    s_exp_key_held = full ? exp_changed : 0;
+}
+
+// The key read Interrupt Service Routine (ISR). This is called KEY_SCAN_HZ
+// times a second by the Timer0 compare match interrupt and used to poll the
+// key states and feed them to the key debouncer.
 //
 // The two 74HC165 chips share use the same clock (PC5) and latch lines (PC7),
 // so each clock we have to pick up two bits of value, on pins PC4 (SW9 to
 // SW16) and PC6 (SW1 to SW8)
 //
-ISR(TIMER0_OVF_vect)
+// The pads and expansion keys are read on every scan so a press can be seen
+// within one scan. The millisecond work (g_key_tick, the debounce buffer and
+// the background ADC conversions) happens on every KEY_SCANS_PER_MS'th.
+//
+ISR(TIMER0_COMPA_vect)
 {
     // Where to write the next value in the ring buffer.
     static uint8_t buffer_pos = 0;
+    // Debounced pad state on the last tick, for timing the latest edge.
+    static uint16_t edge_state = 0;
+#if KEY_SCAN_SHIFT
+    bool ms_tick = (--s_key_scans == 0);
+    if (ms_tick) s_key_scans = KEY_SCANS_PER_MS;
+#else
+    const bool ms_tick = true;
+#endif
 
-    // The counter just overflowed, so reset the counter to the magic number
-    // 193 (see above).
-    TCNT0 = 0xC1;
+#if KEY_SCAN_HALF_TICKS & 1
+    // Swap between the periods either side of the half count. The counter
+    // has only just restarted, so the new value applies to this period.
+    OCR0A ^= KEY_SCAN_OCR ^ (KEY_SCAN_OCR + 1);
+#endif
+    PROFILE_START(isr);
     // Latch the key read (active LOW, reset to HI).
     PORTC &= ~KEY_LATCH;
     PORTC |= KEY_LATCH;
     // Latching the inputs also presented the first
-    // bit to the output pin. Shift the captured bits back to the CPU.
-    uint16_t value = 0;
-    uint16_t lobit = 0x0080;
-    uint16_t hibit = 0x8000;
+    // bit to the output pin. Shift the captured bits back to the CPU, one
+    // byte per chip, first bit out ending up in the top bit.
+    uint8_t lo = 0;
+    uint8_t hi = 0;
     for (uint8_t i=0; i<8; ++i) {
         PORTC &= ~KEY_CLOCK;
-        // Read Port C Input, remembering that open keys read as a "1" so we
-        // will have to invert the read values. Each read of PINC will give
-        // us a single bit of input from each key buffer.
-        value |= (PINC & KEY_LOBIT) ? 0 : lobit;
-        value |= (PINC & KEY_HIBIT) ? 0 : hibit;
+        // Read Port C Input. Each read of PINC will give us a single bit of
+        // input from each key buffer, so read it once and pick both bits
+        // out of the same sample.
+        uint8_t pins = PINC;
+        lo <<= 1;
+        hi <<= 1;
+        if (pins & KEY_LOBIT) lo |= 1;
+        if (pins & KEY_HIBIT) hi |= 1;
         PORTC |= KEY_CLOCK; // clock works on a rising edge
-        lobit >>= 1;
-        hibit >>= 1;
     }
+    // Open keys read as a "1", so invert the read values.
+    uint16_t value = ~(((uint16_t)hi << 8) | lo);
 
+    uint16_t state;
+    if (g_key_debounce_mode == DEBOUNCE_MODE_COUNTER) {
+        // Step the vertical counters with the new sample.
+        state = key_debounce_update(&s_key_debounce, value);
+    } else {
+        // Store the new value in our ring buffer and increment the ring
+        // buffer offset, wrapping the write position to a point inside the
+        // buffer. The buffer holds one sample a millisecond at any scan
+        // rate.
+        if (ms_tick) {
+            g_key_debounce_buffer[buffer_pos] = value;
+            buffer_pos = (buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+        }
+        state = 0xffff;
+        for (uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
+            state &= g_key_debounce_buffer[i];
+        }
+    }
 
-// rotate the key grid if required.
-if(!g_rotate_enable)
-{
-#if defined(KEYGRID_ROTATE_LEFT)
-    value = rotate16_left(value);
-#elif defined(KEYGRID_ROTATE_RIGHT)
-    value = rotate16_right(value);
-#endif
-}
-else
-{
-#if defined(KEYGRID_ROTATE_RIGHT)
-	// Do not rotate the grid
-#else
-    value = rotate16_left(value);
-#endif
-}
+    // buffer the external keys
+    uint8_t exp_state = exp_buffer_digital_inputs(ms_tick);
 
+    // Queue an event if anything changed since the last one. If the queue
+    // is full the queued state is left alone, so the change will be folded
+    // into the next event once the main loop has made some room.
+    if (ms_tick) ++g_key_tick;
+    if (state != edge_state) {
+        edge_state = state;
+        g_key_edge_tick = g_key_tick;
+    }
+    uint16_t changed = state ^ s_key_queued_state;
+    uint8_t exp_changed = exp_state ^ s_exp_queued_state;
+    uint8_t head = s_key_event_head;
+    uint8_t next = (head + 1) & (KEY_EVENT_QUEUE_SIZE - 1);
+    bool full = (next == s_key_event_tail);
+    if (s_key_held || s_exp_key_held || (full && (changed || exp_changed))) {
+        key_count_held(changed, exp_changed, full);
+    }
+    if (!full && (changed || exp_changed)) {
+        key_event_t* event = &s_key_events[head];
+        event->down = changed & state;
+        event->up = changed & s_key_queued_state;
+        event->exp_down = exp_changed & exp_state;
+        event->exp_up = exp_changed & s_exp_queued_state;
+        event->tick = g_key_tick;
+        s_key_event_head = next;
+        s_key_queued_state = state;
+        s_exp_queued_state = exp_state;
+    }
 
+    // Kick off the next round of background ADC conversions and let the
+    // main loop know it's time to send the key events.
+    if (ms_tick) {
+        exp_adc_scan_start();
+        s_key_slot = true;
+    }
 
-	
+    PROFILE_END(PROFILE_KEY_ISR, isr);
+}
 
-    // Store the new value in our ring buffer and increment the ring buffer
-    // offset, wrapping the write position to a point inside the buffer.
-    g_key_debounce_buffer[buffer_pos] = value;
-    buffer_pos = (buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+// Lock the key scans to the USB frames. Called from the Start Of Frame
+// interrupt, this restarts Timer0 as if it had matched KEY_FRAME_LEAD_US
+// ago, so the scan which finishes the coming millisecond (and makes the
+// frame slot due) lands KEY_FRAME_LEAD_US before the next frame. Once
+// locked each call only nudges the count by a tick or so.
+//
+void key_frame_sync(void)
+{
+    TCNT0 = KEY_FRAME_LEAD_COUNTS;
+#if KEY_SCAN_HALF_TICKS & 1
+    // Start each frame on the same one of the two periods.
+    OCR0A = KEY_SCAN_OCR;
+#endif
+#if KEY_SCAN_SHIFT
+    s_key_scans = KEY_SCANS_PER_MS;
+#endif
+}
 
-    // buffer the external keys
-    exp_buffer_digital_inputs();
+// Returns true, once, after each millisecond of key scans. Without Start
+// Of Frame packets this is still once a millisecond, just not in step with
+// the host.
+//
+bool key_frame_slot_due(void)
+{
+    if (!s_key_slot) return false;
+    s_key_slot = false;
+    return true;
 }
 
 // Read the current keystate by reconstructing the key samples from the
@@ -194,11 +377,22 @@ else
 //
 uint16_t key_read(void)
 {
+    if (g_key_debounce_mode == DEBOUNCE_MODE_COUNTER) {
+        // The interrupt has already done the work, just take a copy of the
+        // state without it changing halfway through.
+        uint8_t sreg = SREG;
+        cli();
+        uint16_t state = s_key_debounce.state;
+        SREG = sreg;
+        g_key_state = s_key_orient(state);
+        return g_key_state;
+    }
     // Debounce the keys by ANDing the columns of key samples together.
-    g_key_state = 0xffff;
+    uint16_t state = 0xffff;
     for(uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
-        g_key_state &= g_key_debounce_buffer[i];
+        state &= g_key_debounce_buffer[i];
     }
+    g_key_state = s_key_orient(state);
     return g_key_state;
 }
 
@@ -218,3 +412,134 @@ void key_calc(void)
     // Demote the current state to history.
     g_key_prev_state = g_key_state;
 }
+
+// Key events -----------------------------------------------------------------
+
+// Take the oldest event off the key event queue, setting up the key up, key
+// down and key state globals (and their expansion port versions) as if
+// key_calc() had just seen that edge. Returns false if there are no events
+// waiting, leaving the globals unchanged.
+//
+bool key_event_next(void)
+{
+    uint8_t tail = s_key_event_tail;
+    if (tail == s_key_event_head) return false;
+
+    key_event_t* event = &s_key_events[tail];
+    g_key_down = s_key_orient(event->down);
+    g_key_up = s_key_orient(event->up);
+    g_key_state = (g_key_prev_state | g_key_down) & ~g_key_up;
+    g_key_prev_state = g_key_state;
+    g_exp_key_down = event->exp_down;
+    g_exp_key_up = event->exp_up;
+    g_exp_key_state = (g_exp_key_prev_state | g_exp_key_down) & ~g_exp_key_up;
+    g_exp_key_prev_state = g_exp_key_state;
+    g_key_event_tick = event->tick;
+
+    // Only hand the slot back to the interrupt once we're done with it.
+    s_key_event_tail = (tail + 1) & (KEY_EVENT_QUEUE_SIZE - 1);
+    return true;
+}
+
+// Throw away any queued key events and take the current key state as the
+// starting point for new ones. Used when something else (the menu, the boot
+// key checks) has been reading the keys directly, so that the keys it saw
+// don't turn up later as MIDI notes.
+//
+void key_event_flush(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    s_key_event_tail = s_key_event_head;
+    uint16_t state = s_key_queued_state;
+    g_exp_key_state = g_exp_key_prev_state = s_exp_queued_state;
+    SREG = sreg;
+    g_key_state = g_key_prev_state = s_key_orient(state);
+    g_key_down = g_key_up = 0;
+    g_exp_key_down = g_exp_key_up = 0;
+}
+
+// Vertical counter debouncer -------------------------------------------------
+
+// Expand the debounce windows into the per-plane masks used by
+// key_debounce_update(). Call this whenever the debounce settings change.
+//
+void key_debounce_configure(void)
+{
+    // Keep the windows in the range the counters can time.
+    if (g_key_debounce_press < 1) g_key_debounce_press = 1;
+    if (g_key_debounce_press > DEBOUNCE_WINDOW_MAX) {
+        g_key_debounce_press = DEBOUNCE_WINDOW_MAX;
+    }
+    if (g_key_debounce_release < 1) g_key_debounce_release = 1;
+    if (g_key_debounce_release > DEBOUNCE_WINDOW_MAX) {
+        g_key_debounce_release = DEBOUNCE_WINDOW_MAX;
+    }
+
+    // The counters count scans, not milliseconds. A press window of 1
+    // still means the first scan that sees the press, so only the extra
+    // milliseconds are scaled.
+    uint8_t press = ((g_key_debounce_press - 1) << KEY_SCAN_SHIFT) + 1;
+    uint8_t release = g_key_debounce_release << KEY_SCAN_SHIFT;
+
+    // The masks are used by the timer interrupt, so update them in one go.
+    uint8_t sreg = SREG;
+    cli();
+    for (uint8_t i=0; i<DEBOUNCE_PLANES; ++i) {
+        s_debounce_press_plane[i] = (press & (1 << i)) ? 0xffff : 0x0000;
+        s_debounce_release_plane[i] = (release & (1 << i)) ? 0xffff : 0x0000;
+    }
+    SREG = sreg;
+}
+
+// Feed one sample of the keys into a set of vertical counters and return
+// the new debounced state. Called from the key read interrupt.
+//
+// Each key has a counter spread across the count planes (4 bits, plus one
+// for each doubling of the scan rate), holding the number of consecutive
+// samples that key has disagreed with its debounced state. Any sample that
+// agrees resets the counter. When the counter of a released key reaches the
+// press window the key goes down, and when the counter of a held key
+// reaches the release window it goes up. With a press
+// window of 1 a press is reported on the first sample that sees it, while
+// the release window masks the bounce as the contacts open.
+//
+// All keys are processed at once using word-wide bit operations, so this
+// takes the same time however many keys change. For more, see Scott
+// Dattalo's notes on vertical counters:
+//
+//     http://www.dattalo.com/technical/software/pic/debounce.html
+//
+uint16_t key_debounce_update(debounce_t* debounce, uint16_t sample)
+{
+    uint16_t state = debounce->state;
+    // Keys that disagree with their current debounced state.
+    uint16_t delta = sample ^ state;
+    // Increment the counters of disagreeing keys by rippling a carry
+    // through the planes while clearing the counters of keys that agree.
+    // Along the way, find which counters now equal the window for the
+    // direction that key would move in.
+    uint16_t carry = delta;
+    uint16_t match = 0xffff;
+    for (uint8_t i=0; i<DEBOUNCE_PLANES; ++i) {
+        uint16_t count = debounce->count[i];
+        uint16_t next = (count & carry);
+        count = (count ^ carry) & delta;
+        carry = next;
+        // The bit this plane should hold when the window has been reached,
+        // the release window for held keys and the press window for the
+        // others.
+        uint16_t want = (state & s_debounce_release_plane[i]) |
+                        (~state & s_debounce_press_plane[i]);
+        match &= ~(count ^ want);
+        debounce->count[i] = count;
+    }
+    // Toggle the keys whose window has elapsed and restart their counters.
+    uint16_t toggle = delta & match;
+    for (uint8_t i=0; i<DEBOUNCE_PLANES; ++i) {
+        debounce->count[i] &= ~toggle;
+    }
+    state ^= toggle;
+    debounce->state = state;
+    return state;
+}
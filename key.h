@@ -47,15 +47,62 @@ extern uint8_t g_key_bank_selected;
 // The key debounce buffer.
 extern uint16_t g_key_debounce_buffer[DEBOUNCE_BUFFER_SIZE];
 
+// Debounce settings, see key_debounce_configure().
+extern uint8_t g_key_debounce_mode;     // DEBOUNCE_MODE_BUFFER or _COUNTER
+extern uint8_t g_key_debounce_press;    // Stable samples before a press
+extern uint8_t g_key_debounce_release;  // Stable samples before a release
+
+// Vertical counter debounce state. Bit N of each word belongs to key N, so
+// the four count planes hold a 4-bit counter for every key side by side.
+typedef struct {
+    uint16_t count[DEBOUNCE_PLANES];  // How long each key has disagreed.
+    uint16_t state;                   // Debounced key state.
+} debounce_t;
+
 // The key states (after debounce).
 extern uint16_t g_key_state;      // Current state of the keys.
 extern uint16_t g_key_prev_state; // State of the keys when last polled.
 extern uint16_t g_key_up;         // Key was released since last poll.
 extern uint16_t g_key_down;       // Key was pressed since last poll.
 
+// Key events, the edges found by the key read interrupt. Events are queued
+// in the order they happened so no press or release is lost while the main
+// loop is busy.
+typedef struct {
+    uint16_t down;      // Keys pressed in this event.
+    uint16_t up;        // Keys released in this event.
+    uint8_t exp_down;   // Expansion port keys pressed.
+    uint8_t exp_up;     // Expansion port keys released.
+    uint16_t tick;      // Value of g_key_tick when the edge was seen.
+} key_event_t;
+
+#define KEY_EVENT_QUEUE_SIZE 8  // Must be a power of two.
+
+// Milliseconds since startup, counted by the key read interrupt and
+// wrapping at 16 bits.
+extern volatile uint16_t g_key_tick;
+
+// Read g_key_tick. The interrupt can bump it between the two byte reads,
+// which would give a value up to 256ms out, so hold it off meanwhile.
+static inline uint16_t key_tick(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t now = g_key_tick;
+    SREG = sreg;
+    return now;
+}
+
+// Tick of the last event returned by key_event_next().
+extern uint16_t g_key_event_tick;
+
+// Tick of the most recent pad press or release seen by the interrupt,
+// whether or not it has been taken off the queue yet.
+extern volatile uint16_t g_key_edge_tick;
+
 // Interrupt service routine ---------------------------------------------------
 
-ISR(TIMER0_OVF_vect);
+ISR(TIMER0_COMPA_vect);
 
 // Key functions ---------------------------------------------------------------
 
@@ -64,4 +111,15 @@ void key_disable(void);
 uint16_t key_read(void);
 void key_calc(void);
 
+bool key_event_next(void);
+void key_event_flush(void);
+
+void key_frame_sync(void);
+bool key_frame_slot_due(void);
+
+uint16_t key_orient(const uint16_t value);
+void key_orient_configure(void);
+void key_debounce_configure(void);
+uint16_t key_debounce_update(debounce_t* debounce, uint16_t sample);
+
 #endif // _KEY_H_INCLUDED
@@ -21,7 +21,10 @@
 // rgreen 2009-05-22
 
 #include <stdbool.h>
+#include <string.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "modeldefs.h"  // NOTE: include this first.
@@ -31,6 +34,8 @@
 #include "random.h"
 #include "constants.h"
 #include "key.h"
+#include "timer.h"
+#include "expansion.h"
 
 // Global variables ------------------------------------------------------------
 
@@ -39,7 +44,132 @@ bool g_exp_led_keypress_enable = true;   // light the expansion led when pressed
 uint16_t g_led_midi_state = 0x0000;  // Persistent LED state from midi commands.
 uint16_t g_led_state = 0x0000;       // Current LED state, copied from last
                                      // call to led_set_state()
-uint16_t g_led_groundfx_counter = 0; // Counter for the ground FX MIDI clock.
+
+// Brightness ------------------------------------------------------------------
+
+// The TLC5924 can only turn each LED on or off, so brightness levels are
+// made with Binary Code Modulation: the driver is sent one bit plane of the
+// levels at a time, and each plane stays lit for twice as long as the one
+// before it, so over a frame each LED is on for a time in proportion to
+// its level. The Timer1 compare A interrupt steps through the planes,
+// a fixed LED_PLANES short interrupts per frame whatever the main loop is
+// doing, and planes that are the same as the one before aren't sent at
+// all.
+
+// Length of the shortest plane in timer ticks. A frame is LED_LEVEL_MAX of
+// these, 4.8ms or about 200 frames a second.
+#define LED_PLANE_TICKS 640
+// How long to wait when another transfer has the SPI bus.
+#define LED_RETRY_TICKS 40
+// Closest a compare can be set in the future and still be caught.
+#define LED_MIN_TICKS 20
+
+static uint16_t s_led_plane[LED_PLANES];  // Planes on show.
+static uint16_t s_led_next[LED_PLANES];   // Planes last asked for.
+static volatile bool s_led_next_ready = false;  // s_led_next is new.
+static uint8_t s_led_bit = 0;             // Plane on show.
+static uint16_t s_led_sent = 0;           // Last value sent to the driver.
+
+// Brightness for each velocity, 16 levels as midi_note_velocity() keeps,
+// with gamma=1.5 so the steps look even.
+//
+//     [ max(1, int(round(((i/15.0) ** 1.5) * 15))) for i in range(0,16) ]
+//
+static const uint8_t kVelocityLevel[16] PROGMEM = {
+    1, 1, 1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 12, 14, 15
+};
+
+// Send an LED state to the driver and latch it. The caller must own the
+// SPI bus.
+//
+static void led_write(uint16_t state)
+{
+    // Transmit Most Significant Byte first.
+    spi_transmit(state >> 8);
+    spi_transmit(state & 0xff);
+    // Latch the result to the LEDs by pulsing high.
+    PORTB |= LED_LATCH;
+    PORTB &= ~LED_LATCH;
+    s_led_sent = state;
+}
+
+// Show the next bit plane.
+//
+ISR(TIMER1_COMPA_vect)
+{
+    // The ADC scan or the main loop has the bus. Leave the plane on show
+    // up a little longer and try again.
+    if (g_spi_foreground || g_spi_background) {
+        OCR1A += LED_RETRY_TICKS;
+        return;
+    }
+
+    uint8_t bit = s_led_bit + 1;
+    if (bit >= LED_PLANES) {
+        // New frames only start at the first plane, so they never tear.
+        bit = 0;
+        if (s_led_next_ready) {
+            memcpy(s_led_plane, s_led_next, sizeof(s_led_plane));
+            s_led_next_ready = false;
+        }
+    }
+    s_led_bit = bit;
+    if (s_led_plane[bit] != s_led_sent) {
+        led_write(s_led_plane[bit]);
+    }
+
+    // Time the planes from the compare rather than from now, so the
+    // interrupt latency doesn't add up. If some other interrupt held us up
+    // so long that the next compare has already gone by, start from now.
+    uint16_t next = OCR1A + (LED_PLANE_TICKS << bit);
+    if ((int16_t)(next - TCNT1) < LED_MIN_TICKS) {
+        next = TCNT1 + LED_MIN_TICKS;
+    }
+    OCR1A = next;
+}
+
+// Rotate an LED state to match the key grid, if required. Picked by
+// led_orient_configure() whenever the rotate setting changes.
+//
+static uint16_t (*s_led_rotate)(uint16_t state) = rotate16_none;
+
+void led_orient_configure(void)
+{
+    s_led_rotate = rotate16_none;
+    if (!g_rotate_enable) {
+        // rotate the key grid if required.
+#if defined(KEYGRID_ROTATE_LEFT)
+        s_led_rotate = rotate16_right;
+#elif defined(KEYGRID_ROTATE_RIGHT)
+        s_led_rotate = rotate16_left;
+#endif
+    } else {
+#if !defined(KEYGRID_ROTATE_RIGHT)
+        s_led_rotate = rotate16_right;
+#endif
+    }
+}
+
+// Hand a set of bit planes (in key grid order) to the interrupt.
+//
+static void led_set_planes(uint16_t* plane)
+{
+    uint16_t lit = 0;
+    for (uint8_t i=0; i<LED_PLANES; ++i) {
+        plane[i] = s_led_rotate(plane[i]);
+        lit |= plane[i];
+    }
+
+    // If no lights have changed, do nothing.
+    if (memcmp(plane, s_led_next, sizeof(s_led_next)) == 0) return;
+
+    uint8_t sreg = SREG;
+    cli();
+    memcpy(s_led_next, plane, sizeof(s_led_next));
+    s_led_next_ready = true;
+    g_led_state = lit;
+    SREG = sreg;
+}
 
 // Basic functions -------------------------------------------------------------
 
@@ -54,13 +184,30 @@ void led_setup(void)
     // something has changed.
     g_led_state = 0x0000;
     g_led_midi_state = 0x0000;
+    memset(s_led_plane, 0, sizeof(s_led_plane));
+    memset(s_led_next, 0, sizeof(s_led_next));
+    s_led_next_ready = false;
     // Set the LED_BLANK pin to be an output.
     DDRB |= LED_BLANK;
     // Set LED_BLANK low and keep it there.
     PORTB &= ~LED_BLANK;
 
+    // Blank the driver until the first plane is sent.
+    spi_acquire();
+    led_write(0x0000);
+    spi_release();
+
     // set up the Ground Effects pin to output.
     DDRD |= _BV(PD0);
+
+    // Start the brightness interrupt off Timer1, which timer_setup() has
+    // already set running.
+    uint8_t sreg = SREG;
+    cli();
+    OCR1A = TCNT1 + LED_PLANE_TICKS;
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+    SREG = sreg;
 }
 
 // Set each LEDs on or off state from a 16-bit value.
@@ -77,36 +224,54 @@ void led_setup(void)
 //
 void led_set_state(uint16_t new_state)
 {
+    uint16_t plane[LED_PLANES];
+    for (uint8_t i=0; i<LED_PLANES; ++i) {
+        plane[i] = new_state;
+    }
+    led_set_planes(plane);
+}
 
-	if(!g_rotate_enable)
-	{
-    // rotate the key grid if required.
-#if defined(KEYGRID_ROTATE_LEFT)
-		new_state = rotate16_right(new_state);
-#elif defined(KEYGRID_ROTATE_RIGHT)
-		new_state = rotate16_left(new_state);
-#endif
-	}
-	else
-	{
-#if defined(KEYGRID_ROTATE_RIGHT)
-	   // Do not rotate the grid
-#elif !defined(KEYGRID_ROTATE_RIGHT)
-	   new_state = rotate16_right(new_state);
-#endif
-	}	
+// Light some LEDs at full brightness, some at LED_LEVEL_HALF and some at
+// LED_LEVEL_DIM. Where the masks overlap the brighter level wins.
+//
+void led_set_dimmed(uint16_t full, uint16_t half, uint16_t dim)
+{
+    half &= ~full;
+    dim &= ~(full | half);
+    uint16_t plane[LED_PLANES];
+    for (uint8_t i=0; i<LED_PLANES; ++i) {
+        uint8_t bit = 1 << i;
+        plane[i] = full;
+        if (LED_LEVEL_HALF & bit) plane[i] |= half;
+        if (LED_LEVEL_DIM & bit) plane[i] |= dim;
+    }
+    led_set_planes(plane);
+}
 
-    // If no lights have changed, transmit nothing. This saves bandwidth on
-    // the SPI bus for more important things.
-    if (g_led_state == new_state) return;
-    // Transmit Most Significant Byte first.
-    spi_transmit(new_state >> 8);
-    spi_transmit(new_state & 0xff);
-    // Latch the result to the LEDs by pulsing high.
-    PORTB |= LED_LATCH;
-    PORTB &= ~LED_LATCH;
-    // record the state.
-    g_led_state = new_state;
+// Set the brightness of every LED, 0 (off) to LED_LEVEL_MAX, in the same
+// order as the bits of led_set_state().
+//
+void led_set_levels(const uint8_t* level)
+{
+    uint16_t plane[LED_PLANES];
+    memset(plane, 0, sizeof(plane));
+    for (uint8_t i=0; i<16; ++i) {
+        uint8_t value = level[i];
+        uint16_t bit = 1 << i;
+        for (uint8_t j=0; j<LED_PLANES; ++j) {
+            if (value & (1 << j)) plane[j] |= bit;
+        }
+    }
+    led_set_planes(plane);
+}
+
+// Brightness level to show a note velocity with. Any note that is on is
+// at least a little bit lit.
+//
+uint8_t led_velocity_level(uint8_t velocity)
+{
+    if (velocity == 0) return 0;
+    return pgm_read_byte(&kVelocityLevel[(velocity >> 3) & 0x0f]);
 }
 
 // Turn on or off the Ground Effects LED.
@@ -119,23 +284,137 @@ void led_groundfx_state(bool state)
     }
 }
 
+// Animation -------------------------------------------------------------------
+
+// A short queue of frames that the main loop steps through with
+// led_anim_update(). While a frame is showing it owns the pad and expansion
+// LEDs, so feedback flashes never hold up the keys or MIDI. Once the queue
+// runs dry the usual pattern is drawn again.
+
+#define LED_ANIM_FRAMES 8     // Must be a power of two.
+
+typedef struct {
+    uint16_t leds;            // Pad LEDs to show.
+    uint8_t ms;               // How long to show them for.
+    uint8_t exp_leds : 4;     // Expansion port LEDs to show.
+    uint8_t repeat : 4;       // Show again this many times, one LED along.
+} led_frame_t;
+
+static led_frame_t s_anim[LED_ANIM_FRAMES];
+static uint8_t s_anim_head = 0;     // Frame showing, or next to show.
+static uint8_t s_anim_count = 0;    // Frames in the queue.
+static bool s_anim_showing = false; // The head frame is on the LEDs.
+static uint8_t s_anim_repeat = 0;   // Repeats left of the head frame.
+static uint16_t s_anim_leds = 0;    // Pads of the head frame, as moved.
+static uint16_t s_anim_tick = 0;    // When the head frame went up.
+
+// Add a frame to the end of the queue. Returns false if the queue is full
+// and the frame was dropped.
+//
+bool led_anim_push(uint16_t leds, uint8_t exp_leds, uint8_t ms, uint8_t repeat)
+{
+    if (s_anim_count >= LED_ANIM_FRAMES) return false;
+    led_frame_t* frame =
+        &s_anim[(s_anim_head + s_anim_count) & (LED_ANIM_FRAMES - 1)];
+    frame->leds = leds;
+    frame->ms = ms;
+    frame->exp_leds = exp_leds;
+    frame->repeat = repeat;
+    ++s_anim_count;
+    return true;
+}
+
+// Drop every queued frame, including the one showing.
+//
+void led_anim_clear(void)
+{
+    s_anim_count = 0;
+    s_anim_showing = false;
+}
+
+static void led_anim_show(const led_frame_t* frame)
+{
+    led_set_state(s_anim_leds);
+    exp_set_key_led(frame->exp_leds);
+    s_anim_tick = key_tick();
+}
+
+// Move the animation along. Returns true while a frame is showing and owns
+// the LEDs.
+//
+bool led_anim_update(void)
+{
+    while (s_anim_count) {
+        const led_frame_t* frame = &s_anim[s_anim_head];
+        if (!s_anim_showing) {
+            s_anim_showing = true;
+            s_anim_repeat = frame->repeat;
+            s_anim_leds = frame->leds;
+            led_anim_show(frame);
+            return true;
+        }
+        if ((uint16_t)(key_tick() - s_anim_tick) < frame->ms) return true;
+        if (s_anim_repeat) {
+            --s_anim_repeat;
+            s_anim_leds <<= 1;
+            led_anim_show(frame);
+            return true;
+        }
+        s_anim_head = (s_anim_head + 1) & (LED_ANIM_FRAMES - 1);
+        --s_anim_count;
+        s_anim_showing = false;
+    }
+    return false;
+}
+
+// Play the rest of the queue out with blocking delays. Only for startup,
+// before the interrupts are running the key tick, or just before something
+// that blocks anyway.
+//
+void led_anim_finish(void)
+{
+    for (; s_anim_count; --s_anim_count) {
+        const led_frame_t* frame = &s_anim[s_anim_head];
+        uint16_t leds = frame->leds;
+        for (uint8_t r=0; r<=frame->repeat; ++r) {
+            led_set_state(leds);
+            exp_set_key_led(frame->exp_leds);
+            for (uint8_t ms=0; ms<frame->ms; ++ms) _delay_ms(1);
+            leds <<= 1;
+        }
+        s_anim_head = (s_anim_head + 1) & (LED_ANIM_FRAMES - 1);
+    }
+    s_anim_showing = false;
+}
+
 // Lightshow effects -----------------------------------------------------------
 
-// Turn each LED on for a short time, one by one.  Note the blocking
-// delays. Not designed to be used in any situation that requires immediate
-// response.
+// Turn each LED on for a short time, one by one. Queue it with
+// led_count_start() and it plays from the main loop, or play it straight
+// away here with blocking delays.
 //
+void led_count_start(void)
+{
+    led_anim_push(0x0001, 0, 60, 15);
+}
+
 void led_count_all_leds(void)
 {
-    const int kDelay = 60;
-    // Run through the LEDs turning them on one by one.
-    uint16_t value = 0;
-    for(uint8_t i=0; i<16; ++i) {
-        value = 1<<i;
-        led_set_state(value);
-        // This is a blocking wait, so don't use this function if you need
-        // timely USB service. It's purely decorative.
-        _delay_ms(kDelay);
+    led_count_start();
+    led_anim_finish();
+}
+
+// Confirmation flash of "pattern", four times on and off, moving it "shift"
+// LEDs along each time it comes back on (e.g. 0x000f and 4 lights each row
+// in turn). It replaces whatever was playing.
+//
+void led_flash(uint16_t pattern, uint8_t shift)
+{
+    led_anim_clear();
+    for (uint8_t i=0; i<4; ++i) {
+        led_anim_push(pattern, 0, 75, 0);
+        led_anim_push(0x0000, 0, 75, 0);
+        pattern <<= shift;
     }
 }
 
@@ -24,22 +24,46 @@
 #define _LED_H_INCLUDED
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+
+// Brightness levels -----------------
+
+#define LED_PLANES 4                             // Bits of brightness.
+#define LED_LEVEL_MAX ((1 << LED_PLANES) - 1)    // Fully on.
+#define LED_LEVEL_HALF 4
+#define LED_LEVEL_DIM 1
 
 // Import globals -------------------
 
 extern bool g_led_keypress_enable;   // Light the LED when a key is pressed?
 extern bool g_exp_led_keypress_enable;
 extern uint16_t g_led_state;         // Copy of the last led state set
-extern uint16_t g_led_groundfx_counter;   // Ground fx MIDI clock counter.
 
 // Basic functions ------------------
 
 void led_setup(void);
 void led_set_state(uint16_t new_state);
 void led_groundfx_state(bool state);
+void led_orient_configure(void);
+
+void led_set_dimmed(uint16_t full, uint16_t half, uint16_t dim);
+void led_set_levels(const uint8_t* level);
+uint8_t led_velocity_level(uint8_t velocity);
+
+ISR(TIMER1_COMPA_vect);
+
+// Animation -----------------------
+
+bool led_anim_push(uint16_t leds, uint8_t exp_leds, uint8_t ms, uint8_t repeat);
+void led_anim_clear(void);
+bool led_anim_update(void);
+void led_anim_finish(void);
 
 // Lightshow effects ----------------
 
+void led_count_start(void);
 void led_count_all_leds(void);
+void led_flash(uint16_t pattern, uint8_t shift);
 
 #endif // _LED_H_INCLUDED
@@ -27,6 +27,7 @@
 #include "menu.h"
 #include "eeprom.h"
 #include "expansion.h"
+#include "config.h"
 
 // The menu system.
 //
@@ -53,16 +54,15 @@
 // "g_midi_channel") you'll need to reverse the bits before you position it
 // into the display to keep the usual right-to-left reading of bit patterns.
 //
-// To add a bit of visual interest I added a simulated Pulse Wave Modulation
-// (PWM) on some of the LED values. Turning the LEDs on and off quickly
-// makes them appear dimly lit, so we get the effect of varying the LED
-// intensity. The LED is on for two beats and off for the rest of the period.
+// To add a bit of visual interest some of the LEDs are shown half bright or
+// dim, using the brightness levels of led_set_dimmed(). The LED interrupt
+// does the work, so the menu loop doesn't have to.
 //
 // This is pretty much the least well documented code in the entire system,
 // but it's a pretty basic Finite State Machine with a dispatch routine at
-// the top that gets called in an endless loop until the "finished" flag is
-// set by the top level menu. Because if this repeated polling at high
-// frequency the menu items should only react to keydown messages.
+// the top, menu_step(), that the main loop calls once per pass until the
+// top level menu exits. Because of this repeated polling at high frequency
+// the menu items should only react to keydown messages.
 //
 // NOTE: persistent values are only written if you exit through the
 // top-level "exit" button. If you reset before using that key your changes
@@ -88,15 +88,15 @@ typedef enum menu_state {
 // Which menu page is currently active.
 static menu_state g_menu_state = TOP_LEVEL;
 
-// The global flashing light timer and mask. The counter is incremented
-// every time through the menu loop and when it flips over to zero the mask
-// is inverted.  Lights that should be flashing can be ORed into the light
-// state to get the correct flashing effect, e.g.
+// The global flashing light timer and mask. The mask is inverted every
+// MENU_FLASH_MS milliseconds of the key read interrupt's tick. Lights that
+// should be flashing can be ORed into the light state to get the correct
+// flashing effect, e.g.
 //
 //     uint16_t fixed = 0x0300;
 //     uint16_t flashing = 0x000C0;
 //     uint16_t half = 0x6000;
-//     uint16_t lights = fixed | (flashing & flash_mask) | (half & half_mask);
+//     led_set_dimmed(fixed | (flashing & flash_mask), half, 0);
 //
 // gives us:
 //
@@ -107,10 +107,10 @@ static menu_state g_menu_state = TOP_LEVEL;
 //
 //  where "*" are fixed, "#" are flashing and "o" are half intensity lights.
 //
-static uint16_t dim_mask = 0xffff;
-static uint16_t half_mask = 0xffff;
 static uint16_t flash_mask = 0xffff;
-static uint16_t flash_counter = 4096; // the flash period
+static uint16_t flash_tick = 0;  // g_key_tick when the mask last flipped.
+
+#define MENU_FLASH_MS 250
 
 // Prototypes ------------------------------------------------------------------
 
@@ -121,7 +121,6 @@ void run_8bit_toggle(uint8_t *value, const uint16_t menu_item);
 void run_4bit_value(uint8_t *value, const uint16_t menu_item);
 void run_7bit_value(uint8_t *value, const uint16_t menu_item);
 
-void menu(void);
 bool menu_top_level(void);
 void menu_channel(void);
 void menu_velocity(void);
@@ -179,11 +178,11 @@ void run_bool_toggle(bool *value, const uint16_t menu_item)
     // Add the bar for the value.
     int16_t leds = (*value) ? 0b0000111100000000 : 0x0000;
     // Add in the dim background for the toggle bits
-    leds |= 0b0000111100000000 & dim_mask;
+    uint16_t dim = 0b0000111100000000;
     // Add the flashing exit light
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, 0, dim);
 
     // Process key presses.
     if (g_key_down & menu_item) {
@@ -206,11 +205,11 @@ void run_4bit_toggle(uint8_t *value, const uint16_t menu_item)
 
     int16_t leds = REVERSE_BYTE(*value) << 4;
     // Add in the dim background for the toggle bits
-    leds |= 0b0000111100000000 & dim_mask;
+    uint16_t dim = 0b0000111100000000;
     // Add the flashing exit lights
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, 0, dim);
 
     // Process key presses.
     // Multiple key presses are sorted out by importance: Exit buttons
@@ -239,11 +238,11 @@ void run_8bit_toggle(uint8_t *value, const uint16_t menu_item)
 
     int16_t leds = REVERSE_BYTE(*value) << 8;
     // Add in the dim background for the toggle bits
-    leds |= 0b1111111100000000 & dim_mask;
+    uint16_t dim = 0b1111111100000000;
     // Add the flashing exit lights
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, 0, dim);
 
     // Process key presses.
     // Multiple key presses are sorted out by importance: Exit buttons
@@ -271,13 +270,13 @@ void run_4bit_value(uint8_t *value, const uint16_t menu_item)
 
     int16_t leds = REVERSE_BYTE(*value & 0x0f) << 4;
     // Add in the dim background for the toggle bits
-    leds |= 0b0000111100000000 & dim_mask;
+    uint16_t dim = 0b0000111100000000;
     // Add the half bright incr/decr lights
-    leds |= 0x9000 & half_mask;
+    uint16_t half = 0x9000;
     // Add the flashing exit lights
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, half, dim);
 
     // Process key presses.
     // Multiple key presses are sorted out by importance: Exit buttons
@@ -313,13 +312,13 @@ void run_7bit_value(uint8_t *value, const uint16_t menu_item)
     // Add the 7-bit basenote value
     int16_t leds = REVERSE_BYTE(*value & 0x7f) << 4;
     // Add in the dim background for the toggle bits
-    leds |= 0b0000111111100000 & dim_mask;
+    uint16_t dim = 0b0000111111100000;
     // Add the half bright incr/decr lights
-    leds |= 0x9000 & half_mask;
+    uint16_t half = 0x9000;
     // Add the flashing exit light
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, half, dim);
 
     if (g_key_down & menu_item) {
         // exit key is pressed.
@@ -373,13 +372,13 @@ void run_3value_option(uint8_t *value, uint8_t menu_item)
     }
     int16_t leds = pattern;
     // Add in the dim background for the toggle bits
-    leds |= 0b0000111100000000 & dim_mask;
+    uint16_t dim = 0b0000111100000000;
     // Add the halfbright incr/decr lights
-    leds |= 0b1001000000000000 & half_mask;
+    uint16_t half = 0b1001000000000000;
     // Add the flashing exit lights
     leds |= menu_item & flash_mask;
     // Update LEDs.
-    led_set_state(leds);
+    led_set_dimmed(leds, half, dim);
 
     // Process key presses.
     // Multiple key presses are sorted out by importance: Exit buttons
@@ -400,81 +399,99 @@ void run_3value_option(uint8_t *value, uint8_t menu_item)
 }
 
 
+// Whether the menu has the keys and LEDs, see menu_start().
+static bool s_menu_active = false;
+
+// Take over the keys and LEDs for the menu. Nothing happens here beyond
+// setting up the state, the menu runs a step at a time from the main loop
+// through menu_step(), so USB carries on being serviced and the watchdog
+// stays on while the user is editing.
+//
+void menu_start(void)
+{
+    g_menu_state = TOP_LEVEL;
+    flash_mask = 0xffff;
+    flash_tick = key_tick();
+    // Start from the keys as they are now, so that the key held down to get
+    // here doesn't suddenly count as a keydown and launch a menu item.
+    key_event_flush();
+    s_menu_active = true;
+}
+
+bool menu_active(void)
+{
+    return s_menu_active;
+}
+
 // The main menu dispatcher, sending control to the correct routine
 // depending on which is the currently active menu page (called the
-// "state"). Once it returns the Midifighter can continue boot up.
+// "state"). Each call handles at most one key event from the key read
+// interrupt, so presses queued while the main loop was busy are taken in
+// order. Returns false once the menu has been exited.
 //
 // NOTE: values are not written to the EEPROM until we exit the menu through
 // the "exit button". This allows us to panic reset if we screw up.
 //
-void menu(void)
+bool menu_step(void)
 {
+    if (!s_menu_active) return false;
+
+    // Take the next key edge, if there is one. The menu pages only react
+    // to keydowns, so with nothing new there's nothing pressed.
+    if (!key_event_next()) {
+        g_key_down = 0;
+        g_key_up = 0;
+    }
+
+    // update the flashing light mask every MENU_FLASH_MS.
+    uint16_t now = key_tick();
+    if ((uint16_t)(now - flash_tick) >= MENU_FLASH_MS) {
+        flash_tick = now;
+        flash_mask = ~flash_mask;
+    }
+
     bool finished = false;
 
-    // Loop until the "menu exit" button has been selected.
-    while (!finished) {
-        // Read the key state once before dispatching to the current menu
-        // handler. No other function updates the key state from now on.
-        key_read();
-        key_calc();
-
-        // update the flashing light counter and masks.
-        --flash_counter;
-        if (flash_counter==0) {
-            flash_counter = 4096;
-            flash_mask = ~flash_mask;
-        }
-
-        // Simulate PWM for the dim and half masks.
-        if ((flash_counter & 0x3c) == 0) {
-            half_mask = 0xffff;
-        } else {
-            half_mask = 0x0000;
-        }
-
-        if ((flash_counter & 0x3fc) == 0) {
-            dim_mask = 0xffff;
-        } else {
-            dim_mask = 0x0000;
-        }
-
-
-        // Dispatch control to the current menu page.
-        switch (g_menu_state) {
-        case TOP_LEVEL:
-            finished = menu_top_level();
-            break;
-        case CHANNEL:
-            menu_channel();
-            break;
-        case VELOCITY:
-            menu_velocity();
-            break;
-        case BASENOTE:
-            menu_basenote();
-            break;
-        case KEYPRESS_LED:
-            menu_keypress_led();
-            break;
-        case FOUR_BANKS:
-            menu_fourbanks_mode();
-            break;
-            //        case READ_DIGITAL:
-            //            menu_read_digital();
-            //            break;
-            //        case READ_ANALOG:
-            //            menu_read_analog();
-            //            break;
-        }
+    // Dispatch control to the current menu page.
+    switch (g_menu_state) {
+    case TOP_LEVEL:
+        finished = menu_top_level();
+        break;
+    case CHANNEL:
+        menu_channel();
+        break;
+    case VELOCITY:
+        menu_velocity();
+        break;
+    case BASENOTE:
+        menu_basenote();
+        break;
+    case KEYPRESS_LED:
+        menu_keypress_led();
+        break;
+    case FOUR_BANKS:
+        menu_fourbanks_mode();
+        break;
+        //        case READ_DIGITAL:
+        //            menu_read_digital();
+        //            break;
+        //        case READ_ANALOG:
+        //            menu_read_analog();
+        //            break;
     }
 
+    if (!finished) return true;
+
     // We have exited the menu correctly, write the edited values back to
-    // the EEPROM.
+    // the EEPROM. The writes finish in the background.
+    s_menu_active = false;
     eeprom_save_edits();
+    config_revision_bump();
+    Midifighter_Configure();
 
-    // Everything done, return to the main loop to finish
-    // bootup.
-    return;
+    // Don't let the keys pressed in the menu turn into MIDI events.
+    key_event_flush();
+    return false;
 }
 
 // The first menu page, where each flashing light is one of the menu pages.
@@ -490,8 +507,7 @@ bool menu_top_level()
     //   . . . #  <- Flashing exit menu
 
     // Update the LED display.
-    uint16_t lights = (0x001F & half_mask) | (0x8000 & flash_mask);
-    led_set_state(lights);
+    led_set_dimmed(0x8000 & flash_mask, 0x001F, 0);
 
     // If one of the menu items has been selected, switch the menu state.
     switch (g_key_down) {
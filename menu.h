@@ -23,7 +23,11 @@
 #ifndef _MENU_H_INCLUDED
 #define _MENU_H_INCLUDED
 
+#include <stdbool.h>
+
 // Run the menu update ------------------
-void menu(void);
+void menu_start(void);
+bool menu_step(void);
+bool menu_active(void);
 
 #endif // _MENU_H_INCLUDED
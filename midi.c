@@ -27,6 +27,8 @@
 #include "usb_descriptors.h"
 #include "key.h"
 #include "midi.h"
+#include "sysex.h"
+#include "telemetry.h"
 
 // Global variables ------------------------------------------------------------
 
@@ -37,10 +39,10 @@ static USB_ClassInfo_MIDI_Device_t s_midi_interface = {
     .Config = {
         .StreamingInterfaceNumber = 1,
         .DataINEndpointNumber      = MIDI_STREAM_IN_EPNUM,
-        .DataINEndpointSize        = MIDI_STREAM_EPSIZE,
-        .DataINEndpointDoubleBank  = false,
+        .DataINEndpointSize        = MIDI_STREAM_IN_EPSIZE,
+        .DataINEndpointDoubleBank  = true,
         .DataOUTEndpointNumber     = MIDI_STREAM_OUT_EPNUM,
-        .DataOUTEndpointSize       = MIDI_STREAM_EPSIZE,
+        .DataOUTEndpointSize       = MIDI_STREAM_OUT_EPSIZE,
         .DataOUTEndpointDoubleBank = false,
     },
 };
@@ -75,16 +77,240 @@ const uint8_t kNoteMap[16] PROGMEM = {
 uint8_t g_midi_channel = 14;      // MIDI channel to listen and send on (0..15)
 uint8_t g_midi_velocity = 74;     // Default velocity for NoteOn (0..127)
 
-// A copy of the most recent velocity for each MIDI note.
-uint8_t g_midi_note_state[MIDI_MAX_NOTES];
+// One bit for each MIDI note, set while the host has the note on.
+uint8_t g_midi_note_state[MIDI_MAX_NOTES / 8];
+
+#ifdef MIDI_NOTE_VELOCITY
+// The most recent velocity of the notes that can be shown on the keys,
+// four bits per note.
+static uint8_t s_midi_note_velocity[MIDI_VELOCITY_NOTES / 2];
+#endif
+
+// The note sent by each key in the current bank, see midi_key_table_update().
+uint8_t g_midi_key_note[16];
+static uint8_t s_midi_key_mode = 0xff;  // Fourbanks mode of the table.
+static uint8_t s_midi_key_bank = 0xff;  // Bank of the table.
+
+// The LEDs lit by the MIDI note state, one word per bank of keys, plus the
+// four digital expansion port notes. Kept up to date by
+// midi_note_state_set() so the main loop doesn't have to search the note
+// state for them.
+uint16_t g_midi_led_bank[4];
+uint8_t g_midi_led_digital;
+uint8_t g_midi_led_mode = FOURBANKS_OFF; // Fourbanks mode of the bank LEDs.
+bool g_midi_led_dirty = true;            // LED bitmaps changed.
 
 // Save a little storage by preallocating and reusing space for the MIDI
 // event packet.
 static MIDI_EventPacket_t midi_event;
 
+// Outbound packets that didn't fit into the IN endpoint banks, waiting for
+// the host to collect a bank. Only used from the main loop.
+static MIDI_EventPacket_t s_midi_queue[MIDI_QUEUE_SIZE];
+static uint8_t s_midi_queue_head = 0;  // Next slot to write.
+static uint8_t s_midi_queue_tail = 0;  // Next slot to send.
+
+// Control Changes waiting to be sent, at most one per controller so a
+// fader sweep that outpaces the host only sends the latest value. A slot
+// with a zero Command is empty.
+static MIDI_EventPacket_t s_midi_cc_slot[MIDI_CC_SLOTS];
+
+// Set by the USB Start Of Frame interrupt, cleared when the partly filled
+// IN bank has been handed to the host for the frame.
+static volatile bool s_midi_frame = false;
+
+
+// Outbound queue -------------------------------------------------------------
+//
+// MIDI events are written straight into the IN endpoint, which is double
+// banked so we can fill one bank while the host is reading the other. A
+// bank is handed to the host as soon as it holds 16 packets, otherwise once
+// per USB frame from midi_flush(), so a burst of events goes out in as few
+// 64 byte transfers as possible. If both banks are waiting on the host the
+// packets are held in a small RAM queue.
+//
+// There are two classes of traffic. Notes, bank notes, SysEx and the
+// Ableton mode CCs go through the ordered queue and are never dropped or
+// reordered. Fader CCs wait in a set of slots that only hold the most
+// recent value for each controller and are sent once the ordered queue is
+// empty, so a busy crossfader can't hold up the pads.
+
+// Try to write one packet into the current IN bank, returning false if
+// there's no room in either bank.
+//
+static bool midi_write_packet(const MIDI_EventPacket_t* event)
+{
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (!Endpoint_IsReadWriteAllowed()) return false;
+    const uint8_t* data = (const uint8_t*)event;
+    Endpoint_Write_Byte(data[0]);
+    Endpoint_Write_Byte(data[1]);
+    Endpoint_Write_Byte(data[2]);
+    Endpoint_Write_Byte(data[3]);
+    // Send the bank as soon as it's full, which switches us to the other
+    // bank if the host has finished with it.
+    if (!Endpoint_IsReadWriteAllowed()) {
+        Endpoint_ClearIN();
+    }
+    return true;
+}
+
+// Move as much of the RAM queue into the endpoint banks as will fit.
+//
+static void midi_drain_queue(void)
+{
+    while (s_midi_queue_tail != s_midi_queue_head &&
+           midi_write_packet(&s_midi_queue[s_midi_queue_tail])) {
+        s_midi_queue_tail = (s_midi_queue_tail + 1) & (MIDI_QUEUE_SIZE - 1);
+    }
+}
+
+// Send a USB-MIDI event packet to the host, keeping the events in order.
+// Only blocks if both endpoint banks and the RAM queue are full, in which
+// case we wait for the host just like MIDI_Device_SendEventPacket() would.
+//
+void midi_queue_packet(const MIDI_EventPacket_t* event)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    midi_drain_queue();
+    if (s_midi_queue_tail == s_midi_queue_head && midi_write_packet(event)) {
+        return;
+    }
+
+    uint8_t next = (s_midi_queue_head + 1) & (MIDI_QUEUE_SIZE - 1);
+    while (next == s_midi_queue_tail) {
+        // Everything is full, wait for the host to take a bank. If it never
+        // does, drop the event rather than locking up.
+        TELEMETRY_COUNT(in_waits);
+        Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+        if (Endpoint_WaitUntilReady() != ENDPOINT_READYWAIT_NoError) {
+            TELEMETRY_COUNT(in_drops);
+            return;
+        }
+        midi_drain_queue();
+    }
+    s_midi_queue[s_midi_queue_head] = *event;
+    s_midi_queue_head = next;
+}
+
+// Queue a Control Change in the low priority CC lane, replacing any value
+// still waiting to be sent to the same controller. If every slot is taken
+// by other controllers the CC goes through the ordered queue instead, so
+// nothing is lost.
+//
+void midi_queue_cc(const MIDI_EventPacket_t* event)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    MIDI_EventPacket_t* free_slot = NULL;
+    for (uint8_t i=0; i<MIDI_CC_SLOTS; ++i) {
+        MIDI_EventPacket_t* slot = &s_midi_cc_slot[i];
+        if (slot->Command == 0) {
+            if (!free_slot) free_slot = slot;
+        } else if (slot->Data1 == event->Data1 &&
+                   slot->Data2 == event->Data2) {
+            // Latest value wins.
+            slot->Data3 = event->Data3;
+            return;
+        }
+    }
+    if (free_slot) {
+        *free_slot = *event;
+    } else {
+        midi_queue_packet(event);
+    }
+}
+
+// Send waiting CCs while there is room in the endpoint, but only once all
+// the ordered traffic has gone.
+//
+static void midi_drain_cc(void)
+{
+    if (s_midi_queue_tail != s_midi_queue_head) return;
+    for (uint8_t i=0; i<MIDI_CC_SLOTS; ++i) {
+        MIDI_EventPacket_t* slot = &s_midi_cc_slot[i];
+        if (slot->Command == 0) continue;
+        if (!midi_write_packet(slot)) return;
+        slot->Command = 0;
+    }
+}
+
+// Called from the frame slot, just before each USB frame starts. The next
+// midi_flush() hands a partly filled bank to the host, so it goes out in
+// that frame.
+//
+void midi_end_of_frame(void)
+{
+    s_midi_frame = true;
+}
+
+// Push queued packets into the endpoint and, once per USB frame, hand a
+// partly filled bank to the host. Call this from the main loop after
+// generating events, it never waits for the host.
+//
+void midi_flush(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    midi_drain_queue();
+    midi_drain_cc();
+    if (!s_midi_frame) return;
+    s_midi_frame = false;
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (Endpoint_BytesInEndpoint() && Endpoint_IsReadWriteAllowed()) {
+        Endpoint_ClearIN();
+    }
+}
+
+// Push everything queued so far to the host straight away, without waiting
+// for the next USB frame. For replies whose timing is being measured, this
+// still never waits for the host: if both banks are busy the packets go
+// out as soon as one comes free, as usual.
+//
+void midi_flush_now(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) return;
+
+    midi_drain_queue();
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (Endpoint_BytesInEndpoint() && Endpoint_IsReadWriteAllowed()) {
+        Endpoint_ClearIN();
+    }
+}
+
 
 // MIDI functions -------------------------------------------------------------
 
+// Set the LEDs from the host a whole frame at a time, rather than with a
+// NoteOn or NoteOff per LED:
+//
+//   F0 00 mid mid 07 digital bank leds[3] [bank leds[3] ...] F7
+//
+// digital is the four expansion port LEDs (bit 0 = first), then each bank
+// number (0..3, or 0x7f for the selected bank) is followed by its 16 key
+// LEDs in three 7-bit bytes, high bits first. Everything changes in the
+// same main loop pass, so the LEDs never show half a frame.
+//
+static void sysExCmdLedFrame (SysEx_t* sysex, uint8_t* payload)
+{
+    uint8_t size = sysex_payload_size(sysex);
+    if (size < 1) return;
+    uint8_t digital = payload[0];
+    if (size < 5) {
+        midi_led_frame(0xff, 0, digital);
+        return;
+    }
+    for (uint8_t i=1; i+4<=size; i+=4) {
+        uint8_t bank = payload[i];
+        if (bank == 0x7f) bank = g_key_bank_selected;
+        uint16_t leds = ((uint16_t)payload[i+1] << 14) |
+                        ((uint16_t)payload[i+2] << 7) |
+                        payload[i+3];
+        midi_led_frame(bank, leds, digital);
+    }
+}
+
 // Initialize the MIDI key state.
 void midi_setup(void)
 {
@@ -93,7 +319,183 @@ void midi_setup(void)
 
     // basenote, expnote, channel and velocity have already been set up via
     // the EEPROM settings. Clear the MIDI keystate.
-    memset(g_midi_note_state, 0, MIDI_MAX_NOTES);
+    memset(g_midi_note_state, 0, sizeof(g_midi_note_state));
+#ifdef MIDI_NOTE_VELOCITY
+    memset(s_midi_note_velocity, 0, sizeof(s_midi_note_velocity));
+#endif
+    memset(s_midi_cc_slot, 0, sizeof(s_midi_cc_slot));
+    midi_led_rebuild();
+
+    sysex_install(SYSEX_COMMAND_LED_FRAME, sysExCmdLedFrame);
+}
+
+// Note state and LEDs --------------------------------------------------------
+
+// Set or clear the LED bit used by a single note under the fourbanks mode
+// the LED bitmaps were built for.
+//
+static void midi_led_note(const uint8_t note, const bool on)
+{
+    const uint8_t MIDI_DIGITAL_NOTE = 4;  // lowest digital note.
+
+    if (note >= MIDI_DIGITAL_NOTE && note < MIDI_DIGITAL_NOTE + 4) {
+        uint8_t bit = 1 << (note - MIDI_DIGITAL_NOTE);
+        if (on) {
+            g_midi_led_digital |= bit;
+        } else {
+            g_midi_led_digital &= ~bit;
+        }
+        g_midi_led_dirty = true;
+        return;
+    }
+
+    if (note < MIDI_BASE_NOTE) return;
+
+    // Find which bank and key the note belongs to.
+    uint8_t banksize = 16;
+    uint8_t numbanks = 1;
+    if (g_midi_led_mode == FOURBANKS_INTERNAL) {
+        banksize = 12;
+        numbanks = 4;
+    } else if (g_midi_led_mode == FOURBANKS_EXTERNAL) {
+        numbanks = 4;
+    }
+    uint8_t keynum = note - MIDI_BASE_NOTE;
+    uint8_t bank = 0;
+    while (keynum >= banksize) {
+        keynum -= banksize;
+        if (++bank >= numbanks) return;  // Not shown on any bank.
+    }
+
+    uint16_t bit = 1 << pgm_read_byte(&kNoteMap[keynum]);
+    if (on) {
+        g_midi_led_bank[bank] |= bit;
+    } else {
+        g_midi_led_bank[bank] &= ~bit;
+    }
+    g_midi_led_dirty = true;
+}
+
+// Record the velocity of a MIDI note without touching the LED bitmaps.
+//
+static void midi_note_record(const uint8_t n, const uint8_t velocity)
+{
+    uint8_t bit = 1 << (n & 0x07);
+    if (velocity > 0) {
+        g_midi_note_state[n >> 3] |= bit;
+    } else {
+        g_midi_note_state[n >> 3] &= ~bit;
+    }
+#ifdef MIDI_NOTE_VELOCITY
+    uint8_t slot = n - MIDI_BASE_NOTE;
+    if (slot < MIDI_VELOCITY_NOTES) {
+        // Keep the top four bits of the velocity.
+        uint8_t* pair = &s_midi_note_velocity[slot >> 1];
+        uint8_t value = (velocity >> 3) & 0x0f;
+        if (slot & 0x01) {
+            *pair = (*pair & 0x0f) | (value << 4);
+        } else {
+            *pair = (*pair & 0xf0) | value;
+        }
+    }
+#endif
+}
+
+// Record the velocity of a MIDI note, keeping the LED bitmaps in step. A
+// zero velocity turns the note off.
+//
+void midi_note_state_set(const uint8_t note, const uint8_t velocity)
+{
+    uint8_t n = note & 0x7f;
+    midi_note_record(n, velocity);
+    midi_led_note(n, velocity > 0);
+}
+
+// Set every LED of one bank, and the expansion port LEDs, in one go. The
+// notes behind them are turned on (at full velocity) or off to match, as
+// if the host had sent a NoteOn or NoteOff for each, so the LEDs come back
+// the same after a midi_led_rebuild(). "leds" is in the led_set_state()
+// layout; in fourbanks internal mode the top row shows the selected bank
+// and its bits are ignored.
+//
+void midi_led_frame(const uint8_t bank, const uint16_t leds,
+                    const uint8_t digital)
+{
+    const uint8_t MIDI_DIGITAL_NOTE = 4;  // lowest digital note.
+
+    if (g_midi_led_mode != g_key_fourbanks_mode) {
+        midi_led_rebuild();
+    }
+
+    for (uint8_t i=0; i<4; ++i) {
+        midi_note_record(MIDI_DIGITAL_NOTE + i, (digital & (1 << i)) ? 127 : 0);
+    }
+    g_midi_led_digital = digital & 0x0f;
+
+    uint8_t banksize = 16;
+    uint8_t numbanks = 1;
+    if (g_midi_led_mode == FOURBANKS_INTERNAL) {
+        banksize = 12;
+        numbanks = 4;
+    } else if (g_midi_led_mode == FOURBANKS_EXTERNAL) {
+        numbanks = 4;
+    }
+    if (bank < numbanks) {
+        uint8_t note = MIDI_BASE_NOTE + bank * banksize;
+        uint16_t shown = 0;
+        for (uint8_t keynum=0; keynum<banksize; ++keynum) {
+            uint16_t bit = 1 << pgm_read_byte(&kNoteMap[keynum]);
+            midi_note_record(note + keynum, (leds & bit) ? 127 : 0);
+            shown |= bit;
+        }
+        g_midi_led_bank[bank] = leds & shown;
+    }
+    g_midi_led_dirty = true;
+}
+
+// Is the MIDI note currently on?
+//
+bool midi_note_is_on(const uint8_t note)
+{
+    uint8_t n = note & 0x7f;
+    return (g_midi_note_state[n >> 3] & (1 << (n & 0x07))) != 0;
+}
+
+// Return the velocity of a MIDI note, or zero if it is off. Without
+// MIDI_NOTE_VELOCITY, or for notes that can't be shown on the keys, only
+// on and off are recorded and notes that are on report full velocity.
+//
+uint8_t midi_note_velocity(const uint8_t note)
+{
+    if (!midi_note_is_on(note)) return 0;
+#ifdef MIDI_NOTE_VELOCITY
+    uint8_t slot = (note & 0x7f) - MIDI_BASE_NOTE;
+    if (slot < MIDI_VELOCITY_NOTES) {
+        uint8_t pair = s_midi_note_velocity[slot >> 1];
+        uint8_t value = (slot & 0x01) ? (pair >> 4) : (pair & 0x0f);
+        // Fill the dropped low bits so the top of the range is 127. A
+        // velocity that lost everything in the top bits is still on.
+        return value ? ((value << 3) | 0x07) : 1;
+    }
+#endif
+    return 127;
+}
+
+// Regenerate the LED bitmaps from the MIDI note state for the current
+// fourbanks mode. Needed whenever the fourbanks mode changes, as that moves
+// notes to different keys.
+//
+void midi_led_rebuild(void)
+{
+    memset(g_midi_led_bank, 0, sizeof(g_midi_led_bank));
+    g_midi_led_digital = 0;
+    g_midi_led_mode = g_key_fourbanks_mode;
+    for (uint8_t i=0; i<MIDI_MAX_NOTES; ++i) {
+        if (midi_note_is_on(i)) {
+            midi_led_note(i, true);
+        }
+    }
+    g_midi_led_dirty = true;
 }
 
 // Append a MIDI note change event (note on or off) to the currently
@@ -104,7 +506,7 @@ void midi_setup(void)
 //
 // NOTE: The endpoint can contain 64 bytes and each MIDI-USB message is 4
 // bytes giving us just enough space to fit in, for example, 16 keydown
-// messages.
+// messages. See midi_queue_packet() for what happens after that.
 //
 void midi_stream_note(const uint8_t pitch, const bool onoff)
 {
@@ -123,11 +525,11 @@ void midi_stream_note(const uint8_t pitch, const bool onoff)
     midi_event.Data2       = pitch & 0x7f;   // 0..127
     midi_event.Data3       = g_midi_velocity & 0x7f; // 0..127
 
-    MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+    midi_queue_packet(&midi_event);
 }
 
-// Append a Control Change Event to the currently selected USB Endpoint. If
-// the endpoint is full it will be flushed.
+// Queue a Control Change Event in the low priority CC lane, to be sent after
+// any notes. Only the latest value for each controller is kept.
 //
 //  controller   Number of the controller to alter.
 //  value        Value to send to the CC.
@@ -144,7 +546,7 @@ void midi_stream_cc(const uint8_t controller, const uint8_t value)
     midi_event.Data2       = controller & 0x7f;   // 0..127
     midi_event.Data3       = value & 0x7f;  // 0..127
 
-    MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+    midi_queue_cc(&midi_event);
 }
 
 // Used to send a note on a specific channel
@@ -165,7 +567,7 @@ void midi_stream_note_ch(const uint8_t channel,
 	midi_event.Data2       = pitch & 0x7f;   // 0..127
 	midi_event.Data3       = g_midi_velocity & 0x7f; // 0..127
 
-	MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+	midi_queue_packet(&midi_event);
 }
 
 void midi_stream_raw_cc(const uint8_t channel,
@@ -179,7 +581,7 @@ void midi_stream_raw_cc(const uint8_t channel,
 	midi_event.Data1       = command | (channel & 0x0f); // 0..15
 	midi_event.Data2       = cc & 0x7f;   // 0..127
 	midi_event.Data3       = value & 0x7f;  // 0..127
-	MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+	midi_queue_packet(&midi_event);
 }
 
 void midi_stream_sysex (const uint8_t length, uint8_t* data)
@@ -208,7 +610,7 @@ void midi_stream_sysex (const uint8_t length, uint8_t* data)
         }
         midi_event.Data2       = *data++;
         midi_event.Data3       = *data++;
-        MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+        midi_queue_packet(&midi_event);
         num -= 3;
     }
     if (num) {
@@ -228,7 +630,7 @@ void midi_stream_sysex (const uint8_t length, uint8_t* data)
             midi_event.Data2    = *data++;
             midi_event.Data3    = *data++;
         }
-        MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+        midi_queue_packet(&midi_event);
     }
 }
 
@@ -275,6 +677,23 @@ uint8_t midi_fourbanks_key_to_note(const uint8_t keynum)
     return pgm_read_byte(&kNoteMap[keynum]) + offset;
 }
 
+// Make sure g_midi_key_note[] holds the notes for the current fourbanks
+// mode and bank, so the key handling only needs a table lookup per key.
+// Costs nothing unless the mode or bank has changed.
+//
+void midi_key_table_update(void)
+{
+    if (s_midi_key_mode == g_key_fourbanks_mode &&
+        s_midi_key_bank == g_key_bank_selected) {
+        return;
+    }
+    s_midi_key_mode = g_key_fourbanks_mode;
+    s_midi_key_bank = g_key_bank_selected;
+    for (uint8_t i=0; i<16; ++i) {
+        g_midi_key_note[i] = midi_fourbanks_key_to_note(i);
+    }
+}
+
 // Convert a fourbanks note to a key number, taking into account whether we
 // have internal or external fourbanks mode.
 //
@@ -41,6 +41,14 @@ typedef struct
     uint8_t Data3; // Third byte of data in the MIDI event
 } USB_MIDI_EventPacket_t;
 
+// Number of outbound packets that can wait for the host in RAM once both
+// IN endpoint banks are full. Must be a power of two.
+#define MIDI_QUEUE_SIZE 8
+
+// Number of different controllers that can have a CC waiting to be sent,
+// enough for the two CCs of each analog input.
+#define MIDI_CC_SLOTS 8
+
 // MIDI global variables -------------------------------------------------------
 
 extern USB_ClassInfo_MIDI_Device_t* g_midi_interface_info;
@@ -48,18 +56,45 @@ extern USB_ClassInfo_MIDI_Device_t* g_midi_interface_info;
 extern uint8_t g_midi_channel;
 extern uint8_t g_midi_velocity;
 
-// a copy of the most recent velocity for each MIDI note.
-extern uint8_t g_midi_note_state[MIDI_MAX_NOTES];
+// One bit per MIDI note, set while the note is on. Use the midi_note_*
+// functions rather than reading this directly.
+extern uint8_t g_midi_note_state[MIDI_MAX_NOTES / 8];
+
+// With MIDI_NOTE_VELOCITY defined, velocities are also kept (to 4 bits) for
+// the notes starting at MIDI_BASE_NOTE that can be shown on the keys in
+// one of the fourbanks modes.
+#define MIDI_VELOCITY_NOTES 64
+
+// The note sent by each key, given the fourbanks mode and selected bank.
+extern uint8_t g_midi_key_note[16];
+
+// LEDs lit by the MIDI note state, see midi_note_state_set().
+extern uint16_t g_midi_led_bank[4];  // Key LEDs for each bank.
+extern uint8_t g_midi_led_digital;   // Expansion port LEDs.
+extern uint8_t g_midi_led_mode;      // Fourbanks mode the banks are built for.
+extern bool g_midi_led_dirty;        // Set when any of the above change.
 
 // MIDI function prototypes ----------------------------------------------------
 
 void midi_setup(void);
+void midi_queue_packet(const MIDI_EventPacket_t* event);
+void midi_queue_cc(const MIDI_EventPacket_t* event);
+void midi_end_of_frame(void);
+void midi_flush(void);
+void midi_flush_now(void);
+void midi_note_state_set(const uint8_t note, const uint8_t velocity);
+bool midi_note_is_on(const uint8_t note);
+uint8_t midi_note_velocity(const uint8_t note);
+void midi_led_rebuild(void);
+void midi_led_frame(const uint8_t bank, const uint16_t leds,
+                    const uint8_t digital);
 void midi_stream_note(const uint8_t pitch, const bool onoff);
 void midi_stream_note_ch(const uint8_t channel, const uint8_t note, const bool onoff);
 void midi_stream_cc(const uint8_t controller, const uint8_t value);
 uint8_t midi_note_to_key(const uint8_t notenum);
 uint8_t midi_key_to_note(const uint8_t keynum);
 uint8_t midi_fourbanks_key_to_note(const uint8_t keynum);
+void midi_key_table_update(void);
 uint8_t midi_fourbanks_note_to_key(const uint8_t note);
 void midi_stream_raw_cc(const uint8_t channel,
 						const uint8_t cc,
@@ -36,6 +36,12 @@
 #include "sysex.h"
 #include "config.h"
 #include "combo.h"
+#include "fader.h"
+#include "timer.h"
+#include "profile.h"
+#include "tempo.h"
+#include "telemetry.h"
+#include "stress.h"
 #include "jumptoboot.h"
 
 // Forward Declarations --------------------------------------------------------
@@ -48,44 +54,26 @@ void EVENT_USB_Device_Connect(void);
 void EVENT_USB_Device_Disconnect(void);
 void EVENT_USB_Device_ConfigurationChanged(void);
 void EVENT_USB_Device_UnhandledControlRequest(void);
+void EVENT_USB_Device_StartOfFrame(void);
 
 static bool main_watchdog_flag = false;
 
-// Helper functions ------------------------------------------------------------
-
-uint8_t remap(uint8_t value, uint8_t from, uint8_t to, uint8_t lo, uint8_t hi)
-{
-    // Remap the values in the range [lo..hi] into the values [from..to]
-    // e.g. remap the value in the range 3..124 into values 0..127 with a
-    // dead zone at either end.
-
-    //    d      e
-    // 2  D2=64  E2=124   from, to
-    // 3  D3=0   E3=127    lo, hi
-
-    // =IF(A15 < $D$2 , $D$3 ,
-    //     IF(A15 > $E$2, $E$3,
-    //         $D$3 + FLOOR( FLOOR((A15-$D$2)*($E$3-$D$3),1) / floor($E$2-$D$2,1) ,1)))
-
-    // IF(A15 < from)  lo
-    // IF(A15 > to) hi
-    // else lo +  (A15-from) * (hi-lo) ) / (to-from)
-
-    if (value < from) return lo;
-    if (value > to) return hi;
-    uint16_t numer = (value - from) * (hi - lo);
-    uint16_t denom = (to - from);
-    return (uint8_t)(lo + (numer / denom));
-}
+// Expansion port pins generate the MIDI notes 4 to 7.
+#define MIDI_DIGITAL_NOTE 4  // lowest digital note.
 
 // USB Tasks and Events --------------------------------------------------------
 
+// Connect and Disconnect come from the USB interrupt, which can't wait for
+// the SPI bus (see spi_acquire()), so they leave the LEDs to show here for
+// the main loop.
+static volatile uint8_t s_usb_leds = 0;
+
 // We are in the process of enumerating but not yet ready to generate MIDI.
 //
 void EVENT_USB_Device_Connect(void)
 {
     // Indicate that USB is enumerating.
-    led_set_state(0x0002);
+    s_usb_leds = 0x02;
 }
 
 // The device is no longer connected to a host.
@@ -93,32 +81,39 @@ void EVENT_USB_Device_Connect(void)
 void EVENT_USB_Device_Disconnect(void)
 {
     // Indicate that USB is disconnected.
-    led_set_state(0x0001);
+    s_usb_leds = 0x01;
 }
 
 // Device has enumerated. Set up the Endpoints.
 //
 void EVENT_USB_Device_ConfigurationChanged(void)
 {
-    // Indicate that USB is now ready to use (followed by a short delay so
-    // you can actually see it flash).
-    led_set_state(0x0004);
-
     // Allow the LUFA MIDI Class drivers to configure the USB endpoints.
+    uint16_t leds = 0x0004;  // Indicate that USB is now ready to use.
     if (!MIDI_Device_ConfigureEndpoints(g_midi_interface_info)) {
         // Setting up the endpoints failed, display the error state.
-        led_set_state(0x0008);
+        leds = 0x0008;
     }
 
-    // Success. Add a short delay so the final USB state LEDs can be seen
-    // before the MIDI task takes over the LEDs.
-    _delay_ms(40);
-    led_set_state(0x0000);
+    // Use the Start Of Frame interrupt to lock the key scans to the host.
+    USB_Device_EnableSOFEvents();
+
+    // Show the final USB state long enough to be seen before the MIDI task
+    // takes over the LEDs again.
+    led_anim_push(leds, 0, 40, 0);
 	// Now we can enable the watchdog timer
 	MCUSR &= ~(1 << WDRF);  // clear the watchdog reset flag
 	wdt_enable(WDTO_120MS);
 }
 
+// Start of a new USB frame, once every millisecond. Keep the key scans
+// in step with the host, see frame_slot().
+//
+void EVENT_USB_Device_StartOfFrame(void)
+{
+    key_frame_sync();
+}
+
 // Any other USB control command that we don't recognize is handled here.
 //
 void EVENT_USB_Device_UnhandledControlRequest(void)
@@ -167,6 +162,577 @@ void EVENT_USB_Device_UnhandledControlRequest(void)
 // }
 
 
+// Configuration handlers ------------------------------------------------------
+
+// The parts of the task that depend on the settings come in one variant per
+// mode. Midifighter_Configure() picks them whenever the settings change, so
+// the loop itself never has to look at the settings.
+//
+typedef struct {
+    void (*keys)(void);                 // Bank handling and pad MIDI.
+    void (*note)(uint8_t note, bool on);// One pad going down or up.
+    void (*combos)(void);               // Combo recognition, if enabled.
+    uint16_t (*leds)(uint16_t* full);   // Compose the LEDs.
+    void (*fader)(uint8_t i, uint8_t value, uint8_t prev_value);
+} handlers_t;
+
+static handlers_t s_handlers;
+
+// Keys whose LED lights while pressed, taken from the keypress LED setting.
+static uint16_t s_led_keypress_mask = 0;
+static uint8_t s_exp_led_keypress_mask = 0;
+
+// Sliders to turn upside down, from INVERT_SLIDER_* and the rotate setting.
+static uint8_t s_fader_invert = 0;
+
+static void handler_none(void)
+{
+}
+
+// Key events ----------------------------------------------------------------
+
+// Generate MIDI events for the digital input ports.
+//
+static void send_exp_keys(void)
+{
+    PROFILE_START(exp_keys);
+    uint8_t bit = 0x01;
+    for(uint8_t i=0; i<4; ++i) {
+        if (g_exp_key_down & bit) {
+            // There's a key down, generate a NoteOn
+            midi_stream_note(MIDI_DIGITAL_NOTE + i, true);
+        }
+        if (g_exp_key_up & bit) {
+            // There's a key up, insert a NoteOff
+            midi_stream_note(MIDI_DIGITAL_NOTE + i, false);
+        }
+        bit <<= 1;
+    }
+    PROFILE_END(PROFILE_EXP_KEYS, exp_keys);
+}
+
+// Generate MIDI events for the bank select keys and then for the pads,
+// starting from "keyoffset" in the note table for this bank.
+//
+static void send_pads(uint16_t bank_keydown, uint16_t bank_keyup,
+                      uint16_t bank_keystate, uint16_t keydown,
+                      uint16_t keyup, uint8_t keyoffset)
+{
+    PROFILE_START(pads);
+
+    // Update the active bank
+    // ----------------------
+    if (bank_keydown & 0x000f) {
+        // The bank selected will be the most recently pressed key. If
+        // multiple keys are pressed at the same instant, choose the
+        // leftmost key.
+        uint8_t bank_bit = 1;
+        uint8_t new_bank = 0;
+        while (!(bank_keydown & bank_bit) && new_bank < 4) {
+            bank_bit <<= 1;
+            ++new_bank;
+        }
+        // Force a NoteOff if a new bank has been selected but the
+        // previous bank is still depressed.
+        if ((g_key_bank_selected != new_bank) &&
+            (bank_keystate & (1<<g_key_bank_selected))) {
+            // NoteOff the old bank.
+            midi_stream_note(g_key_bank_selected, false);
+        }
+        // NoteOn for the new bank every time it's pressed.
+        midi_stream_note(new_bank, true);
+        g_key_bank_selected = new_bank;
+    }
+
+    if (bank_keyup & 0x000f) {
+        // NoteOff only for the currently selected bank.
+        uint8_t bank_bit = 1 << g_key_bank_selected;
+        if (bank_keyup & bank_bit) {
+            midi_stream_note(g_key_bank_selected, false);
+        }
+    }
+
+    // Send MIDI messages for the keys that changed, converting key numbers
+    // to MIDI notes using the note table for this bank. Only the set bits
+    // are visited, lowest key first, so an idle pass costs nothing.
+    midi_key_table_update();
+    uint16_t changed = keydown | keyup;
+    while (changed) {
+        uint16_t bit = rightmost_bit_16(changed);
+        changed &= ~bit;
+        uint8_t note = g_midi_key_note[bit_index_16(bit) + keyoffset];
+        if (keydown & bit) {
+            // There's a key down, put a NoteOn event into the stream.
+            s_handlers.note(note, true);
+        }
+        if (keyup & bit) {
+            // There's a key up, put a NoteOff event onto the stream.
+            s_handlers.note(note, false);
+        }
+    }
+
+    PROFILE_END(PROFILE_PADS, pads);
+}
+
+// Fourbanks Off
+// -------------
+// No bank keys to generate MIDI for, only bank zero is active.
+//
+static void keys_fourbanks_off(void)
+{
+    send_exp_keys();
+    g_key_bank_selected = 0;
+    send_pads(0, 0, 0, g_key_down, g_key_up, 0);
+}
+
+// Fourbanks Internal
+// ------------------
+// The top four keys control which bank we are reading. If any of them are
+// being activated we may need to swap the displayed bank.
+//
+static void keys_fourbanks_internal(void)
+{
+    send_exp_keys();
+    send_pads(g_key_down, g_key_up, g_key_state,
+              g_key_down >> 4, g_key_up >> 4, 4);
+}
+
+// Fourbanks External
+// ------------------
+// In Fourbanks External mode, g_exp_digital_read has been disabled and the
+// digital notes aren't generated. All 16 keys are banked with the bank
+// being selected by keys on the Digital Expansion ports.
+//
+static void keys_fourbanks_external(void)
+{
+    send_pads(g_exp_key_down, g_exp_key_up, g_exp_key_state,
+              g_key_down, g_key_up, 0);
+}
+
+// A pad note in Traktor mode.
+//
+static void note_traktor(uint8_t note, bool on)
+{
+    midi_stream_note(note, on);
+}
+
+// Ableton mode sends a CC alongside each pad note, before the NoteOn and
+// after the NoteOff.
+//
+static void note_ableton(uint8_t note, bool on)
+{
+    if (on) {
+        midi_stream_raw_cc(g_midi_channel+1, note, 127);
+        midi_stream_note(note, true);
+    } else {
+        midi_stream_note(note, false);
+        midi_stream_raw_cc(g_midi_channel+1, note, 0);
+    }
+}
+
+// Recognize combo key events.
+//
+static void send_combos(void)
+{
+    PROFILE_START(combos);
+    combo_action_t action = combo_recognize(g_key_down, g_key_up, g_key_state);
+    if (action == COMBO_DOWN) {
+        midi_stream_note(g_combo_note, true);
+    } else if (action == COMBO_RELEASE) {
+        midi_stream_note(g_combo_note, false);
+    }
+    PROFILE_END(PROFILE_COMBOS, combos);
+}
+
+// Generate the MIDI events for one key event taken off the key event queue,
+// first for the expansion port inputs and then for the key grid.
+//
+static void send_key_event(void)
+{
+    s_handlers.keys();
+    s_handlers.combos();
+}
+
+
+// Faders ---------------------------------------------------------------------
+
+#define FADER_NOTEON_LOW  3
+#define FADER_NOTEON_HIGH (127 - FADER_NOTEON_LOW)
+#define MIDI_ANALOG_NOTE  100
+#define MIDI_ANALOG_CC    16
+
+// New mapping style:
+//
+//   0  3             64           124 127
+//   |--|-------------|-------------|--|   - full range
+//
+//      |0=======================127|      - CC A
+//                    |0=========105|      - CC B (Traktor)
+//
+//   |__|on____________________________|   - note A (Traktor)
+//   |off___________________________|on|   - note B (Traktor)
+//      3                          124
+//
+
+// Generate the default CC event for a fader that has moved.
+//
+static void fader_cc(uint8_t i, uint8_t value)
+{
+    if (value >= FADER_NOTEON_LOW && value <= FADER_NOTEON_HIGH) {
+        midi_stream_cc(MIDI_ANALOG_CC + 2*i, fader_curve(i, value));
+    }
+}
+
+// Ableton mode only sends the default CC.
+//
+static void fader_ableton(uint8_t i, uint8_t value, uint8_t prev_value)
+{
+    (void)prev_value;
+    fader_cc(i, value);
+}
+
+// Traktor mode adds the second CC range and the notes at either end.
+//
+static void fader_traktor(uint8_t i, uint8_t value, uint8_t prev_value)
+{
+    uint8_t cc_b = MIDI_ANALOG_CC + 2*i + 1;
+    uint8_t note_a = MIDI_ANALOG_NOTE + 2*i;
+    uint8_t note_b = MIDI_ANALOG_NOTE + 2*i + 1;
+
+    // 1. Generate the default CC event.
+    fader_cc(i, value);
+
+    if (value >= FADER_NOTEON_LOW && value <= FADER_NOTEON_HIGH) {
+        // 2. If the value is in the range 50%-100%, output the second CC
+        // range.
+        static uint8_t second_cc_value = 0;
+        if (value >= 64) {
+            second_cc_value = fader_split(value);
+            midi_stream_cc(cc_b, second_cc_value);
+        } else {
+            // Make sure we zero the second CC value when we enter the lower
+            // range.
+            if (second_cc_value > 0) {
+                second_cc_value = 0;
+                midi_stream_cc(cc_b, second_cc_value);
+            }
+        }
+    }
+
+    // Only the first inputs have notes, the rest would run off the top of
+    // the note range.
+    if (note_b > 0x7f) return;
+
+    // 3. Generate a Note event if we have just entered or left the top or
+    //    bottom tick of the range. Values turn on as we leave the bottom or
+    //    enter the top:
+    //
+    //   |off|on----------------------------| note A
+    //   |off----------------------------|on| note B
+    //
+    if (value <= FADER_NOTEON_LOW && prev_value > FADER_NOTEON_LOW) {
+        midi_stream_note(note_a, true);
+        midi_note_state_set(note_a, g_midi_velocity);
+    } else if (value > FADER_NOTEON_LOW && prev_value <= FADER_NOTEON_LOW) {
+        midi_stream_note(note_a, false);
+        midi_note_state_set(note_a, 0);
+    } else if (value >= FADER_NOTEON_HIGH && prev_value < FADER_NOTEON_HIGH) {
+        midi_stream_note(note_b, true);
+        midi_note_state_set(note_b, g_midi_velocity);
+    } else if (value < FADER_NOTEON_HIGH && prev_value >= FADER_NOTEON_HIGH) {
+        midi_stream_note(note_b, false);
+        midi_note_state_set(note_b, 0);
+    }
+}
+
+
+// LEDs ------------------------------------------------------------------------
+
+// Normal display
+// --------------
+// Light the 16 LEDs of notes with a velocity greater than zero. Returns the
+// LEDs lit by MIDI notes and adds those lit at full brightness to "full".
+//
+static uint16_t leds_fourbanks_off(uint16_t* full)
+{
+    // If keypress lights are enabled, illuminate the LED of keys currently
+    // activated.
+    *full |= g_key_state & s_led_keypress_mask;
+
+    // update the external key LEDs. If exp_keypress leds are enabled,
+    // illuminate the LED of keys currently activated. Warning this bool is
+    // hard coded as true unlike g_led_keypress_enable which is set from the
+    // EEPROM
+    exp_set_key_led(g_midi_led_digital |
+                    (g_exp_key_state & s_exp_led_keypress_mask));
+
+    return g_midi_led_bank[0];
+}
+
+// Fourbanks Internal
+// ------------------
+// The top four keys display which bank is selected. At least one bank is
+// always selected. The bottom 12 LEDs show the MIDI state of the selected
+// bank.
+//
+static uint16_t leds_fourbanks_internal(uint16_t* full)
+{
+    // If keypress lights are enabled, illuminate the LED of the currently
+    // activated keys, but only the bottom 12 keys.
+    *full |= (1 << g_key_bank_selected) | (g_key_state & s_led_keypress_mask);
+
+    // update the external key LEDs.
+    exp_set_key_led(g_midi_led_digital);
+
+    return g_midi_led_bank[g_key_bank_selected];
+}
+
+// Fourbanks External
+// ------------------
+// Light the external LEDS to indicate the selected bank and the LED on each
+// key that has a non-zero MIDI state.
+//
+static uint16_t leds_fourbanks_external(uint16_t* full)
+{
+    exp_set_key_led(1 << g_key_bank_selected);
+
+    // If keypress lights are enabled, illuminate the LEDs of the currently
+    // activated keys.
+    *full |= g_key_state & s_led_keypress_mask;
+
+    return g_midi_led_bank[g_key_bank_selected];
+}
+
+// Pick the handlers ---------------------------------------------------------
+
+// Choose the variant of each part of the task for the current settings, and
+// the orientation of the keys and LEDs. Call this whenever the settings are
+// changed, by SysEx, the menu or a factory reset.
+//
+void Midifighter_Configure(void)
+{
+    switch (g_key_fourbanks_mode) {
+    case FOURBANKS_INTERNAL:
+        s_handlers.keys = keys_fourbanks_internal;
+        s_handlers.leds = leds_fourbanks_internal;
+        s_led_keypress_mask = 0xfff0;
+        break;
+    case FOURBANKS_EXTERNAL:
+        s_handlers.keys = keys_fourbanks_external;
+        s_handlers.leds = leds_fourbanks_external;
+        s_led_keypress_mask = 0xffff;
+        break;
+    default:
+        s_handlers.keys = keys_fourbanks_off;
+        s_handlers.leds = leds_fourbanks_off;
+        s_led_keypress_mask = 0xffff;
+        break;
+    }
+    if (!g_led_keypress_enable) s_led_keypress_mask = 0;
+    s_exp_led_keypress_mask = g_exp_led_keypress_enable ? 0x0f : 0;
+
+    if (g_device_mode == ABLETON) {
+        s_handlers.note = note_ableton;
+        s_handlers.fader = fader_ableton;
+    } else {
+        s_handlers.note = note_traktor;
+        s_handlers.fader = fader_traktor;
+    }
+
+    s_handlers.combos = g_combos_enable ? send_combos : handler_none;
+
+    s_fader_invert = 0;
+    if (!g_rotate_enable) {
+#ifdef INVERT_SLIDER_1
+        s_fader_invert |= 0x01;
+#endif
+#ifdef INVERT_SLIDER_2
+        s_fader_invert |= 0x02;
+#endif
+#ifdef INVERT_SLIDER_3
+        s_fader_invert |= 0x04;
+#endif
+#ifdef INVERT_SLIDER_4
+        s_fader_invert |= 0x08;
+#endif
+    }
+
+    key_orient_configure();
+    led_orient_configure();
+    exp_orient_configure();
+}
+
+
+// The frame slot -------------------------------------------------------------
+
+// Send the key events seen so far and hand them to the host. The key scans
+// are locked to the USB frames (see key_frame_sync()), so the scan which
+// makes the slot due lands KEY_FRAME_LEAD_US before the next frame starts.
+// Key events go out in the frame after the scan that saw them, at the same
+// point every time, however busy the rest of the loop is.
+//
+// Everything else in Midifighter_Task() is the slow work (MIDI in and
+// SysEx, the faders, the LEDs), which calls this between stages so none of
+// it holds the slot up for long. EEPROM writes already happen in the
+// background.
+//
+static void frame_slot(void)
+{
+    if (!key_frame_slot_due()) return;
+
+    // Work through every key edge seen by the key read interrupt since the
+    // last slot, in the order they happened, so short taps and rolls are
+    // not lost. The stages of send_key_event() time themselves.
+    for (;;) {
+        PROFILE_START(key_read);
+        bool more = key_event_next();
+        PROFILE_END(PROFILE_KEY_READ, key_read);
+        if (!more) break;
+        send_key_event();
+    }
+
+    // Finished generating MIDI events, send them on their way along with
+    // anything else queued since the last slot. This doesn't wait for the
+    // host.
+    PROFILE_START(flush);
+    midi_end_of_frame();
+    midi_flush();
+    PROFILE_END(PROFILE_FLUSH, flush);
+}
+
+// MIDI input -----------------------------------------------------------------
+
+// Traktor sends dozens of LED notes at once when it loads a deck or changes
+// page, and working through all of them before the next key scan would hold
+// the pads up for as long as it takes. So each pass of Midifighter_Task()
+// only handles MIDI_IN_BUDGET packets. Anything beyond that is read out of
+// the endpoint and held over for the next pass, so real time messages
+// further along can still be seen at once: the tempo tracker times each
+// clock by when it is read, so it must not wait behind the notes.
+
+#define MIDI_IN_BUDGET 8  // Packets handled per pass.
+#define MIDI_IN_CARRY  8  // Packets held over to the next pass.
+
+static MIDI_EventPacket_t s_midi_in_carry[MIDI_IN_CARRY];
+static uint8_t s_midi_in_carry_head = 0;
+static uint8_t s_midi_in_carry_count = 0;
+
+// Handle one packet from the host. Returns how much of the budget it used.
+//
+static uint8_t midi_in_event(MIDI_EventPacket_t* event)
+{
+    // Assuming all virtual MIDI cables are intended for us, ensure that
+    // this event is being sent on our current MIDI channel.
+    //
+    // The lower 4-bits (".Command") of the USB_MIDI event packet tells
+    // us what kind of data it contains, and whether to expect more data
+    // in the same message. Commands are:
+    //     0x0 = Reserved for Misc
+    //     0x1 = Reserved for Cable events
+    //     0x2 = 2-byte System Common
+    //     0x3 = 3-byte System Common
+    //     0x4 = 3-byte Sysex starts or continues
+    //     0x5 = 1-byte System Common or Sysex ends
+    //     0x6 = 2-byte Sysex ends
+    //     0x7 = 3-byte Sysex ends
+    //     0x8 = Note On
+    //     0x9 = Note Off
+    //     0xA = Poly KeyPress
+    //     0xB = Control Change (CC)
+    //     0xC = Program Change
+    //     0xD = Channel Pressure
+    //     0xE = PitchBend Change
+    //     0xF = 1-byte message
+
+    // System Real Time events (0xF) never get this far, midi_in_task()
+    // handles them as soon as they are read.
+    if (event->Command >= 0x4 && event->Command <= 0x7) {
+        // SysEx starts or continues with 3 bytes (0x4) or ends with 1,
+        // 2 or 3 bytes (0x5..0x7). The receiver keeps its place between
+        // packets, so messages can be any length.
+        uint8_t size = (event->Command == 0x4) ? 3 : event->Command - 0x4;
+        sysex_receive(&event->Data1, size);
+        // A finished message runs its handler, which can take a while
+        // (writing the EEPROM, replying), so leave it at that for this
+        // pass.
+        if (event->Command != 0x4) return MIDI_IN_BUDGET;
+    }
+    else {
+        // Now we can check that the MIDI channel is the one we're payin
+        // attention to before parsing the event.
+        uint8_t channel = event->Data1 & 0x0f;
+        if (channel == g_midi_channel) {
+            // Check to see if we have a NoteOn or NoteOff event.
+            switch (event->Command) {
+            case 0x9 : {
+                    // A NoteOn event was found, so update the MIDI
+                    // keystate with the note velocity (which may be
+                    // zero).
+                    uint8_t note = event->Data2;
+                    uint8_t velocity = event->Data3;
+                    // record the note velocity in the MIDI note state
+                    midi_note_state_set(note, velocity);
+                }
+                break;
+            case 0x8 : {
+                    // A NoteOff event, so record a zero in the MIDI
+                    // keystate. Yes, a noteoff can have a "velocity",
+                    // but we're relying on the keystate to be zero when
+                    // we have a noteoff, otherwise the LEDs won't match
+                    // the state when we come to calculate them.
+                    uint8_t note = event->Data2;
+                    // record a zero note velocity in the MIDI note state
+                    midi_note_state_set(note, 0);
+                }
+                break;
+            }  // end switch on command
+        } // end channel test
+    }
+    return 1;
+}
+
+// Handle the packets held over from the last pass, then read new ones from
+// the endpoint until the budget runs out or there's nowhere left to keep
+// them.
+//
+static void midi_in_task(void)
+{
+    uint8_t budget = MIDI_IN_BUDGET;
+
+    while (budget && s_midi_in_carry_count) {
+        uint8_t used = midi_in_event(&s_midi_in_carry[s_midi_in_carry_head]);
+        s_midi_in_carry_head = (s_midi_in_carry_head + 1) % MIDI_IN_CARRY;
+        --s_midi_in_carry_count;
+        budget = (used < budget) ? budget - used : 0;
+    }
+
+    // If there is data in the Endpoint for us to read, get a USB-MIDI
+    // packet to process. A host sending nothing but clocks can't keep us
+    // here either, the number of reads is limited too.
+    MIDI_EventPacket_t input_event;
+    for (uint8_t reads = 0;
+         reads < MIDI_IN_BUDGET + MIDI_IN_CARRY &&
+         s_midi_in_carry_count < MIDI_IN_CARRY &&
+         MIDI_Device_ReceiveEventPacket(g_midi_interface_info, &input_event);
+         ++reads) {
+        // System Real Time events (Clock, Start, Stop) can't wait, and
+        // don't change the order of anything else.
+        if (input_event.Command == 0xF) {
+            tempo_realtime(input_event.Data1);
+        } else if (budget) {
+            // Nothing is held over when there is budget left.
+            uint8_t used = midi_in_event(&input_event);
+            budget = (used < budget) ? budget - used : 0;
+        } else {
+            uint8_t tail = (s_midi_in_carry_head + s_midi_in_carry_count)
+                           % MIDI_IN_CARRY;
+            s_midi_in_carry[tail] = input_event;
+            ++s_midi_in_carry_count;
+        }
+    }
+}
+
+
 // The MIDI processing task.
 //
 // Read the buttons and expansion ports to generate MIDI notes. This routine
@@ -174,15 +740,40 @@ void EVENT_USB_Device_UnhandledControlRequest(void)
 //
 void Midifighter_Task(void)
 {
+    // While the menu is up it has the keys and LEDs to itself, so there's
+    // nothing for the rest of the task to do. Keep taking what the host
+    // sends all the same, so it doesn't notice.
+    if (menu_active()) {
+        bool configured = (USB_DeviceState == DEVICE_STATE_Configured);
+        if (configured) midi_in_task();
+        if (!menu_step() && configured) {
+            // Let the config tool know what was changed.
+            send_config_data();
+        }
+        if (configured) {
+            // Hand SysEx replies to the host once a frame, as the frame
+            // slot does outside the menu.
+            if (key_frame_slot_due()) midi_end_of_frame();
+            midi_flush();
+        }
+		// Set watchdog flag so main loop knows this section ran
+		main_watchdog_flag = true;
+        return;
+    }
+
     // If the Midifighter is not completely enumerated by the USB Host,
     // don't go any further - no updating of LEDs, no reading from
     // endpoints, we wait for the USB to connect.
     if (USB_DeviceState != DEVICE_STATE_Configured) {
+        // Keep the power-on count going while a fast boot enumerates.
+        led_anim_update();
 		// Set watchdog flag so main loop knows this section ran
 		main_watchdog_flag = true;
         return;
     }
 
+    PROFILE_START(loop);
+
     // Overview
     // --------
     // The state of all the active notes is kept in an array of bytes
@@ -287,603 +878,228 @@ void Midifighter_Task(void)
     // keypad.
 
 
-	SysEx_t sysEx;
-	uint8_t index = 0;
-
-
     // INPUT MIDI from USB -----------------------------------------------------
 
-    // If there is data in the Endpoint for us to read, get a USB-MIDI
-    // packet to process. Endpoint_IsReadWriteAllowed() returns true if
-    // there is data remaining inside an OUT endpoint or if an IN endpoint
-    // has space left to fill. The same function doing two jobs, confusing
-    // but there you are.
-    MIDI_EventPacket_t input_event;
-    while (MIDI_Device_ReceiveEventPacket(g_midi_interface_info,
-                                          &input_event)) {
-        // Assuming all virtual MIDI cables are intended for us, ensure that
-        // this event is being sent on our current MIDI channel.
-        //
-        // The lower 4-bits (".Command") of the USB_MIDI event packet tells
-        // us what kind of data it contains, and whether to expect more data
-        // in the same message. Commands are:
-        //     0x0 = Reserved for Misc
-        //     0x1 = Reserved for Cable events
-        //     0x2 = 2-byte System Common
-        //     0x3 = 3-byte System Common
-        //     0x4 = 3-byte Sysex starts or continues
-        //     0x5 = 1-byte System Common or Sysex ends
-        //     0x6 = 2-byte Sysex ends
-        //     0x7 = 3-byte Sysex ends
-        //     0x8 = Note On
-        //     0x9 = Note Off
-        //     0xA = Poly KeyPress
-        //     0xB = Control Change (CC)
-        //     0xC = Program Change
-        //     0xD = Channel Pressure
-        //     0xE = PitchBend Change
-        //     0xF = 1-byte message
-
-        // System Real Time events don't have a channel, so we check for
-        // them first.
-        if (input_event.Command == 0xF) {
-            if (input_event.Data1 == 0xF8) {
-                // Clock event, increment the counter.
-                g_led_groundfx_counter++;
-            } else if (input_event.Data1 == 0xFA) {
-                // Song Start, reset the counter.
-                g_led_groundfx_counter = 0;
-            } else if (input_event.Data1 == 0xFC) {
-                // Song Stop event, reset the counter.
-                g_led_groundfx_counter = 0;
-            }
-        }
-		else if (input_event.Command == 0x4) { // Start or continue 3 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_READ(3);
-		}
-		else if (input_event.Command == 0x5) { // End  1 byte
-			SYSEX_READ(1);
-			SYSEX_END();
-		}
-		else if (input_event.Command == 0x6) { // End 2 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_END();
-		}
-		else if (input_event.Command == 0x7) { // End 3 bytes
-			SYSEX_READ(1);
-			SYSEX_READ(2);
-			SYSEX_READ(3);
-			SYSEX_END();
-		}
-		else {
-			// Now we can check that the MIDI channel is the one we're payin
-			// attention to before parsing the event.
-			uint8_t channel = input_event.Data1 & 0x0f;
-			if (channel == g_midi_channel) {
-				// Check to see if we have a NoteOn or NoteOff event.
-				switch (input_event.Command) {
-				case 0x9 : {
-						// A NoteOn event was found, so update the MIDI
-						// keystate with the note velocity (which may be
-						// zero).
-						uint8_t note = input_event.Data2;
-						uint8_t velocity = input_event.Data3;
-						// record the note velocity in the MIDI note state
-						g_midi_note_state[note] = velocity;
-					}
-					break;
-				case 0x8 : {
-						// A NoteOff event, so record a zero in the MIDI
-						// keystate. Yes, a noteoff can have a "velocity",
-						// but we're relying on the keystate to be zero when
-						// we have a noteoff, otherwise the LEDs won't match
-						// the state when we come to calculate them.
-						uint8_t note = input_event.Data2;
-						// record a zero note velocity in the MIDI note state
-						g_midi_note_state[note] = 0;
-					}
-					break;
-				}  // end switch on command
-			} // end channel test
-		}
-    } // end while
+    // Take what the host has sent, within this pass's share of the time.
+    PROFILE_START(midi_in);
+    midi_in_task();
+    PROFILE_END(PROFILE_MIDI_IN, midi_in);
 
+    frame_slot();
 
-    // OUTPUT events from the EXPANSION ports ----------------------------------
+    // Synthetic traffic for testing the USB path, if built in.
+    stress_task();
+    frame_slot();
 
-    // Generate MIDI events the digital input ports
-    //
-    exp_key_read();  // scan the debounce buffer.
-    exp_key_calc();  // update the keyup/keydown variables.
-
-    // Expansion port pins generate the MIDI notes 4 to 7.
-    const uint8_t MIDI_DIGITAL_NOTE = 4;  // lowest digital note.
-
-    // NOTE: enabling fourbanks external mode turns off digital note generation.
-    if (g_key_fourbanks_mode != FOURBANKS_EXTERNAL) {
-        uint8_t bit = 0x01;
-        for(uint8_t i=0; i<4; ++i) {
-            if (g_exp_key_down & bit) {
-                // There's a key down, generate a NoteOn
-                midi_stream_note(MIDI_DIGITAL_NOTE + i, true);
-            }
-            if (g_exp_key_up & bit) {
-                // There's a key up, insert a NoteOff
-                midi_stream_note(MIDI_DIGITAL_NOTE + i, false);
-            }
-            bit <<= 1;
-        }
-    }
 
     // Generate MIDI events for the four analog ports only if they've
     // changed their value since the last time we read them.
 
-    // Read the full 10-bit value from each ADC channel. NOTE: We tried
-    // averaging multiple reads of the ADC but found that the data was
-    // good enough to use with only a single read.
+    // The ADC inputs are sampled in the background by the SPI interrupt
+    // (see exp_adc_scan_start()), which averages several samples of each
+    // input to smooth out the noise and visits the ones being moved most
+    // often. Only work on the inputs that have a new value.
 
-    static uint16_t adc_value[NUM_ANALOG];
+    uint8_t i;
+    uint16_t adc_value;
 
-    // Read the full 10-bit value from each ADC channel. Take the
-    // average of several samples to smooth out the noise.
-    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-        adc_value[i] = 0;
-    }
-    for (uint8_t samples = 0; samples < 4; ++samples) {
-        for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-            adc_value[i] += exp_adc_read(i);
+    PROFILE_START(adc);
+    while ((i = exp_adc_fetch(&adc_value)) != EXP_ADC_NONE) {
+        // Invert the sliders if necessary. This must be performed
+        // before hysteresis, otherwise it causes noise artifacts.
+        if (s_fader_invert & (1 << EXP_ANALOG_PORT(i))) {
+            adc_value = 1024 - adc_value;
         }
-    }
-    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-        adc_value[i] >>= 2;
-    }
-	
-	// invert the sliders if necessary
-	// must be performed before hysteresis otherwise
-	// causes noise artifacts.
-	if (!g_rotate_enable)
-	{
-	#ifdef INVERT_SLIDER_1
-        adc_value[0] = 1024 - adc_value[0];
-	#endif
-	#ifdef INVERT_SLIDER_2
-        adc_value[1] = 1024 - adc_value[1];
-	#endif
-	#ifdef INVERT_SLIDER_3
-        adc_value[2] = 1024 - adc_value[2];
-	#endif
-	#ifdef INVERT_SLIDER_4
-        adc_value[3] = 1024 - adc_value[3];
-	#endif
-	}	
-
-    // Make sure any change in the value is due to
-    // user action and not sampling noise. We do this by making sure the
-    // value has changed by a minimum amount before we say it has
-    // changed - essentially adding a small amount of Hysteresis into
-    // the system.
-    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-        // Need a signed value for the difference
-        int16_t difference = adc_value[i] - g_exp_analog_prev[i];
-        // If the difference is less than four bits either way we
-        // assume the difference was noise and the ADC was not changed.
-        if (abs(difference) < 8) {
-            adc_value[i] = g_exp_analog_prev[i];
-        }
-    }
 
-    // Next, check the ADC values to see if they have changed.
-    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-
-        // Lose the bottom three bits of each 10-bit ADC value,
-        // converting it to a 7-bit CC value.
-        uint8_t value = (uint8_t)(adc_value[i] >> 3);
-        uint8_t prev_value = (uint8_t)(g_exp_analog_prev[i] >> 3);
-
-        // Compare the CC value to the previous one sent. If there has
-        // been a change, generate the three new MIDI events.
-        if (value != prev_value) {
-
-            const uint8_t NOTEON_LOW = 3;
-            const uint8_t NOTEON_HIGH = 127 - NOTEON_LOW;
-            const uint8_t MIDI_ANALOG_NOTE = 100;
-            const uint8_t MIDI_ANALOG_CC = 16;
-            uint8_t cc_a = MIDI_ANALOG_CC + 2*i;
-            uint8_t cc_b = MIDI_ANALOG_CC + 2*i + 1;
-            uint8_t note_a = MIDI_ANALOG_NOTE + 2*i;
-            uint8_t note_b = MIDI_ANALOG_NOTE + 2*i + 1;
-
-            // New mapping style:
-            //
-            //   0  3             64           124 127
-            //   |--|-------------|-------------|--|   - full range
-            //
-            //      |0=======================127|      - CC A
-            //                    |0=========105|      - CC B
-            //
-            //   |__|on____________________________|   - note A
-            //   |off___________________________|on|   - note B
-            //      3                          124
-            //
-            if (value >= NOTEON_LOW && value <= NOTEON_HIGH) {
-                // 1. Generate the default CC event.
-                midi_stream_cc(cc_a, remap(value, NOTEON_LOW,NOTEON_HIGH, 0,127));
-
-				if (g_device_mode == TRAKTOR)
-				{
-					// 2. If the value is in the range 50%-100%, output the
-					// second CC range.
-					static uint8_t second_cc_value = 0;
-					if (value >= 64) {
-						second_cc_value = remap(value, 64,NOTEON_HIGH, 0,105);
-						midi_stream_cc(cc_b, second_cc_value);
-					} else {
-						// Make sure we zero the second CC value when we
-						// enter the lower range.
-						if (second_cc_value > 0) {
-							second_cc_value = 0;
-							midi_stream_cc(cc_b, second_cc_value);
-						}
-					}
-				}				
-            }
-
-            // 3. Generate a Note event if we have just entered or left
-            //    the top or bottom tick of the range. Values turn on as
-            //    we leave the bottom or enter the top:
-            //
-            //   |off|on----------------------------| note A
-            //   |off----------------------------|on| note B
-            //
-			if (g_device_mode == TRAKTOR)
-			{
-				if (value <= NOTEON_LOW && prev_value > NOTEON_LOW) {
-					midi_stream_note(note_a, true);
-					g_midi_note_state[note_a] = g_midi_velocity;
-				} else if (value > NOTEON_LOW && prev_value <= NOTEON_LOW) {
-					midi_stream_note(note_a, false);
-					g_midi_note_state[note_a] = 0;
-				} else if (value >= NOTEON_HIGH && prev_value < NOTEON_HIGH) {
-					midi_stream_note(note_b, true);
-					g_midi_note_state[note_b] = g_midi_velocity;
-				} else if (value < NOTEON_HIGH && prev_value >= NOTEON_HIGH) {
-					midi_stream_note(note_b, false);
-					g_midi_note_state[note_b] = 0;
-				}
-			}			
-
-            // Record the new ADC value for next time through.
-            g_exp_analog_prev[i] = adc_value[i];
+        // Filter the values to make sure any change is due to user
+        // action and not sampling noise. The filter turns each 10-bit
+        // ADC value into a 7-bit CC value, reporting a change at most
+        // once per interval.
+        uint8_t prev_value = g_fader[i].value;
+        if (fader_update(i, adc_value)) {
+            s_handlers.fader(i, g_fader[i].value, prev_value);
         }
     }
+    PROFILE_END(PROFILE_ADC, adc);
 
-    // OUTPUT key presses ------------------------------------------------------
-
-    key_read();  // Read the debounce buffer to generate a keystate.
-    key_calc();  // Use the new keystate to update keydown/keyup state.
-
-    // Setup the variables for Bank output based on the Fourbanks mode.
-    uint16_t bank_keydown = 0;
-    uint16_t bank_keyup = 0;
-    uint16_t bank_keystate = 0;
-    uint16_t keydown = 0;
-    uint16_t keyup = 0;
-    uint8_t keyoffset = 0;
-    uint8_t keycount = 0;
-
-    if (g_key_fourbanks_mode == FOURBANKS_OFF) {
-
-        // Fourbanks Off
-        // -------------
-        // No bank keys to generate MIDI for.
-        bank_keydown = 0;
-        bank_keyup = 0;
-        bank_keystate = 0;
-        keydown = g_key_down;
-        keyup = g_key_up;
-        keyoffset = 0;
-        keycount = 16;
-
-        // Only bank zero is active.
-        g_key_bank_selected = 0;
-
-    } else if (g_key_fourbanks_mode == FOURBANKS_INTERNAL) {
-
-        // Fourbanks Internal
-        // ------------------
-        // The top four keys control which bank we are reading. If any of
-        // them are being activated we may need to swap the displayed bank.
-        bank_keydown = g_key_down;
-        bank_keyup = g_key_up;
-        bank_keystate = g_key_state;
-        keydown = g_key_down >> 4;
-        keyup = g_key_up >> 4;
-        keyoffset = 4;
-        keycount = 12;
-
-    } else if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
-
-        // Fourbanks External
-        // ------------------
-        // In Fourbanks External mode, g_exp_digital_read has been disabled.
-        // All 16 keys are banked with the bank being selected by keys on
-        // the Digital Expansion ports.
-        bank_keydown = g_exp_key_down;
-        bank_keyup = g_exp_key_up;
-        bank_keystate = g_exp_key_state;
-        keydown = g_key_down;
-        keyup = g_key_up;
-        keyoffset = 0;
-        keycount = 16;
-
-    } // fourbanks setup
+    // OUTPUT key events --------------------------------------------------------
 
-    // Update the active bank
-    // ----------------------
-    if (bank_keydown & 0x000f) {
-        // The bank selected will be the most recently pressed key. If
-        // multiple keys are pressed at the same instant, choose the
-        // leftmost key.
-        uint8_t bank_bit = 1;
-        uint8_t new_bank = 0;
-        while (!(bank_keydown & bank_bit) && new_bank < 4) {
-            bank_bit <<= 1;
-            ++new_bank;
-        }
-        // Force a NoteOff if a new bank has been selected but the
-        // previous bank is still depressed.
-        if ((g_key_bank_selected != new_bank) &&
-            (bank_keystate & (1<<g_key_bank_selected))) {
-            // NoteOff the old bank.
-            midi_stream_note(g_key_bank_selected, false);
-        }
-        // NoteOn for the new bank every time it's pressed.
-        midi_stream_note(new_bank, true);
-        g_key_bank_selected = new_bank;
-    }
-
-    if (bank_keyup & 0x000f) {
-        // NoteOff only for the currently selected bank.
-        uint8_t bank_bit = 1 << g_key_bank_selected;
-        if (bank_keyup & bank_bit) {
-            midi_stream_note(g_key_bank_selected, false);
-        }
-    }
-
-    // Loop over the key bits and send MIDI messages, converting key
-    // numbers to MIDI notes using the mapping table.
-    uint16_t bit = 0x0001;
-    for(uint8_t i=0; i<keycount; ++i) {
-        if (keydown & bit) {
-            // There's a key down, put a NoteOn event into the stream.
-            uint8_t note = midi_fourbanks_key_to_note(i + keyoffset);
-			if (g_device_mode == ABLETON)
-			{
-				midi_stream_raw_cc(g_midi_channel+1,note,127);			
-			}			
-            midi_stream_note(note, true);
-        }
-        if (keyup & bit) {
-            // There's a key up, put a NoteOff event onto the stream.
-            uint8_t note = midi_fourbanks_key_to_note(i + keyoffset);
-            midi_stream_note(note, false);
-			if (g_device_mode == ABLETON)
-			{
-				midi_stream_raw_cc(g_midi_channel+1,note,0);			
-			}			
-        }
-        bit <<= 1;
-    }
-
-    if (g_combos_enable) {
-		// Recognize combo key events
-		// --------------------------
-		combo_action_t action = combo_recognize(g_key_down, g_key_up, g_key_state);
-		switch (action) {
-			case COMBO_A_DOWN:
-				midi_stream_note(8, true);
-				break;
-			case COMBO_A_RELEASE:
-				midi_stream_note(8, false);
-				break;
-			case COMBO_B_DOWN:
-				midi_stream_note(9, true);
-				break;
-			case COMBO_B_RELEASE:
-				midi_stream_note(9, false);
-				break;
-			case COMBO_C_DOWN:
-				midi_stream_note(10, true);
-				break;
-			case COMBO_C_RELEASE:
-				midi_stream_note(10, false);
-				break;
-			case COMBO_D_DOWN:
-				midi_stream_note(11, true);
-				break;
-			case COMBO_D_RELEASE:
-				midi_stream_note(11, false);
-				break;
-			case COMBO_E_DOWN:
-				midi_stream_note(12, true);
-				break;
-			case COMBO_E_RELEASE:
-				midi_stream_note(12, false);
-				break;
-			default:
-				// do nothing.
-				break;
-		}
-	}
-
-    // Finished generating MIDI events, flush the endpoints.
-    MIDI_Device_Flush(g_midi_interface_info);
+    frame_slot();
 
 
     // Update the LEDs ---------------------------------------------------------
 
-    uint16_t leds = 0x0000;
-
-    if (g_key_fourbanks_mode == FOURBANKS_OFF) {
-
-        // Normal display
-        // --------------
-        // Update the 16 LEDs with the current midi state. Loop over the
-        // MIDI keystate array and set an LED bit if that MIDI note has a
-        // velocity greater than zero.
-        uint8_t basenote = MIDI_BASE_NOTE;
-        for (uint8_t i=basenote; i<basenote + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_note_to_key(i);
-            }
-        }
-
-        // If keypress lights are enabled, illuminate the LED of keys
-        // currently activated.
-        if (g_led_keypress_enable) {
-            leds |= g_key_state;
-        }
-
-        // update the external key LEDs.
-        uint8_t key_leds = 0;
-        uint8_t key_bit = 0x01;
-        for (uint8_t i=0; i<4; ++i) {
-            if (g_midi_note_state[MIDI_DIGITAL_NOTE + i] > 0) {
-                key_leds |= key_bit;
-            }
-            key_bit <<= 1;
-        }
-		
-		//If exp_keypress leds are enabled, illuminate the LED of keys 
-		//currently activated. Warning this bool is hard coded as true
-		//unlike g_led_keypress_enable which is set from the EEPROM
-		if (g_exp_led_keypress_enable){
-			key_leds |= g_exp_key_state;
-		}
-				
-        exp_set_key_led(key_leds);
-
-    } else if (g_key_fourbanks_mode == FOURBANKS_INTERNAL) {
-
-        // Fourbanks Internal
-        // ------------------
-        //
-        // The top four keys display which bank is selected. At least one
-        // bank is always selected.
-        leds = (1 << g_key_bank_selected);
-
-        // Update the bottom 12 LEDs with the MIDI state of the selected
-        // bank.
-        uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 12);
-        for (uint8_t i=basenote; i<basenote + 12; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_fourbanks_note_to_key(i);
-            }
-        }
-
-        // If keypress lights are enabled, illuminate the LED of the
-        // currently activated keys, but only the bottom 12 keys.
-        if (g_led_keypress_enable) {
-            leds |= g_key_state & 0xfff0;
-        }
+    // The LEDs lit by MIDI notes are kept in per-bank bitmaps, updated as
+    // the notes arrive, so all that's needed here is to combine them with
+    // the key state. If nothing has changed since the last pass (and nobody
+    // else has written to the LEDs) there's nothing to do at all.
+    static uint16_t last_key_state = 0;
+    static uint8_t last_exp_key_state = 0;
+    static uint8_t last_bank = 0;
+    static uint16_t last_leds = 0;
+    static bool last_flash = false;
+
+    PROFILE_START(leds);
+    if (g_midi_led_mode != g_key_fourbanks_mode) {
+        midi_led_rebuild();
+    }
 
-        // update the external key LEDs.
-        uint8_t key_leds = 0;
-        uint8_t key_bit = 0x1;
-        for (uint8_t i=0; i<4; ++i) {
-            if (g_midi_note_state[MIDI_DIGITAL_NOTE + i] > 0) {
-                key_leds |= key_bit;
-            }
-            key_bit <<= 1;
-        }
-        exp_set_key_led(key_leds);
-
-    } else if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
-
-        // Fourbanks External
-        // ------------------
-        //
-        // Light the external LEDS to indicate the selected bank.
-        uint8_t bank_led = 1 << g_key_bank_selected;
-        exp_set_key_led(bank_led);
-
-        // set the LED on each key that has a non-zero MIDI state.
-        uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 16);
-        for (uint8_t i=basenote; i<basenote + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
-                leds |= 1 << midi_fourbanks_note_to_key(i);
+    // A feedback animation (see led_anim_push()) has the LEDs to itself
+    // until it ends, then the usual pattern is drawn again.
+    if (led_anim_update()) {
+        last_flash = true;
+    } else if (last_flash ||
+        g_midi_led_dirty ||
+        g_key_state != last_key_state ||
+        g_exp_key_state != last_exp_key_state ||
+        g_key_bank_selected != last_bank ||
+        g_led_state != last_leds) {
+
+        last_flash = false;
+        g_midi_led_dirty = false;
+        last_key_state = g_key_state;
+        last_exp_key_state = g_exp_key_state;
+        last_bank = g_key_bank_selected;
+
+        uint16_t full = 0x0000;  // Lit at full brightness regardless.
+        uint16_t leds = s_handlers.leds(&full);  // Lit by MIDI notes.
+
+        // Illuminate the LEDs with the new pattern.
+#ifdef MIDI_NOTE_VELOCITY
+        // Show the velocity of each note as the brightness of its LED.
+        midi_key_table_update();
+        uint8_t levels[16];
+        for (uint8_t i=0; i<16; ++i) {
+            uint16_t bit = 1 << i;
+            if (full & bit) {
+                levels[i] = LED_LEVEL_MAX;
+            } else if (leds & bit) {
+                levels[i] = led_velocity_level(
+                    midi_note_velocity(g_midi_key_note[i]));
+            } else {
+                levels[i] = 0;
             }
         }
+        led_set_levels(levels);
+#else
+        led_set_state(leds | full);
+#endif
+        last_leds = leds | full;
+    }
+    PROFILE_END(PROFILE_LEDS, leds);
 
-        // If keypress lights are enabled, illuminate the LEDs of the
-        // currently activated keys.
-        if (g_led_keypress_enable) {
-            leds |= g_key_state;
-        }
-
-    } // fourbanks mode
-
-    // Illuminate the LEDs with the new pattern.
-    led_set_state(leds);
+    frame_slot();
 
     // Update the Ground Effects LED
     // -----------------------------
     // Use explicit values so we can tweak
     // the flashing pattern: one beat on, three beat off.
     //
-    // There are 24 clock ticks per beat, 96 per bar.
+    // There are 24 clock ticks per beat, 96 per bar. The tempo tracker
+    // predicts which tick we're on between the clocks, so the pattern
+    // doesn't jitter with the USB packets.
     //
-    if (g_led_groundfx_counter == 0) {
+    uint8_t groundfx_clock = tempo_position() >> 8;
+    if (groundfx_clock == 0) {
         led_groundfx_state(true);
-    } else if (g_led_groundfx_counter < 8) {
+    } else if (groundfx_clock < 8) {
         led_groundfx_state(false);
-    } else if (g_led_groundfx_counter < 24) {
-        led_groundfx_state(true);
     } else {
-        g_led_groundfx_counter = 0;
+        led_groundfx_state(true);
     }
 	
 	// Set watchdog flag so main loop knows this section ran
 	main_watchdog_flag = true;
+
+    PROFILE_END(PROFILE_LOOP, loop);
 	
 	DDRD |= 0x02;
-	PORTD ^= 0x02;
+	// Writing a one to PIND toggles the pin in a single instruction. A
+	// read-modify-write of PORTD could undo the multiplexer select the SPI
+	// interrupt writes in between.
+	PIND = 0x02;
 
 }
 
 void enter_menu_mode (void)
 {
-    // Call "key_calc()" to set the "prev_key_state" so that when we
-    // enter the menu, the currently held down key will not suddenly
-    // count as a keydown and launch a menu item.
-    key_calc();
-    // Enter the menu system.
-    menu();
+    // Hand the keys and LEDs to the menu. It runs from Midifighter_Task()
+    // and sends the configuration back when it's done.
+    menu_start();
+}
 
-    // Send reset configuration as sysex
-    send_config_data();
+// Put every setting back to its factory default and bring everything that
+// works from the settings up to date with them. Without the configure calls
+// the key read interrupt, the fader filters and the task handlers would
+// carry on with the old settings.
+//
+static void factory_reset_settings (void)
+{
+    eeprom_factory_reset();
+    config_revision_bump();
+    key_debounce_configure();
+    fader_configure();
+    Midifighter_Configure();
 }
 
 void factory_reset (void)
 {
     // Reset the eeprom values.
-    eeprom_factory_reset();
+    factory_reset_settings();
 
     // Send reset configuration as sysex
     send_config_data();
 
     // Flash to signal success.
-    led_set_state(0xffff);
-    _delay_ms(100);
-    led_set_state(0x0000);
-    _delay_ms(100);
-    led_set_state(0xffff);
-    _delay_ms(100);
+    led_flash(0xffff, 0);
+}
+
+
+#ifdef FAST_BOOT
+// Fast boot ------------------------------------------------------------------
+
+#define FAST_BOOT_WINDOW_MS 100  // How long to look for a boot combo.
+#define FAST_BOOT_HOLD_MS   20   // How long a combo must be held steady.
+
+// USB is already running during the boot checks, so they keep it and the
+// watchdog going whenever they have to wait.
+//
+static void fast_boot_service(void)
+{
+    MIDI_Device_USBTask(g_midi_interface_info);
+    USB_USBTask();
+    wdt_reset();
 }
 
+// Look for one of the boot key combos while the USB enumerates and the
+// power-on count plays. Returns the combo, or zero if none was held.
+//
+static uint16_t fast_boot_keys(void)
+{
+    uint16_t start = key_tick();
+    uint16_t last = start;
+    uint16_t held = 0;
+    uint16_t held_since = start;
+    for (;;) {
+        uint16_t now = key_tick();
+        if ((uint16_t)(now - start) >= FAST_BOOT_WINDOW_MS) break;
+        if (now != last) {
+            last = now;
+            uint16_t keys = key_read();
+            if (keys != held) {
+                held = keys;
+                held_since = now;
+            } else if ((uint16_t)(now - held_since) >= FAST_BOOT_HOLD_MS &&
+                       (keys == 0x9009 || keys == 0x0001 || keys == 0x1248)) {
+                return keys;
+            }
+        }
+        led_anim_update();
+        fast_boot_service();
+    }
+    return 0;
+}
+#endif // FAST_BOOT
 
 // Main -----------------------------------------------------------------------
 
@@ -893,8 +1109,9 @@ int main(void)
 {
     // Disable watchdog timer to prevent endless resets if we just used it
     // to soft-reset the machine. (Older AVR chips disable it after reset,
-    // the AT90USB162 doesn't).
-    MCUSR &= ~(1 << WDRF);  // clear the watchdog reset flag
+    // the AT90USB162 doesn't). Keep the reset flags for the telemetry.
+    uint8_t mcusr = MCUSR;
+    MCUSR = 0;              // clear the reset flags
     wdt_disable();          // turn off the watchdog
 
     // Disable clock prescaling so we're working at full 16MHz speed.
@@ -904,20 +1121,36 @@ int main(void)
 
     // Start up the subsystems.
     eeprom_setup();   // setup global settings from the EEPROM
+    telemetry_setup(mcusr);  // count the reset we came out of.
+    timer_setup();    // startup the free-running cycle timer.
+    profile_setup();  // clear the profiler timings, if built in.
+    stress_setup();   // install the stress test, if built in.
 	key_setup();  // startup the key debounce interrupt.
     spi_setup();  // startup the SPI bus.
     led_setup();  // startup the LED chip.
     exp_setup();  // startup the expansion ports and ADC.
+    fader_setup();    // startup the analog filters.
     midi_setup(); // startup the MIDI keystate and LUFA MIDI Class interface.
 	config_setup();   // setup the configuration system
+    combo_setup();    // load the combo definitions.
+    Midifighter_Configure();  // pick the handlers for the settings.
 
+#ifdef FAST_BOOT
+    // Start up USB straight away and look for the boot combos while it
+    // enumerates. The power-on light show plays from the main loop.
+    USB_Init();
+    sei();
+    led_count_start();
+    uint16_t boot_keys = fast_boot_keys();
+#else
     // Power-on light show. Woo! This generally signals that we are alive.
     led_count_all_leds();
 
 	// PCB version MF_MK1-3 has an issue where the clock inhibit pins for the 
 	// 74HC165 shift registers are floating causing a delay of approximately
 	// 1.5 s before buttons can be read correctly after a hard reset. This
-	// delay is necessary to mask the problem on this board version. 
+	// delay is necessary to mask the problem on this board version, so
+	// don't build those with FAST_BOOT.
 	_delay_ms(1500);
 	
 	// Check to see if the bootloader has been requested by the user holding
@@ -926,8 +1159,9 @@ int main(void)
     // before entering the bootloader is a little involved. A little delay is needed
 	// so keys are otherwise the debounce will mask the keypress
 	
-	key_read();
-	if (g_key_state == 0x9009) {
+	uint16_t boot_keys = key_read();
+#endif
+	if (boot_keys == 0x9009) {
 
 		
 	    // Drop to Bootloader:
@@ -974,25 +1208,22 @@ int main(void)
        // led_set_state(0x8421);
        // while(1);
 		
+		wdt_disable();
 		led_set_state(0xA5A5);
 		Jump_To_Bootloader();
 
-    }  else if(g_key_state == 0x0001) {
+    }  else if(boot_keys == 0x0001) {
         // Menu mode has been requested:
         //  # . . .
         //  . . . .
         //  . . . .
         //  . . . .
 
-        // Call "key_calc()" to set the "prev_key_state" so that when we
-        // enter the menu, the currently held down key will not suddenly
-        // count as a keydown and launch a menu item.
-        key_calc();
-        // Enter the menu system.
-        menu();
-        // when menu exists, we continue the USB startup...
+        // Enter the menu system. It runs from the main loop, so we
+        // continue the USB startup underneath it.
+        menu_start();
 
-    } else if (g_key_state == 0x1248) {
+    } else if (boot_keys == 0x1248) {
         // Factory reset all persistent values then drop to menu mode
         //  . . . #
         //  . . # .
@@ -1000,21 +1231,25 @@ int main(void)
         //  # . . .
 
         // Reset the eeprom values.
-        eeprom_factory_reset();
-
-        // Flash to signal success.
-        led_set_state(0xffff);
-		_delay_ms(100);
-		led_set_state(0x0000);
-        _delay_ms(100);
-        led_set_state(0xffff);
-        _delay_ms(100);
+        factory_reset_settings();
+
+        // Flash to signal success. The menu takes over the LEDs, so let
+        // it play out first.
+        led_anim_clear();
+        led_anim_push(0xffff, 0, 100, 0);
+        led_anim_push(0x0000, 0, 100, 0);
+        led_anim_push(0xffff, 0, 100, 0);
+#ifdef FAST_BOOT
+        while (led_anim_update()) fast_boot_service();
+#else
+        led_anim_finish();
+#endif
 
         // Enter menu mode.
-        key_calc();
-        menu();
+        menu_start();
     }
 
+#ifndef FAST_BOOT
     // Start up USB system now that everything else is safely squared away
     // and our globals are setup.
     USB_Init();
@@ -1024,9 +1259,22 @@ int main(void)
 
     // Indicate USB not ready.
     led_set_state(0x0001);
+#endif
+
+    // Start generating key events from the keys as they are now, not from
+    // whatever was held down at power on.
+    key_event_flush();
 
     // Enter an endless loop.
     for(;;) {
+        // Show the USB state left by the connect and disconnect events.
+        uint8_t sreg = SREG;
+        cli();
+        uint8_t usb_leds = s_usb_leds;
+        s_usb_leds = 0;
+        SREG = sreg;
+        if (usb_leds) led_set_state(usb_leds);
+
         // Read keys and expansion port to check for MIDI events to send and
         // LEDs to set.
         Midifighter_Task();
@@ -1041,6 +1289,7 @@ int main(void)
 		if (main_watchdog_flag)
 		{
 			wdt_reset();
+			telemetry_watchdog();
 			main_watchdog_flag = false;			
 		}
     }
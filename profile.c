@@ -0,0 +1,76 @@
+// Main loop profiler for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+// Globals ---------------------------------------------------------------------
+
+profile_stat_t g_profile[PROFILE_STAGES];
+
+
+// Functions -------------------------------------------------------------------
+
+void profile_setup(void)
+{
+    profile_reset();
+}
+
+// Forget all the timings taken so far.
+//
+void profile_reset(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    for (uint8_t i=0; i<PROFILE_STAGES; ++i) {
+        g_profile[i].min = 0xffff;
+        g_profile[i].max = 0;
+        g_profile[i].total = 0;
+        g_profile[i].count = 0;
+    }
+    SREG = sreg;
+}
+
+// Add one timing to a stage. Each stage is only ever recorded from one
+// place, so the key read interrupt and the main loop never update the same
+// entry.
+//
+void profile_record(const uint8_t stage, const uint16_t ticks)
+{
+    profile_stat_t* stat = &g_profile[stage];
+    if (ticks < stat->min) stat->min = ticks;
+    if (ticks > stat->max) stat->max = ticks;
+    // Halve the history rather than letting the count wrap, which keeps
+    // the average following recent behaviour during long runs.
+    if (stat->count == 0xffff) {
+        stat->total >>= 1;
+        stat->count >>= 1;
+    }
+    stat->total += ticks;
+    ++stat->count;
+}
+
+#endif // PROFILE
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,91 @@
+// Main loop profiler for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _PROFILE_H_INCLUDED
+#define _PROFILE_H_INCLUDED
+
+#include <stdint.h>
+#include "timer.h"
+
+// The profiler is only built in when PROFILE is defined (see the makefile),
+// otherwise the macros below compile to nothing and cost neither time nor
+// RAM.
+
+// Stages of Midifighter_Task() that are timed, plus the whole loop and the
+// key read interrupt.
+enum {
+    PROFILE_MIDI_IN = 0,  // MIDI receive loop
+    PROFILE_ADC,          // Analog fetch, filters and CCs
+    PROFILE_KEY_READ,     // Taking key events off the queue
+    PROFILE_EXP_KEYS,     // Expansion port digital notes
+    PROFILE_PADS,         // Bank select and pad note dispatch
+    PROFILE_COMBOS,       // Combo recognition
+    PROFILE_FLUSH,        // Flushing the MIDI IN endpoint
+    PROFILE_LEDS,         // LED rebuild and led_set_state()
+    PROFILE_LOOP,         // All of Midifighter_Task()
+    PROFILE_KEY_ISR,      // The TIMER0 key read interrupt
+    PROFILE_STAGES
+};
+
+#ifdef PROFILE
+
+// Types ----------------------------------------------------------------------
+
+// Timings for one stage, in timer ticks (TIMER_TICK_CYCLES cycles each).
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t total;   // Sum of the samples since the last reset...
+    uint16_t count;   // ...and how many there were, for the average.
+} profile_stat_t;
+
+// Globals ---------------------------------------------------------------------
+
+extern profile_stat_t g_profile[PROFILE_STAGES];
+
+// Functions -------------------------------------------------------------------
+
+void profile_setup(void);
+void profile_reset(void);
+void profile_record(const uint8_t stage, const uint16_t ticks);
+
+// Time a stretch of code:
+//
+//     PROFILE_START(adc);
+//     ...
+//     PROFILE_END(PROFILE_ADC, adc);
+//
+// Interrupts that fire in between are counted too.
+#define PROFILE_START(name) uint16_t profile_##name = timer_now()
+#define PROFILE_END(stage, name) \
+    profile_record(stage, timer_now() - profile_##name)
+
+#else
+
+#define profile_setup() do {} while (0)
+#define PROFILE_START(name) do {} while (0)
+#define PROFILE_END(stage, name) do {} while (0)
+
+#endif // PROFILE
+
+// ----------------------------------------------------------------------------
+
+#endif // _PROFILE_H_INCLUDED
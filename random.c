@@ -72,7 +72,7 @@ static const int8_t grad_table[32] PROGMEM = {
 //     3928, 3952, 3976, 4000, 4023, 4047, 4071, 4096
 // };
 
-const uint8_t gamma8_table[256] = {
+const uint8_t gamma8_table[256] PROGMEM = {
     0, 0, 0, 0, 0, 0, 0, 1,
     1, 1, 1, 2, 2, 2, 3, 3,
     4, 4, 4, 5, 5, 6, 6, 6,
@@ -212,16 +212,45 @@ uint32_t random_color(void)
 uint16_t rightmost_bit_16(uint16_t value)
 {
     // return the rightmost set bit in a 16-bit value (the bit, not the bit
-    // position), or zero of no bits are set.
-    uint16_t bit = 0x0001;
-    while (bit && (value & bit) == 0) {
-        bit <<= 1;
-    }
-    return bit;
+    // position), or zero of no bits are set. In two's complement -value
+    // flips every bit above the lowest set one, so the AND leaves only
+    // that bit.
+    return value & -value;
+}
+
+// Position of each bit in a de Bruijn multiply, see bit_index_16().
+static const uint8_t debruijn_table[16] PROGMEM = {
+    0, 1, 2, 5, 3, 9, 6, 11, 15, 4, 8, 10, 14, 7, 13, 12
+};
+
+uint8_t bit_index_16(uint16_t bit)
+{
+    // return the position (0..15) of a single bit, e.g. one returned by
+    // rightmost_bit_16(). Multiplying by the de Bruijn sequence 0x09AF
+    // shifts a different 4-bit pattern into the top nibble for each bit
+    // position, which a table turns back into the position.
+    return pgm_read_byte(&debruijn_table[(uint16_t)(bit * 0x09AF) >> 12]);
 }
 
 // ----------------------------------------------------------------------------
 
+// Each row of a 4x4 grid nibble spread out into a column, one bit per
+// nibble. rotate_right_table[] puts bit 0 of the row at the bottom of the
+// column, rotate_left_table[] at the top. Generated from Python using:
+//
+//    right = [sum(1 << 4*j for j in range(4) if n >> j & 1) for n in range(16)]
+//    left = [right[int('{:04b}'.format(n)[::-1], 2)] for n in range(16)]
+//
+static const uint16_t rotate_right_table[16] PROGMEM = {
+    0x0000, 0x0001, 0x0010, 0x0011, 0x0100, 0x0101, 0x0110, 0x0111,
+    0x1000, 0x1001, 0x1010, 0x1011, 0x1100, 0x1101, 0x1110, 0x1111
+};
+
+static const uint16_t rotate_left_table[16] PROGMEM = {
+    0x0000, 0x1000, 0x0100, 0x1100, 0x0010, 0x1010, 0x0110, 0x1110,
+    0x0001, 0x1001, 0x0101, 0x1101, 0x0011, 0x1011, 0x0111, 0x1111
+};
+
 uint16_t rotate16_right(const uint16_t value)
 {
     // Rotate a 16-bit value (formatted as a 4x4 grid) 90 degrees right, e.g.
@@ -231,21 +260,11 @@ uint16_t rotate16_right(const uint16_t value)
     //  9  10 11 12     15 11 7  3
     //  13 14 15 16     16 12 8  4
     //
-    uint8_t row[4];
-    row[0] = (value & 0xf000) >> 12;
-    row[1] = (value & 0x0f00) >> 8;
-    row[2] = (value & 0x00f0) >> 4;
-    row[3] = (value & 0x000f);
-    uint8_t col[4] = {0,0,0,0};
-    uint8_t bit = 0x01;
-    for (uint8_t i=0; i<4; i++) {
-        col[0] |= (row[i] & 0x08) ? bit : 0;
-        col[1] |= (row[i] & 0x04) ? bit : 0;
-        col[2] |= (row[i] & 0x02) ? bit : 0;
-        col[3] |= (row[i] & 0x01) ? bit : 0;
-        bit <<= 1;
-    }
-    return (col[0] << 12) | (col[1] << 8) | (col[2] << 4) | col[3];
+    // Each row becomes a column, the top row on the right.
+    return (pgm_read_word(&rotate_right_table[value >> 12])) |
+           (pgm_read_word(&rotate_right_table[(value >> 8) & 0x0f]) << 1) |
+           (pgm_read_word(&rotate_right_table[(value >> 4) & 0x0f]) << 2) |
+           (pgm_read_word(&rotate_right_table[value & 0x0f]) << 3);
 }
 
 uint16_t rotate16_left(const uint16_t value)
@@ -257,21 +276,18 @@ uint16_t rotate16_left(const uint16_t value)
     //  9  10 11 12     2  6  10 14
     //  13 14 15 16     1  5  9  13
     //
-    uint8_t row[4];
-    row[0] = (value & 0xF000) >> 12;
-    row[1] = (value & 0x0F00) >> 8;
-    row[2] = (value & 0x00F0) >> 4;
-    row[3] = (value & 0x000F);
-    uint8_t col[4] = {0,0,0,0};
-    uint8_t bit = 0x08;
-    for (uint8_t i=0; i<4; i++) {
-        col[0] |= (row[i] & 0x01) ? bit : 0;
-        col[1] |= (row[i] & 0x02) ? bit : 0;
-        col[2] |= (row[i] & 0x04) ? bit : 0;
-        col[3] |= (row[i] & 0x08) ? bit : 0;
-        bit >>= 1;
-    }
-    return (col[0] << 12) |(col[1] << 8) | (col[2] << 4) | col[3];
+    // Each row becomes a column, the top row on the left.
+    return (pgm_read_word(&rotate_left_table[value >> 12]) << 3) |
+           (pgm_read_word(&rotate_left_table[(value >> 8) & 0x0f]) << 2) |
+           (pgm_read_word(&rotate_left_table[(value >> 4) & 0x0f]) << 1) |
+           (pgm_read_word(&rotate_left_table[value & 0x0f]));
+}
+
+uint16_t rotate16_none(const uint16_t value)
+{
+    // Leave the grid as it is, to stand in for the two above when a
+    // rotation is picked through a function pointer.
+    return value;
 }
 
 // ----------------------------------------------------------------------------
@@ -17,7 +17,7 @@
 // Constants ------------------------------------------------------------------
 
 extern const uint16_t gamma16_table[256];
-extern const uint8_t gamma8_table[256];
+extern const uint8_t gamma8_table[256];  // in PROGMEM, use pgm_read_byte()
 
 // Functions ------------------------------------------------------------------
 
@@ -32,8 +32,10 @@ float clampf(float value, float low, float high);
 uint8_t smoothstep(uint8_t min, uint8_t max, uint8_t t);
 uint32_t random_color(void);
 uint16_t rightmost_bit_16(uint16_t value);
+uint8_t bit_index_16(uint16_t bit);
 uint16_t rotate16_right(const uint16_t value);
 uint16_t rotate16_left(const uint16_t value);
+uint16_t rotate16_none(const uint16_t value);
 
 // ----------------------------------------------------------------------------
 
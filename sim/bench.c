@@ -0,0 +1,430 @@
+// Load benchmark for the Midifighter Pro main loop
+//
+// Runs the firmware on the host simulation through a set of scripted
+// scenarios and reports, for each one:
+//
+//   - host time per main loop pass and per key interrupt, as a relative
+//     measure to compare builds against each other (for cycle counts on
+//     the real chip, build the firmware with -DPROFILE),
+//   - the MIDI events the host received against the ones it should have,
+//   - key to NoteOn latency as seen by the host,
+//   - any events lost: missing notes, stale fader values, LED state that
+//     doesn't match the feedback the host sent, or packets dropped because
+//     the endpoint wait timed out.
+//
+// The exit status is 1 if anything was lost, so the bench can gate a
+// release.
+//
+// Usage: bench [-l loop_us] [-b banks_per_frame] [-s scenario]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#include "../constants.h"
+#include "../combo.h"
+#include "../fader.h"
+#include "../key.h"
+#include "../led.h"
+#include "../midi.h"
+
+
+// Expansion port inputs play notes 4 to 7.
+#define MIDI_DIGITAL_NOTE 4
+
+// Settings ------------------------------------------------------------------
+
+// Simulated time taken by one pass of the main loop when it isn't waiting
+// on the SPI bus or the host.
+static double s_loop_us = 50.0;
+
+static const char* s_only = NULL;
+
+// Time given to each scenario after its input stops, so in-flight events
+// can arrive before they are counted.
+#define SETTLE_MS 50.0
+
+// Results -------------------------------------------------------------------
+
+typedef struct {
+    uint32_t loops;
+    uint64_t loop_ns_total;
+    uint64_t loop_ns_max;
+    uint32_t key_isr;
+    uint64_t key_isr_ns;
+    uint32_t notes_on_expected;
+    uint32_t notes_off_expected;
+    uint32_t notes_on;
+    uint32_t notes_off;
+    uint32_t ccs;
+    uint32_t packets_in;
+    uint32_t packets_out;
+    uint32_t backlog_max;
+    uint32_t latency_count;
+    double latency_total_ms;
+    double latency_max_ms;
+    uint32_t timeouts;
+    uint32_t lost;
+} result_t;
+
+static result_t s_result;
+
+// Key tracking --------------------------------------------------------------
+
+static double s_press_ms[16];
+static bool s_press_pending[16];
+
+// Change the pads held down, counting the notes that should come of it.
+//
+static void set_keys(uint16_t keys)
+{
+    uint16_t changed = keys ^ g_sim_keys;
+    for (uint8_t k=0; k<16; ++k) {
+        uint16_t bit = 1 << k;
+        if (!(changed & bit)) continue;
+        if (keys & bit) {
+            ++s_result.notes_on_expected;
+            s_press_ms[k] = sim_now_ms();
+            s_press_pending[k] = true;
+        } else {
+            ++s_result.notes_off_expected;
+        }
+    }
+    g_sim_keys = keys;
+}
+
+#ifndef MULTIPLEX_ANALOG
+static void set_exp_keys(uint8_t keys)
+{
+    uint8_t changed = (keys ^ g_sim_exp_keys) & 0x0f;
+    for (uint8_t k=0; k<4; ++k) {
+        if (!(changed & (1 << k))) continue;
+        if (keys & (1 << k)) ++s_result.notes_on_expected;
+        else ++s_result.notes_off_expected;
+    }
+    g_sim_exp_keys = keys;
+}
+#endif
+
+// Host side -----------------------------------------------------------------
+
+static int16_t s_last_cc[128];
+static bool s_led_expected[128];
+
+void bench_host_receive(const uint8_t packet[4])
+{
+    uint8_t command = packet[0] & 0x0f;
+    uint8_t note = packet[2];
+    uint8_t velocity = packet[3];
+#ifdef MULTIPLEX_ANALOG
+    // The expansion lines drive the multiplexers, there are no digital keys.
+    bool pad_note = false;
+#else
+    bool pad_note = note >= MIDI_DIGITAL_NOTE && note < MIDI_DIGITAL_NOTE + 4;
+#endif
+    for (uint8_t k=0; k<16; ++k) {
+        if (g_midi_key_note[k] == note) pad_note = true;
+    }
+
+    if ((command == 0x9 || command == 0x8) && !pad_note) {
+        // Fader end stop notes aren't part of the count.
+        return;
+    }
+    if (command == 0x9 && velocity) {
+        ++s_result.notes_on;
+        // Match the note back to the pad that sent it for the latency. The
+        // pads are pressed as wired, the notes are laid out as oriented.
+        for (uint8_t k=0; k<16; ++k) {
+            uint16_t oriented = key_orient(1 << k);
+            uint8_t o = 0;
+            while (!(oriented & (1 << o))) ++o;
+            if (g_midi_key_note[o] == note && s_press_pending[k]) {
+                double latency = sim_now_ms() - s_press_ms[k];
+                s_press_pending[k] = false;
+                ++s_result.latency_count;
+                s_result.latency_total_ms += latency;
+                if (latency > s_result.latency_max_ms)
+                    s_result.latency_max_ms = latency;
+                break;
+            }
+        }
+    } else if (command == 0x8 || command == 0x9) {
+        ++s_result.notes_off;
+    } else if (command == 0xB) {
+        ++s_result.ccs;
+        s_last_cc[note & 0x7f] = velocity;
+    }
+}
+
+// Send a LED feedback note from the host, remembering what it should leave
+// lit.
+//
+static void host_note(uint8_t note, bool on)
+{
+    uint8_t velocity = on ? 127 : 0;
+    if (sim_usb_send(0x9, 0x90 | g_midi_channel, note, velocity)) {
+        s_led_expected[note] = on;
+    }
+}
+
+// Scenarios -----------------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    double ms;                    // How long the input runs for.
+    bool keys, faders, feedback;  // Which inputs it drives.
+} scenario_t;
+
+static const scenario_t s_scenarios[] = {
+    { "idle",     300, false, false, false },
+    { "pad-roll", 1000, true,  false, false },
+    { "faders",   800, false, true,  false },
+    { "feedback", 500, false, false, true  },
+    { "combined", 1000, true,  true,  true  },
+};
+#define NUM_SCENARIOS (sizeof(s_scenarios) / sizeof(s_scenarios[0]))
+
+// Every 60ms each pad is held for 15ms, each one starting 3ms after the
+// last, so up to five pads are down at once. The expansion inputs follow
+// the same pattern offset by half a cycle.
+//
+static void step_keys(double t, bool stopping)
+{
+    uint16_t keys = 0;
+    for (uint8_t k=0; k<16; ++k) {
+        double phase = t - k * 3.0;
+        if (phase >= 0 && (int)phase % 60 < 15) keys |= 1 << k;
+    }
+    // Once stopping, let the held pads finish their press but start no
+    // new ones, so none is cut shorter than a key read.
+    if (stopping) keys &= g_sim_keys;
+    set_keys(keys);
+
+#ifndef MULTIPLEX_ANALOG
+    uint8_t exp_keys = 0;
+    for (uint8_t k=0; k<4; ++k) {
+        double phase = t - 30.0 - k * 5.0;
+        if (phase >= 0 && (int)phase % 60 < 15) exp_keys |= 1 << k;
+    }
+    if (stopping) exp_keys &= g_sim_exp_keys;
+    set_exp_keys(exp_keys);
+#endif
+}
+
+// Each fader sweeps end to end and back every 400ms, a quarter cycle
+// apart, and comes to rest at centre for the last 100ms.
+//
+static void step_faders(double t, double length)
+{
+    for (uint8_t i=0; i<4; ++i) {
+        if (t > length - 100.0) {
+            g_sim_adc[i] = 512;
+            continue;
+        }
+        double phase = (t + i * 100.0) / 400.0;
+        phase -= (int)phase;
+        double level = phase < 0.5 ? phase * 2.0 : (1.0 - phase) * 2.0;
+        g_sim_adc[i] = (uint16_t)(level * 1023.0);
+    }
+}
+
+// Flood the device with LED feedback for the pad notes, four packets every
+// 100us, which is far more than anything Traktor or Live sends.
+//
+static void step_feedback(double t)
+{
+    static double next = 0;
+    static uint32_t seed = 12345;
+    if (t < next) return;
+    next = t + 0.1;
+    for (uint8_t i=0; i<4; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        uint8_t note = g_midi_key_note[(seed >> 16) & 0x0f];
+        host_note(note, (seed >> 24) & 1);
+    }
+}
+
+// Checks once a scenario has settled ----------------------------------------
+
+static uint32_t check_faders(void)
+{
+    uint32_t stale = 0;
+    for (uint8_t i=0; i<4; ++i) {
+        uint8_t value = g_fader[i].value;
+        if (value < 3 || value > 124) continue;
+        // The default linear curve stretches 3..124 over 0..127.
+        int16_t expected = (value - 3) * 127 / 121;
+        if (s_last_cc[16 + 2*i] != expected) ++stale;
+    }
+    return stale;
+}
+
+static uint32_t check_feedback(void)
+{
+    uint32_t wrong = 0;
+    for (uint8_t k=0; k<16; ++k) {
+        uint8_t note = g_midi_key_note[k];
+        if (midi_note_is_on(note) != s_led_expected[note]) ++wrong;
+    }
+    return wrong;
+}
+
+// Driver --------------------------------------------------------------------
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t s_total_lost = 0;
+static uint32_t s_ran = 0;
+
+static void report(const scenario_t* scenario)
+{
+    result_t* r = &s_result;
+    uint32_t missing_on = r->notes_on_expected > r->notes_on
+                        ? r->notes_on_expected - r->notes_on : 0;
+    uint32_t missing_off = r->notes_off_expected > r->notes_off
+                         ? r->notes_off_expected - r->notes_off : 0;
+    uint32_t stale = scenario->faders ? check_faders() : 0;
+    uint32_t wrong_leds = scenario->feedback ? check_feedback() : 0;
+    r->lost = missing_on + missing_off + stale + wrong_leds + r->timeouts;
+    s_total_lost += r->lost;
+
+    printf("%-9s %6u %7.0f %7.0f %6.0f  %5u/%-5u %5u/%-5u %6u %6u %6u %5u %6.2f %6.2f %5u\n",
+           scenario->name, r->loops,
+           r->loops ? (double)r->loop_ns_total / r->loops : 0.0,
+           (double)r->loop_ns_max,
+           r->key_isr ? (double)r->key_isr_ns / r->key_isr : 0.0,
+           r->notes_on, r->notes_on_expected,
+           r->notes_off, r->notes_off_expected,
+           r->ccs, r->packets_in, r->packets_out, r->backlog_max,
+           r->latency_count ? r->latency_total_ms / r->latency_count : 0.0,
+           r->latency_max_ms, r->lost);
+    if (missing_on || missing_off)
+        printf("          lost %u NoteOn, %u NoteOff\n", missing_on, missing_off);
+    if (stale)
+        printf("          %u faders left on a stale CC value\n", stale);
+    if (wrong_leds)
+        printf("          %u pads don't match the LED feedback\n", wrong_leds);
+    if (r->timeouts)
+        printf("          %u packets dropped waiting for the host\n", r->timeouts);
+    fflush(stdout);
+}
+
+// Called at the end of every main loop pass. Accounts the host time the
+// pass took, moves the simulated clock on and steps the current scenario.
+//
+void bench_loop_hook(void)
+{
+    static enum { WARMUP, RUN, SETTLE } phase = WARMUP;
+    static size_t current = 0;
+    static double start_ms = 0;
+    static double settle_ms = 0;
+    static uint64_t pass_start = 0;
+    static sim_counters_t hw_start;
+    static sim_usb_counters_t usb_start;
+
+    uint64_t now = host_ns();
+    if (phase == RUN && pass_start) {
+        uint64_t ns = now - pass_start;
+        ++s_result.loops;
+        s_result.loop_ns_total += ns;
+        if (ns > s_result.loop_ns_max) s_result.loop_ns_max = ns;
+    }
+
+    if (!pass_start) start_ms = sim_now_ms();
+    sim_advance_us(s_loop_us);
+    double t = sim_now_ms() - start_ms;
+
+    if (phase == WARMUP) {
+        // Keep the pads playing plain notes so every key press has
+        // exactly one NoteOn to look for.
+        g_combos_enable = 0;
+        g_key_fourbanks_mode = FOURBANKS_OFF;
+        g_rotate_enable = 0;
+        if (t < 100.0) goto done;
+        while (current < NUM_SCENARIOS && s_only &&
+               strcmp(s_scenarios[current].name, s_only)) {
+            ++current;
+        }
+        if (current == NUM_SCENARIOS) {
+            fprintf(stderr, "bench: no scenario called %s\n", s_only);
+            exit(2);
+        }
+        memset(&s_result, 0, sizeof(s_result));
+        memset(s_press_pending, 0, sizeof(s_press_pending));
+        for (uint8_t i=0; i<128; ++i) s_last_cc[i] = -1;
+        hw_start = g_sim;
+        usb_start = g_sim_usb;
+        start_ms = sim_now_ms();
+        t = 0;
+        phase = RUN;
+    }
+
+    const scenario_t* scenario = &s_scenarios[current];
+
+    if (phase == RUN) {
+        bool stopping = t >= scenario->ms;
+        if (scenario->keys) step_keys(t, stopping);
+        if (scenario->faders && !stopping) step_faders(t, scenario->ms);
+        if (scenario->feedback && !stopping) step_feedback(t);
+        if (stopping && !g_sim_keys && !g_sim_exp_keys) {
+            settle_ms = t + SETTLE_MS;
+            phase = SETTLE;
+        }
+    } else if (phase == SETTLE && t >= settle_ms) {
+        s_result.key_isr = g_sim.key_isr - hw_start.key_isr;
+        s_result.key_isr_ns = g_sim.key_isr_host_ns - hw_start.key_isr_host_ns;
+        s_result.packets_in = g_sim_usb.in_packets - usb_start.in_packets;
+        s_result.packets_out = g_sim_usb.out_packets - usb_start.out_packets;
+        s_result.backlog_max = g_sim_usb.out_backlog_max;
+        s_result.timeouts = g_sim_usb.in_timeouts - usb_start.in_timeouts;
+        g_sim_usb.out_backlog_max = 0;
+        report(scenario);
+        ++s_ran;
+        ++current;
+        if (s_only || current == NUM_SCENARIOS) {
+            printf("\n%u scenarios, %u events lost, %u watchdog trips\n",
+                   s_ran, s_total_lost, g_sim.wdt_trips);
+            exit(s_total_lost || g_sim.wdt_trips ? 1 : 0);
+        }
+        start_ms = sim_now_ms();
+        phase = WARMUP;
+    }
+
+done:
+    pass_start = host_ns();
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "l:b:s:h")) != -1) {
+        switch (opt) {
+        case 'l': s_loop_us = atof(optarg); break;
+        case 'b': g_sim_usb_in_banks_per_frame = atoi(optarg); break;
+        case 's': s_only = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-l loop_us] [-b banks_per_frame] [-s scenario]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    printf("loop %.0fus, host takes %u IN banks per frame\n\n",
+           s_loop_us, g_sim_usb_in_banks_per_frame);
+    printf("%-9s %6s %7s %7s %6s  %11s %11s %6s %6s %6s %5s %6s %6s %5s\n",
+           "scenario", "loops", "ns/loop", "max ns", "ns/isr",
+           "noteon", "noteoff", "cc", "in", "out", "queue",
+           "lat ms", "max ms", "lost");
+
+    sim_hw_reset();
+    return firmware_main();
+}
@@ -0,0 +1,16 @@
+// Host simulation stand-in for <LUFA/Common/Common.h>
+
+#ifndef _SIM_LUFA_COMMON_H_INCLUDED
+#define _SIM_LUFA_COMMON_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ATTR_NO_INIT
+#define ATTR_INIT_SECTION(x)
+#define ATTR_WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...)
+#define ATTR_PACKED __attribute__((packed))
+#define ATTR_ALWAYS_INLINE
+
+#endif // _SIM_LUFA_COMMON_H_INCLUDED
@@ -0,0 +1,42 @@
+// Host simulation stand-in for <LUFA/Drivers/USB/Class/MIDI.h>
+
+#ifndef _SIM_LUFA_MIDI_H_INCLUDED
+#define _SIM_LUFA_MIDI_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <LUFA/Drivers/USB/USB.h>
+
+typedef struct {
+    unsigned char Command     : 4;
+    unsigned char CableNumber : 4;
+    uint8_t Data1;
+    uint8_t Data2;
+    uint8_t Data3;
+} ATTR_PACKED MIDI_EventPacket_t;
+
+typedef struct {
+    const struct {
+        uint8_t  StreamingInterfaceNumber;
+        uint8_t  DataINEndpointNumber;
+        uint16_t DataINEndpointSize;
+        bool     DataINEndpointDoubleBank;
+        uint8_t  DataOUTEndpointNumber;
+        uint16_t DataOUTEndpointSize;
+        bool     DataOUTEndpointDoubleBank;
+    } Config;
+    struct {
+        uint8_t Reserved;
+    } State;
+} USB_ClassInfo_MIDI_Device_t;
+
+bool MIDI_Device_ConfigureEndpoints(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo);
+void MIDI_Device_ProcessControlRequest(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo);
+void MIDI_Device_USBTask(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo);
+uint8_t MIDI_Device_SendEventPacket(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo,
+                                    const MIDI_EventPacket_t* const Event);
+uint8_t MIDI_Device_Flush(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo);
+bool MIDI_Device_ReceiveEventPacket(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo,
+                                    MIDI_EventPacket_t* const Event);
+
+#endif // _SIM_LUFA_MIDI_H_INCLUDED
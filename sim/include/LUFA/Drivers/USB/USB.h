@@ -0,0 +1,75 @@
+// Host simulation stand-in for <LUFA/Drivers/USB/USB.h>
+//
+// Covers the device-mode subset of the LUFA 101122 API used by the
+// firmware. The endpoint calls operate on the simulated host model in
+// sim_usb.c.
+
+#ifndef _SIM_LUFA_USB_H_INCLUDED
+#define _SIM_LUFA_USB_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <LUFA/Common/Common.h>
+
+// Device state ---------------------------------------------------------------
+
+enum USB_Device_States_t {
+    DEVICE_STATE_Unattached = 0,
+    DEVICE_STATE_Powered,
+    DEVICE_STATE_Default,
+    DEVICE_STATE_Addressed,
+    DEVICE_STATE_Configured,
+    DEVICE_STATE_Suspended,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+void USB_Init(void);
+void USB_ShutDown(void);
+void USB_USBTask(void);
+void USB_Device_EnableSOFEvents(void);
+void USB_Device_DisableSOFEvents(void);
+uint16_t USB_Device_GetFrameNumber(void);
+
+// Endpoints ------------------------------------------------------------------
+
+#define ENDPOINT_READYWAIT_NoError            0
+#define ENDPOINT_READYWAIT_EndpointStalled    1
+#define ENDPOINT_READYWAIT_DeviceDisconnected 2
+#define ENDPOINT_READYWAIT_BusSuspended       3
+#define ENDPOINT_READYWAIT_Timeout            4
+
+#define ENDPOINT_RWSTREAM_NoError             0
+#define ENDPOINT_RWSTREAM_DeviceDisconnected  2
+
+void Endpoint_SelectEndpoint(const uint8_t EndpointNumber);
+uint8_t Endpoint_GetCurrentEndpoint(void);
+bool Endpoint_IsReadWriteAllowed(void);
+bool Endpoint_IsINReady(void);
+bool Endpoint_IsOUTReceived(void);
+void Endpoint_ClearIN(void);
+void Endpoint_ClearOUT(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+void Endpoint_Write_Byte(const uint8_t Byte);
+uint8_t Endpoint_Read_Byte(void);
+uint8_t Endpoint_WaitUntilReady(void);
+
+// Descriptors ----------------------------------------------------------------
+//
+// Opaque stand-ins so usb_descriptors.h can be included.
+
+typedef struct { uint8_t Size; uint8_t Type; } USB_Descriptor_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Configuration_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Interface_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Device_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Audio_Descriptor_Interface_AC_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_MIDI_Descriptor_AudioInterface_AS_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_MIDI_Descriptor_InputJack_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_MIDI_Descriptor_OutputJack_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Audio_Descriptor_StreamEndpoint_Std_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_MIDI_Descriptor_Jack_Endpoint_t;
+
+#endif // _SIM_LUFA_USB_H_INCLUDED
@@ -0,0 +1,9 @@
+// Host simulation stand-in for <LUFA/Version.h>
+
+#ifndef _SIM_LUFA_VERSION_H_INCLUDED
+#define _SIM_LUFA_VERSION_H_INCLUDED
+
+#define LUFA_VERSION_INTEGER 0x101122
+#define LUFA_VERSION_STRING  "101122-sim"
+
+#endif // _SIM_LUFA_VERSION_H_INCLUDED
@@ -0,0 +1,6 @@
+// Host simulation stand-in for <avr/boot.h>
+
+#ifndef _SIM_AVR_BOOT_H_INCLUDED
+#define _SIM_AVR_BOOT_H_INCLUDED
+
+#endif // _SIM_AVR_BOOT_H_INCLUDED
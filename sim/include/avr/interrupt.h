@@ -0,0 +1,19 @@
+// Host simulation stand-in for <avr/interrupt.h>
+//
+// Interrupt handlers become plain functions that the simulator calls
+// between main loop steps, so enabling and disabling interrupts only
+// needs to be recorded.
+
+#ifndef _SIM_AVR_INTERRUPT_H_INCLUDED
+#define _SIM_AVR_INTERRUPT_H_INCLUDED
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+
+void sim_sei(void);
+void sim_cli(void);
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#endif // _SIM_AVR_INTERRUPT_H_INCLUDED
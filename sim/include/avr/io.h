@@ -0,0 +1,139 @@
+// Host simulation stand-in for <avr/io.h>
+//
+// Only the at90usb162 registers and bit names used by the firmware are
+// declared. Plain registers are ordinary variables. Registers whose reads
+// have to be modelled (shift register inputs, timers, EEPROM) are
+// routed through accessor functions in sim_hw.c that return a pointer, so
+// the firmware can keep using them as lvalues.
+
+#ifndef _SIM_AVR_IO_H_INCLUDED
+#define _SIM_AVR_IO_H_INCLUDED
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// Port B, C, D --------------------------------------------------------------
+
+extern volatile uint8_t DDRB, PORTB, PINB;
+extern volatile uint8_t DDRC, PORTC;
+extern volatile uint8_t DDRD, PORTD;
+
+volatile uint8_t* sim_pinc(void);
+volatile uint8_t* sim_pind(void);
+#define PINC (*sim_pinc())
+#define PIND (*sim_pind())
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+// SPI -----------------------------------------------------------------------
+
+extern volatile uint8_t SPCR, SPDR;
+volatile uint8_t* sim_spsr(void);
+#define SPSR (*sim_spsr())
+
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE  6
+#define SPIE 7
+
+#define SPI2X 0
+#define WCOL  6
+#define SPIF  7
+
+// Timers --------------------------------------------------------------------
+
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t* sim_tcnt0(void);
+#define TCNT0 (*sim_tcnt0())
+
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, OCR1B;
+volatile uint16_t* sim_tcnt1(void);
+#define TCNT1 (*sim_tcnt1())
+
+#define WGM00 0
+#define WGM01 1
+#define CS00  0
+#define CS01  1
+#define CS02  2
+#define WGM02 3
+#define TOIE0  0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TOV0   0
+#define OCF0A  1
+
+#define WGM10 0
+#define WGM11 1
+#define CS10  0
+#define CS11  1
+#define CS12  2
+#define WGM12 3
+#define WGM13 4
+#define TOIE1  0
+#define OCIE1A 1
+#define OCIE1B 2
+#define TOV1   0
+#define OCF1A  1
+#define OCF1B  2
+
+// USART1 --------------------------------------------------------------------
+
+extern volatile uint8_t UCSR1A, UCSR1B, UCSR1C, UDR1;
+extern volatile uint16_t UBRR1;
+
+// EEPROM --------------------------------------------------------------------
+
+extern volatile uint16_t EEAR;
+volatile uint8_t* sim_eecr(void);
+volatile uint8_t* sim_eedr(void);
+#define EECR (*sim_eecr())
+#define EEDR (*sim_eedr())
+
+#define EERE  0
+#define EEPE  1
+#define EEMPE 2
+#define EERIE 3
+
+// System --------------------------------------------------------------------
+
+extern volatile uint8_t MCUSR, SREG;
+
+#define SREG_I 7
+
+#define PORF  0
+#define EXTRF 1
+#define BORF  2
+#define WDRF  3
+
+#endif // _SIM_AVR_IO_H_INCLUDED
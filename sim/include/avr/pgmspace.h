@@ -0,0 +1,15 @@
+// Host simulation stand-in for <avr/pgmspace.h>
+
+#ifndef _SIM_AVR_PGMSPACE_H_INCLUDED
+#define _SIM_AVR_PGMSPACE_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define memcpy_P(dst, src, n) memcpy((dst), (src), (n))
+
+#endif // _SIM_AVR_PGMSPACE_H_INCLUDED
@@ -0,0 +1,9 @@
+// Host simulation stand-in for <avr/power.h>
+
+#ifndef _SIM_AVR_POWER_H_INCLUDED
+#define _SIM_AVR_POWER_H_INCLUDED
+
+#define clock_div_1 0
+#define clock_prescale_set(div) do { (void)(div); } while (0)
+
+#endif // _SIM_AVR_POWER_H_INCLUDED
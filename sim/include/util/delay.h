@@ -0,0 +1,15 @@
+// Host simulation stand-in for <util/delay.h>
+//
+// Blocking delays advance the simulated clock, running any timer
+// interrupts that would have fired while the CPU was spinning.
+
+#ifndef _SIM_UTIL_DELAY_H_INCLUDED
+#define _SIM_UTIL_DELAY_H_INCLUDED
+
+#include <inttypes.h>
+
+void sim_delay_us(double us);
+#define _delay_ms(ms) sim_delay_us((ms) * 1000.0)
+#define _delay_us(us) sim_delay_us(us)
+
+#endif // _SIM_UTIL_DELAY_H_INCLUDED
@@ -0,0 +1,83 @@
+// Host simulation of the Midifighter Pro hardware
+//
+// The firmware sources are compiled for the host against the stand-in
+// headers in sim/include. sim_hw.c models the registers, the simulated
+// clock and the interrupts, sim_usb.c models the USB endpoints and the
+// host at the other end of them, and bench.c drives the whole thing with
+// scripted input.
+
+#ifndef _SIM_H_INCLUDED
+#define _SIM_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Clock ---------------------------------------------------------------------
+
+// Simulated time since reset, in nanoseconds.
+extern uint64_t g_sim_time_ns;
+
+static inline double sim_now_ms(void) { return g_sim_time_ns / 1e6; }
+
+// Move the simulated clock forward, running any interrupts that come due
+// (or holding them pending while interrupts are disabled).
+void sim_advance_us(double us);
+
+// Clear the EEPROM to its erased state.
+void sim_hw_reset(void);
+
+// Inputs --------------------------------------------------------------------
+
+extern uint16_t g_sim_keys;       // Pads held down, bit 0 = first bit read.
+extern uint8_t g_sim_exp_keys;    // Expansion port inputs held down.
+extern uint16_t g_sim_adc[4];     // 10-bit value on each ADC channel.
+extern uint16_t g_sim_mux_adc[4][8];  // Behind a multiplexer on a channel.
+
+// Counters ------------------------------------------------------------------
+
+typedef struct {
+    uint32_t key_isr;             // TIMER0 interrupts run.
+    uint32_t spi_isr;             // SPI transfer complete interrupts run.
+    uint32_t led_isr;             // LED brightness interrupts run.
+    uint32_t sof;                 // USB frames.
+    uint32_t spi_bytes;           // Foreground SPI transfers.
+    uint32_t eeprom_writes;       // Bytes programmed into the EEPROM.
+    uint32_t eeprom_isr;          // EEPROM ready interrupts run.
+    uint32_t wdt_trips;           // Times the watchdog would have reset us.
+    uint64_t key_isr_host_ns;     // Host time spent in the key interrupt.
+} sim_counters_t;
+
+extern sim_counters_t g_sim;
+
+// USB host model ------------------------------------------------------------
+
+typedef struct {
+    uint32_t in_packets;          // USB-MIDI packets taken by the host.
+    uint32_t in_banks;            // IN endpoint banks taken by the host.
+    uint32_t in_timeouts;         // Endpoint waits that gave up (packet lost).
+    uint32_t out_packets;         // Packets the firmware read from the host.
+    uint32_t out_backlog_max;     // Most packets waiting to go to the device.
+} sim_usb_counters_t;
+
+extern sim_usb_counters_t g_sim_usb;
+
+// IN endpoint banks the host will take per frame.
+extern uint8_t g_sim_usb_in_banks_per_frame;
+
+// Set once the firmware asks for start of frame events.
+extern bool g_sim_usb_sof_enabled;
+
+void sim_usb_frame(void);
+bool sim_usb_send(uint8_t command, uint8_t data1, uint8_t data2, uint8_t data3);
+uint32_t sim_usb_backlog(void);
+
+// Called by the USB model for every packet the host receives.
+void bench_host_receive(const uint8_t packet[4]);
+
+// Called once per pass of the firmware main loop.
+void bench_loop_hook(void);
+
+// The firmware entry point, renamed by the sim makefile.
+int firmware_main(void);
+
+#endif // _SIM_H_INCLUDED
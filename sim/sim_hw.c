@@ -0,0 +1,449 @@
+// Host simulation of the at90usb162 registers, clock and interrupts
+//
+// Most registers are plain variables. The few whose reads have to be
+// modelled go through the accessor functions declared in sim/include/avr/io.h:
+//
+//   PINC   the two 74HC165 key shift registers, one bit pair per read
+//   PIND   the expansion port 74HC165, one bit per read
+//   SPSR   a foreground SPI transfer, answered by the ADC model
+//   TCNT1  the free-running timer, derived from the simulated clock, with
+//          compare A interrupts when it passes OCR1A
+//   EECR   the EEPROM, reading at once and writing 3.4ms after the strobe
+//
+// Interrupts are run from sim_advance_us() whenever they come due and the
+// I bit in SREG is set. The firmware runs single threaded, so an interrupt
+// can only happen at the points where the simulated clock moves: delays,
+// SPI transfers, endpoint and EEPROM waits and the end of each main loop
+// pass.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#include "sim.h"
+#include "../constants.h"
+#include "../expansion.h"
+
+// The firmware's interrupt handlers and USB events.
+void TIMER0_COMPA_vect(void);
+void TIMER1_COMPA_vect(void);
+void SPI_STC_vect(void);
+void EE_READY_vect(void);
+void EVENT_USB_Device_StartOfFrame(void);
+void Jump_To_Bootloader(void);
+
+// Registers -----------------------------------------------------------------
+
+volatile uint8_t DDRB, PORTB, PINB;
+volatile uint8_t DDRC, PORTC;
+volatile uint8_t DDRD, PORTD;
+volatile uint8_t SPCR, SPDR;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, OCR1B;
+volatile uint8_t UCSR1A, UCSR1B, UCSR1C, UDR1;
+volatile uint16_t UBRR1;
+volatile uint16_t EEAR;
+volatile uint8_t MCUSR, SREG;
+
+static volatile uint8_t s_pinc, s_pind, s_spsr, s_tcnt0, s_eecr, s_eedr;
+static volatile uint16_t s_tcnt1;
+
+// State ---------------------------------------------------------------------
+
+uint64_t g_sim_time_ns = 0;
+sim_counters_t g_sim;
+
+uint16_t g_sim_keys = 0;
+uint8_t g_sim_exp_keys = 0;
+uint16_t g_sim_adc[4] = {512, 512, 512, 512};
+uint16_t g_sim_mux_adc[4][8];
+
+static uint8_t s_key_bit = 0;         // Next bit pair out of the key chips.
+static uint8_t s_exp_bit = 0;         // Next bit out of the expansion chip.
+
+static uint8_t s_adc_state = 0;       // Byte of the ADC exchange (0..2).
+static uint8_t s_adc_channel = 0;
+static uint16_t s_adc_sample = 0;     // Held from the second byte on.
+
+static uint8_t s_eeprom[512];
+
+static bool s_in_isr = false;
+static bool s_key_pending = false;
+static bool s_sof_pending = false;
+static bool s_cmp_pending = false;
+
+#define SOF_PERIOD_NS 1000000
+// Time the EEPROM takes to program a byte.
+#define EEPROM_WRITE_NS 3400000
+// fck/16 SPI clock, 8 bits per byte.
+#define SPI_BYTE_US 8.0
+
+static uint64_t s_next_key_ns = 1000000;  // Until key_setup() sets it.
+static uint64_t s_key_from_ns = 0;         // Last Timer0 match or restart.
+static uint8_t s_tcnt0_seen = 0;           // Count the last TCNT0 read gave.
+static uint64_t s_next_sof_ns = SOF_PERIOD_NS;
+static uint64_t s_eeprom_done_ns = 0;  // When the running write finishes.
+static bool s_cmp_enabled = false;     // OCIE1A seen set.
+static uint64_t s_cmp_from_ns = 0;     // Last compare A, or when enabled.
+
+static bool s_wdt_enabled = false;
+static uint64_t s_wdt_deadline_ns = 0;
+static uint64_t s_wdt_timeout_ns = 0;
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// SPI devices ---------------------------------------------------------------
+
+// Answer one byte sent to the bus. While the ADC is selected it is a three
+// byte conversion (see exp_adc_read()), otherwise the byte went to the LED
+// driver which has nothing to say back.
+//
+static uint8_t spi_exchange(uint8_t mosi)
+{
+    if (PORTB & ADC_SELECT) {
+        s_adc_state = 0;
+        return 0;
+    }
+    switch (s_adc_state) {
+    case 0:
+        if (mosi & 0x01) s_adc_state = 1;
+        return 0;
+    case 1:
+        // The input is sampled here, through the multiplexer on the
+        // channel if one is fitted (see MULTIPLEX_ANALOG).
+        s_adc_channel = (mosi >> 4) & 0x03;
+        s_adc_sample = g_sim_adc[s_adc_channel] & 0x3ff;
+#ifdef MULTIPLEX_ANALOG
+        if (s_adc_channel < EXP_MUX_PORTS) {
+            uint8_t select = (PORTD & EXP_MUX_SELECT) >> EXP_MUX_SELECT_SHIFT;
+            s_adc_sample = g_sim_mux_adc[s_adc_channel][select] & 0x3ff;
+        }
+#endif
+        s_adc_state = 2;
+        return (s_adc_sample >> 8) & 0x07;
+    default:
+        s_adc_state = 0;
+        return s_adc_sample & 0xff;
+    }
+}
+
+// Interrupts ----------------------------------------------------------------
+
+static void key_timer_step(void);
+
+static void run_isr(void (*isr)(void))
+{
+    uint8_t sreg = SREG;
+    SREG &= ~_BV(SREG_I);
+    s_in_isr = true;
+    isr();
+    s_in_isr = false;
+    key_timer_step();
+    SREG = sreg;
+}
+
+// Run the background SPI chain started by the key interrupt through to the
+// end. The main loop can't run in the middle of it (it would spin forever
+// in spi_acquire()), so the whole round of conversions happens at once.
+//
+static void run_spi_chain(void)
+{
+    while ((SPCR & _BV(SPIE)) && (SREG & _BV(SREG_I))) {
+        SPDR = spi_exchange(SPDR);
+        ++g_sim.spi_isr;
+        run_isr(SPI_STC_vect);
+    }
+}
+
+static void eeprom_step(void);
+
+// The EEPROM ready interrupt is level triggered: it keeps firing for as
+// long as it is enabled and no write is running.
+//
+static bool eeprom_ready_pending(void)
+{
+    eeprom_step();
+    return (s_eecr & _BV(EERIE)) && !(s_eecr & _BV(EEPE));
+}
+
+// When TCNT1 next matches OCR1A after the last match. Timer1 counts every
+// 500ns in normal mode, so a match comes round at least once per wrap.
+//
+static uint64_t compare_ns(void)
+{
+    uint64_t from = s_cmp_from_ns / 500;
+    uint16_t delta = OCR1A - (uint16_t)from;
+    return (from + (delta ? delta : 65536)) * 500;
+}
+
+// The key read timer in CTC mode clears every OCR0A+1 counts of its
+// prescaled clock. Only the prescalers key.c might use are modelled.
+//
+static uint64_t key_tick_ns(void)
+{
+    uint8_t cs = TCCR0B & (_BV(CS02) | _BV(CS01) | _BV(CS00));
+    uint32_t prescale = cs == _BV(CS02) ? 256 : cs == _BV(CS01) ? 8 : 64;
+    return prescale * 1000 / 16;
+}
+
+static uint64_t key_period_ns(void)
+{
+    return (OCR0A + 1) * key_tick_ns();
+}
+
+// The firmware writes TCNT0 to lock the key scans to the USB frames. A
+// write shows up as the count no longer matching the last read, after which
+// the timer carries on counting from the written value.
+//
+static void key_timer_step(void)
+{
+    if (s_tcnt0 == s_tcnt0_seen) return;
+    s_key_from_ns = g_sim_time_ns - s_tcnt0 * key_tick_ns();
+    s_next_key_ns = s_key_from_ns + key_period_ns();
+    s_tcnt0_seen = s_tcnt0;
+}
+
+static void run_pending(void)
+{
+    if (s_in_isr || !(SREG & _BV(SREG_I))) return;
+    while (s_key_pending || s_sof_pending || s_cmp_pending ||
+           eeprom_ready_pending()) {
+        if (s_cmp_pending) {
+            s_cmp_pending = false;
+            if (TIMSK1 & _BV(OCIE1A)) {
+                ++g_sim.led_isr;
+                run_isr(TIMER1_COMPA_vect);
+            }
+        }
+        if (s_key_pending) {
+            s_key_pending = false;
+            if (TIMSK0 & _BV(OCIE0A)) {
+                s_key_bit = 0;
+                s_exp_bit = 0;
+                ++g_sim.key_isr;
+                uint64_t start = host_ns();
+                run_isr(TIMER0_COMPA_vect);
+                run_spi_chain();
+                g_sim.key_isr_host_ns += host_ns() - start;
+            }
+        }
+        if (s_sof_pending) {
+            s_sof_pending = false;
+            if (g_sim_usb_sof_enabled) run_isr(EVENT_USB_Device_StartOfFrame);
+        }
+        if (eeprom_ready_pending()) {
+            ++g_sim.eeprom_isr;
+            run_isr(EE_READY_vect);
+        }
+    }
+}
+
+void sim_advance_us(double us)
+{
+    uint64_t target = g_sim_time_ns + (uint64_t)(us * 1000.0);
+    eeprom_step();
+    key_timer_step();
+    for (;;) {
+        if ((TIMSK1 & _BV(OCIE1A)) && !s_cmp_enabled) {
+            s_cmp_from_ns = g_sim_time_ns;
+        }
+        s_cmp_enabled = (TIMSK1 & _BV(OCIE1A)) != 0;
+
+        uint64_t next = s_next_key_ns < s_next_sof_ns ? s_next_key_ns
+                                                      : s_next_sof_ns;
+        uint64_t cmp = s_cmp_enabled ? compare_ns() : UINT64_MAX;
+        if (cmp < next) next = cmp;
+        bool eeprom_due = (s_eecr & _BV(EEPE)) && s_eeprom_done_ns <= next;
+        if (eeprom_due) next = s_eeprom_done_ns;
+        if (next > target) break;
+        g_sim_time_ns = next;
+        if (eeprom_due) {
+            eeprom_step();
+            run_pending();
+            continue;
+        }
+        if (next == cmp) {
+            s_cmp_from_ns = cmp;
+            s_cmp_pending = true;
+            run_pending();
+            continue;
+        }
+        if (next == s_next_key_ns) {
+            s_key_from_ns = next;
+            s_next_key_ns += key_period_ns();
+            s_key_pending = true;
+        }
+        if (next == s_next_sof_ns) {
+            s_next_sof_ns += SOF_PERIOD_NS;
+            ++g_sim.sof;
+            // The host side of the bus carries on regardless of what the
+            // CPU is doing.
+            sim_usb_frame();
+            s_sof_pending = true;
+        }
+        run_pending();
+    }
+    g_sim_time_ns = target;
+    run_pending();
+
+    if (s_wdt_enabled && g_sim_time_ns > s_wdt_deadline_ns) {
+        ++g_sim.wdt_trips;
+        s_wdt_deadline_ns = g_sim_time_ns + s_wdt_timeout_ns;
+    }
+}
+
+void sim_sei(void)
+{
+    SREG |= _BV(SREG_I);
+    run_pending();
+}
+
+void sim_cli(void)
+{
+    SREG &= ~_BV(SREG_I);
+}
+
+void sim_delay_us(double us)
+{
+    sim_advance_us(us);
+}
+
+// Register accessors --------------------------------------------------------
+
+volatile uint8_t* sim_pinc(void)
+{
+    // Open keys read high.
+    uint8_t value = 0xff;
+    if (s_key_bit < 8) {
+        if (g_sim_keys & (0x0080 >> s_key_bit)) value &= ~KEY_LOBIT;
+        if (g_sim_keys & (0x8000 >> s_key_bit)) value &= ~KEY_HIBIT;
+        ++s_key_bit;
+    }
+    s_pinc = value;
+    return &s_pinc;
+}
+
+volatile uint8_t* sim_pind(void)
+{
+    uint8_t value = 0xff;
+    if (s_exp_bit < 8) {
+        if (g_sim_exp_keys & (0x80 >> s_exp_bit)) value &= ~EXP_KEY_BIT;
+        ++s_exp_bit;
+    }
+    s_pind = value;
+    return &s_pind;
+}
+
+volatile uint8_t* sim_spsr(void)
+{
+    // Every poll of SPSR is taken as one complete foreground transfer.
+    SPDR = spi_exchange(SPDR);
+    ++g_sim.spi_bytes;
+    s_spsr = _BV(SPIF);
+    sim_advance_us(SPI_BYTE_US);
+    return &s_spsr;
+}
+
+volatile uint8_t* sim_tcnt0(void)
+{
+    uint64_t count = (g_sim_time_ns - s_key_from_ns) / key_tick_ns();
+    s_tcnt0 = count > 0xff ? 0xff : (uint8_t)count;
+    s_tcnt0_seen = s_tcnt0;
+    return &s_tcnt0;
+}
+
+volatile uint16_t* sim_tcnt1(void)
+{
+    // clk/8 at 16MHz is one count every 500ns.
+    s_tcnt1 = (uint16_t)(g_sim_time_ns / 500);
+    return &s_tcnt1;
+}
+
+static uint16_t s_eeprom_address;
+static uint8_t s_eeprom_data;
+
+static void eeprom_step(void)
+{
+    // A write strobed with EEPE latches the address and data, then takes a
+    // while to finish.
+    if ((s_eecr & _BV(EEPE)) && s_eeprom_done_ns == 0) {
+        s_eeprom_address = EEAR & 0x1ff;
+        s_eeprom_data = s_eedr;
+        s_eeprom_done_ns = g_sim_time_ns + EEPROM_WRITE_NS;
+        s_eecr &= ~_BV(EEMPE);
+    }
+    if ((s_eecr & _BV(EEPE)) && g_sim_time_ns >= s_eeprom_done_ns) {
+        s_eeprom[s_eeprom_address] = s_eeprom_data;
+        ++g_sim.eeprom_writes;
+        s_eeprom_done_ns = 0;
+        s_eecr &= ~_BV(EEPE);
+    }
+    if (s_eecr & _BV(EERE)) {
+        s_eedr = s_eeprom[EEAR & 0x1ff];
+        s_eecr &= ~_BV(EERE);
+    }
+}
+
+volatile uint8_t* sim_eecr(void)
+{
+    eeprom_step();
+    // Polling EEPE while a write runs takes time, or the wait would never
+    // end. Once it's done the ready interrupt gets its chance to start the
+    // next one, as it would between any two instructions.
+    if (s_eecr & _BV(EEPE)) sim_advance_us(1);
+    else run_pending();
+    return &s_eecr;
+}
+
+volatile uint8_t* sim_eedr(void)
+{
+    eeprom_step();
+    return &s_eedr;
+}
+
+// Watchdog ------------------------------------------------------------------
+
+void sim_wdt_enable(unsigned char timeout)
+{
+    s_wdt_timeout_ns = 15000000ull << timeout;
+    s_wdt_deadline_ns = g_sim_time_ns + s_wdt_timeout_ns;
+    s_wdt_enabled = true;
+}
+
+void sim_wdt_disable(void)
+{
+    s_wdt_enabled = false;
+}
+
+void sim_wdt_reset(void)
+{
+    s_wdt_deadline_ns = g_sim_time_ns + s_wdt_timeout_ns;
+}
+
+// Odds and ends -------------------------------------------------------------
+
+// Stands in for jumptoboot.c, which jumps into the bootloader with inline
+// assembly.
+void Jump_To_Bootloader(void)
+{
+    fprintf(stderr, "sim: firmware asked for the bootloader\n");
+    exit(2);
+}
+
+void sim_hw_reset(void)
+{
+    memset(s_eeprom, 0xff, sizeof(s_eeprom));
+    s_eecr &= ~(_BV(EEPE) | _BV(EEMPE));
+    s_eeprom_done_ns = 0;
+}
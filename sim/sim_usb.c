@@ -0,0 +1,271 @@
+// Host simulation of the USB device endpoints and the host driving them
+//
+// Stands in for the LUFA 101122 device calls the firmware makes. The MIDI
+// IN endpoint is double banked like the real one: the firmware fills one
+// 64 byte bank while the other waits for the host, and the host takes a
+// limited number of banks per 1ms frame. The OUT endpoint is a single 32
+// byte bank the host refills from its own queue of packets whenever the
+// firmware has emptied it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Drivers/USB/Class/MIDI.h>
+
+#include "sim.h"
+#include "../usb_descriptors.h"
+
+void EVENT_USB_Device_Connect(void);
+void EVENT_USB_Device_ConfigurationChanged(void);
+
+volatile uint8_t USB_DeviceState = DEVICE_STATE_Unattached;
+
+sim_usb_counters_t g_sim_usb;
+uint8_t g_sim_usb_in_banks_per_frame = 2;
+bool g_sim_usb_sof_enabled = false;
+
+// Longest LUFA waits for the host before giving up (USB_STREAM_TIMEOUT_MS).
+#define STREAM_TIMEOUT_MS 100
+
+// IN endpoint ---------------------------------------------------------------
+
+typedef struct {
+    uint8_t data[MIDI_STREAM_IN_EPSIZE];
+    uint8_t length;
+    bool committed;   // Handed to the host, waiting to be read.
+} bank_t;
+
+static bank_t s_in_bank[2];
+static uint8_t s_in_fill = 0;  // Bank the firmware is writing.
+
+// OUT endpoint and the host's queue for it ----------------------------------
+
+#define OUT_BANK_PACKETS (MIDI_STREAM_OUT_EPSIZE / 4)
+#define HOST_QUEUE_SIZE 8192
+
+static uint8_t s_out_bank[OUT_BANK_PACKETS][4];
+static uint8_t s_out_count = 0;
+static uint8_t s_out_read = 0;
+
+static uint8_t s_host_queue[HOST_QUEUE_SIZE][4];
+static uint32_t s_host_head = 0;
+static uint32_t s_host_tail = 0;
+
+static uint8_t s_endpoint = 0;
+static uint16_t s_frame = 0;
+
+// Host side -----------------------------------------------------------------
+
+// One USB frame has gone by. The host reads whatever banks are waiting,
+// oldest first.
+//
+void sim_usb_frame(void)
+{
+    ++s_frame;
+    uint8_t taken = 0;
+    for (uint8_t k=0; k<2 && taken<g_sim_usb_in_banks_per_frame; ++k) {
+        bank_t* bank = &s_in_bank[(s_in_fill + k) & 1];
+        if (!bank->committed) continue;
+        ++taken;
+        for (uint8_t i=0; i+4<=bank->length; i+=4) {
+            ++g_sim_usb.in_packets;
+            bench_host_receive(&bank->data[i]);
+        }
+        ++g_sim_usb.in_banks;
+        bank->length = 0;
+        bank->committed = false;
+    }
+}
+
+// Queue a packet for the host to send to the device. Returns false if the
+// host has run out of room.
+//
+bool sim_usb_send(uint8_t command, uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    if (s_host_head - s_host_tail >= HOST_QUEUE_SIZE) return false;
+    uint8_t* packet = s_host_queue[s_host_head++ % HOST_QUEUE_SIZE];
+    packet[0] = command & 0x0f;
+    packet[1] = data1;
+    packet[2] = data2;
+    packet[3] = data3;
+    uint32_t backlog = sim_usb_backlog();
+    if (backlog > g_sim_usb.out_backlog_max) g_sim_usb.out_backlog_max = backlog;
+    return true;
+}
+
+uint32_t sim_usb_backlog(void)
+{
+    return (s_host_head - s_host_tail) + (s_out_count - s_out_read);
+}
+
+static void out_refill(void)
+{
+    s_out_count = 0;
+    s_out_read = 0;
+    while (s_out_count < OUT_BANK_PACKETS && s_host_tail != s_host_head) {
+        memcpy(s_out_bank[s_out_count++],
+               s_host_queue[s_host_tail++ % HOST_QUEUE_SIZE], 4);
+    }
+}
+
+// Device state --------------------------------------------------------------
+
+void USB_Init(void)
+{
+    memset(s_in_bank, 0, sizeof(s_in_bank));
+    s_in_fill = 0;
+    USB_DeviceState = DEVICE_STATE_Powered;
+    EVENT_USB_Device_Connect();
+    USB_DeviceState = DEVICE_STATE_Configured;
+    EVENT_USB_Device_ConfigurationChanged();
+}
+
+void USB_ShutDown(void)
+{
+    USB_DeviceState = DEVICE_STATE_Unattached;
+    g_sim_usb_sof_enabled = false;
+}
+
+void USB_USBTask(void)
+{
+    bench_loop_hook();
+}
+
+void USB_Device_EnableSOFEvents(void) { g_sim_usb_sof_enabled = true; }
+void USB_Device_DisableSOFEvents(void) { g_sim_usb_sof_enabled = false; }
+uint16_t USB_Device_GetFrameNumber(void) { return s_frame & 0x7ff; }
+
+// Endpoints -----------------------------------------------------------------
+
+void Endpoint_SelectEndpoint(const uint8_t EndpointNumber)
+{
+    s_endpoint = EndpointNumber;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void)
+{
+    return s_endpoint;
+}
+
+bool Endpoint_IsINReady(void)
+{
+    return !s_in_bank[s_in_fill].committed;
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+    return s_out_read < s_out_count;
+}
+
+bool Endpoint_IsReadWriteAllowed(void)
+{
+    if (s_endpoint == MIDI_STREAM_IN_EPNUM) {
+        bank_t* bank = &s_in_bank[s_in_fill];
+        return !bank->committed && bank->length < MIDI_STREAM_IN_EPSIZE;
+    }
+    return s_out_read < s_out_count;
+}
+
+void Endpoint_ClearIN(void)
+{
+    s_in_bank[s_in_fill].committed = true;
+    s_in_fill ^= 1;
+}
+
+void Endpoint_ClearOUT(void)
+{
+    s_out_count = 0;
+    s_out_read = 0;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+    if (s_endpoint == MIDI_STREAM_IN_EPNUM) {
+        bank_t* bank = &s_in_bank[s_in_fill];
+        return bank->committed ? 0 : bank->length;
+    }
+    return (s_out_count - s_out_read) * 4;
+}
+
+void Endpoint_Write_Byte(const uint8_t Byte)
+{
+    bank_t* bank = &s_in_bank[s_in_fill];
+    if (bank->length < MIDI_STREAM_IN_EPSIZE) bank->data[bank->length++] = Byte;
+}
+
+uint8_t Endpoint_Read_Byte(void)
+{
+    return 0;
+}
+
+// Spin (in simulated time) until the selected endpoint can be used.
+//
+uint8_t Endpoint_WaitUntilReady(void)
+{
+    uint64_t deadline = g_sim_time_ns + STREAM_TIMEOUT_MS * 1000000ull;
+    for (;;) {
+        if (USB_DeviceState != DEVICE_STATE_Configured)
+            return ENDPOINT_READYWAIT_DeviceDisconnected;
+        if (s_endpoint == MIDI_STREAM_IN_EPNUM ? Endpoint_IsINReady()
+                                               : Endpoint_IsOUTReceived())
+            return ENDPOINT_READYWAIT_NoError;
+        if (g_sim_time_ns >= deadline) {
+            ++g_sim_usb.in_timeouts;
+            return ENDPOINT_READYWAIT_Timeout;
+        }
+        sim_advance_us(10);
+    }
+}
+
+// MIDI class driver ---------------------------------------------------------
+
+bool MIDI_Device_ConfigureEndpoints(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo)
+{
+    (void)MIDIInterfaceInfo;
+    return true;
+}
+
+void MIDI_Device_ProcessControlRequest(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo)
+{
+    (void)MIDIInterfaceInfo;
+}
+
+void MIDI_Device_USBTask(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo)
+{
+    // Built with NO_CLASS_DRIVER_AUTOFLUSH, so there is nothing to do.
+    (void)MIDIInterfaceInfo;
+}
+
+uint8_t MIDI_Device_SendEventPacket(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo,
+                                    const MIDI_EventPacket_t* const Event)
+{
+    (void)MIDIInterfaceInfo;
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (Endpoint_WaitUntilReady() != ENDPOINT_READYWAIT_NoError)
+        return ENDPOINT_RWSTREAM_DeviceDisconnected;
+    const uint8_t* data = (const uint8_t*)Event;
+    for (uint8_t i=0; i<4; ++i) Endpoint_Write_Byte(data[i]);
+    if (!Endpoint_IsReadWriteAllowed()) Endpoint_ClearIN();
+    return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t MIDI_Device_Flush(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo)
+{
+    (void)MIDIInterfaceInfo;
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (Endpoint_BytesInEndpoint()) Endpoint_ClearIN();
+    return ENDPOINT_RWSTREAM_NoError;
+}
+
+bool MIDI_Device_ReceiveEventPacket(USB_ClassInfo_MIDI_Device_t* const MIDIInterfaceInfo,
+                                    MIDI_EventPacket_t* const Event)
+{
+    (void)MIDIInterfaceInfo;
+    if (USB_DeviceState != DEVICE_STATE_Configured) return false;
+    if (s_out_read == s_out_count) out_refill();
+    if (s_out_read == s_out_count) return false;
+    memcpy(Event, s_out_bank[s_out_read++], 4);
+    ++g_sim_usb.out_packets;
+    return true;
+}
@@ -24,6 +24,11 @@
 #include "spi.h"
 #include "constants.h"
 
+// Globals ---------------------------------------------------------------------
+
+volatile bool g_spi_foreground = false;
+volatile bool g_spi_background = false;
+
 
 // SPI functions ---------------------------------------------------------------
 
@@ -82,4 +87,28 @@ uint8_t spi_transmit(uint8_t byte)
     return SPDR;
 }
 
+// Claim the SPI bus for the main loop.
+//
+// Background transfers check the foreground flag at the end of every ADC
+// conversion and hand the bus back, so the wait here is at most the three
+// bytes of a single conversion. Once this returns the SPI interrupt is
+// disabled and spi_transmit() can poll SPIF as usual.
+//
+// Never call this with interrupts off, e.g. from another interrupt. Only
+// the SPI interrupt can finish a background transfer, so the wait would
+// never end.
+//
+void spi_acquire(void)
+{
+    g_spi_foreground = true;
+    while (g_spi_background) {}
+}
+
+// Give the SPI bus back to the background scanner.
+//
+void spi_release(void)
+{
+    g_spi_foreground = false;
+}
+
 // -----------------------------------------------------------------------------
@@ -23,9 +23,23 @@
 #ifndef _SPI_H_INCLUDED
 #define _SPI_H_INCLUDED
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// SPI globals -----------------------------------------------------------------
+
+// Bus ownership flags. The LED driver and the ADC share the SPI data and
+// clock lines, and the ADC is scanned from interrupts in the background, so
+// the main loop has to claim the bus before it talks to the LED driver.
+extern volatile bool g_spi_foreground;  // Main loop owns (or wants) the bus.
+extern volatile bool g_spi_background;  // An interrupt driven transfer is
+                                        // in progress.
+
 // SPI functions ---------------------------------------------------------------
 
 void spi_setup(void);
 uint8_t spi_transmit(uint8_t byte);
+void spi_acquire(void);
+void spi_release(void);
 
 #endif // _SPI_H_INCLUDED
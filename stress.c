@@ -0,0 +1,224 @@
+// MIDI throughput stress test for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "stress.h"
+#include "constants.h"
+#include "key.h"
+#include "midi.h"
+#include "sysex.h"
+#include "telemetry.h"
+#include "timer.h"
+
+#ifdef STRESS
+
+// A run keeps as close as it can to the requested rate by working out,
+// each pass, how many events should have gone by now and sending the
+// difference (at most STRESS_BURST of them). Events are MIDI messages, so a
+// SysEx counts once however many packets it takes. The time spent inside
+// the output path is added up too: nearly all of it is waiting for the
+// host to take an IN bank, so it shows how congested the bus is.
+
+// Globals ---------------------------------------------------------------------
+
+typedef struct {
+    bool running;
+    uint8_t pattern;      // STRESS_ flags.
+    uint8_t kind;         // Next kind of event in the pattern...
+    uint8_t seq;          // ...and the note, CC value or SysEx count.
+    bool note_off;        // The note is on, send its NoteOff next.
+    uint16_t rate;        // Events per second, 0 for as fast as it goes.
+    uint32_t length_ms;   // How long to run for.
+    uint16_t last_tick;   // Key read tick at the last pass.
+    uint32_t elapsed_ms;  // Time run so far.
+    uint32_t sent;        // Events sent so far.
+    uint32_t busy;        // Timer ticks spent sending them.
+    uint16_t waits;       // The telemetry counters at the start of the run.
+    uint16_t drops;
+} stress_t;
+
+static stress_t s_stress;
+
+// Functions -------------------------------------------------------------------
+
+// Send the next event of the pattern.
+//
+static void stress_send(void)
+{
+    // Find the next kind that is in the pattern.
+    while (!(s_stress.pattern & (1 << s_stress.kind))) {
+        s_stress.kind = (s_stress.kind + 1) % 3;
+    }
+    uint8_t seq = s_stress.seq & 0x7f;
+
+    switch (1 << s_stress.kind) {
+    case STRESS_NOTES:
+        // The on and off of each note are two events.
+        midi_stream_note(seq, !s_stress.note_off);
+        s_stress.note_off = !s_stress.note_off;
+        if (s_stress.note_off) return;  // Stay on the notes for the NoteOff.
+        ++s_stress.seq;
+        break;
+    case STRESS_CCS:
+        midi_stream_raw_cc(g_midi_channel, 0, seq);
+        ++s_stress.seq;
+        break;
+    default: {
+        uint8_t payload[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                                    SYSEX_COMMAND_STRESS,
+                                    0x03, // Traffic, see sysExCmdStress()
+                                    seq,
+                                    0xf7};
+        midi_stream_sysex(sizeof(payload), payload);
+        ++s_stress.seq;
+        break;
+    }
+    }
+    s_stress.kind = (s_stress.kind + 1) % 3;
+}
+
+// Send a value as "count" 7-bit bytes, high bits first.
+//
+static uint8_t* stress_put(uint8_t* out, const uint32_t value, uint8_t count)
+{
+    while (count--) {
+        *out++ = (value >> (7 * count)) & 0x7f;
+    }
+    return out;
+}
+
+// Finish the run and report how it went:
+//
+//   F0 00 mid mid 0A 01 sent[4] ms[3] rate[3] busy_ms[3] waits[3] drops[3] F7
+//
+// sent is the events sent in ms milliseconds (28 bits, as a long run flat
+// out can go past 21), rate the events per second
+// that works out to, busy_ms the time spent inside the output path and
+// waits and drops the times midi_queue_packet() had to wait for the host
+// and gave up (see telemetry.h).
+//
+static void stress_finish(void)
+{
+    s_stress.running = false;
+
+    uint32_t ms = s_stress.elapsed_ms;
+    uint32_t rate = ms ? s_stress.sent * 1000 / ms : 0;
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t waits = g_telemetry.in_waits - s_stress.waits;
+    uint16_t drops = g_telemetry.in_drops - s_stress.drops;
+    SREG = sreg;
+
+    uint8_t payload[6 + 4 + 5 * 3 + 1];
+    uint8_t* out = payload;
+    *out++ = 0xf0;
+    *out++ = 0x00;
+    *out++ = MANUFACTURER_ID >> 8;
+    *out++ = MANUFACTURER_ID & 0x7f;
+    *out++ = SYSEX_COMMAND_STRESS;
+    *out++ = 0x01; // 0x0 = request, 0x1 = response
+    out = stress_put(out, s_stress.sent, 4);
+    out = stress_put(out, ms, 3);
+    out = stress_put(out, rate, 3);
+    out = stress_put(out, s_stress.busy / (F_CPU / TIMER_TICK_CYCLES / 1000), 3);
+    out = stress_put(out, waits, 3);
+    out = stress_put(out, drops, 3);
+    *out++ = 0xf7;
+    midi_stream_sysex(sizeof(payload), payload);
+}
+
+// Start or stop a run:
+//
+//   F0 00 mid mid 0A 00 pattern rate_hi rate_lo seconds F7   start
+//   F0 00 mid mid 0A 02 F7                                   stop early
+//
+// pattern is the STRESS_ flags of the traffic to send, rate the target in
+// events per second (14 bits, 0 for flat out) and seconds how long to run.
+// The report is sent when the run ends, either way. The SysEx traffic is
+// F0 00 mid mid 0A 03 count F7, for the host to throw away.
+//
+static void sysExCmdStress(SysEx_t* sysex, uint8_t* payload)
+{
+    uint8_t size = sysex_payload_size(sysex);
+
+    if (payload[0] == STRESS_SYSEX_START && size >= 5) {
+        uint8_t pattern = payload[1] & (STRESS_NOTES | STRESS_CCS | STRESS_SYSEX);
+        if (!pattern || !payload[4]) return;
+        s_stress.pattern = pattern;
+        s_stress.kind = 0;
+        s_stress.seq = 0;
+        s_stress.note_off = false;
+        s_stress.rate = ((uint16_t)payload[2] << 7) | payload[3];
+        s_stress.length_ms = (uint32_t)payload[4] * 1000;
+        s_stress.last_tick = key_tick();
+        s_stress.elapsed_ms = 0;
+        s_stress.sent = 0;
+        s_stress.busy = 0;
+        s_stress.waits = g_telemetry.in_waits;
+        s_stress.drops = g_telemetry.in_drops;
+        s_stress.running = true;
+    } else if (payload[0] == STRESS_SYSEX_STOP && s_stress.running) {
+        stress_finish();
+    }
+}
+
+void stress_setup(void)
+{
+    sysex_install(SYSEX_COMMAND_STRESS, sysExCmdStress);
+}
+
+// Called once a pass from Midifighter_Task() to send the events that are
+// due.
+//
+void stress_task(void)
+{
+    if (!s_stress.running) return;
+
+    uint16_t now = key_tick();
+    s_stress.elapsed_ms += (uint16_t)(now - s_stress.last_tick);
+    s_stress.last_tick = now;
+    if (s_stress.elapsed_ms >= s_stress.length_ms) {
+        stress_finish();
+        return;
+    }
+
+    uint32_t due = s_stress.rate
+        ? s_stress.elapsed_ms * s_stress.rate / 1000
+        : s_stress.sent + STRESS_BURST;
+    for (uint8_t i=0; i<STRESS_BURST && s_stress.sent < due; ++i) {
+        // A long wait for the host wraps the timer, so time those with the
+        // key read tick instead.
+        uint16_t start = timer_now();
+        uint16_t start_ms = key_tick();
+        stress_send();
+        uint16_t ticks = timer_now() - start;
+        uint16_t ms = key_tick() - start_ms;
+        s_stress.busy += (ms > 16) ? (uint32_t)ms * (F_CPU / TIMER_TICK_CYCLES / 1000)
+                                   : ticks;
+        ++s_stress.sent;
+    }
+}
+
+#endif // STRESS
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,61 @@
+// MIDI throughput stress test for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _STRESS_H_INCLUDED
+#define _STRESS_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The stress test is only built in when STRESS is defined (see the
+// makefile). It sends synthetic MIDI through the usual output path at a
+// chosen rate, to find out how much a host, hub and cable will take. See
+// sysExCmdStress() for how to start one.
+
+// Kinds of traffic in the pattern, one bit each.
+#define STRESS_NOTES 0x01  // NoteOn then NoteOff.
+#define STRESS_CCS   0x02  // Control Changes, through the ordered queue.
+#define STRESS_SYSEX 0x04  // Short SysEx messages (3 packets each).
+
+// Most events sent in one pass of the main loop, a full IN bank of notes.
+#define STRESS_BURST 16
+
+// Stress SysEx commands.
+#define STRESS_SYSEX_START 0x0
+#define STRESS_SYSEX_STOP  0x2
+
+// Functions -------------------------------------------------------------------
+
+#ifdef STRESS
+
+void stress_setup(void);
+void stress_task(void);
+
+#else
+
+#define stress_setup() do {} while (0)
+#define stress_task() do {} while (0)
+
+#endif // STRESS
+
+// ----------------------------------------------------------------------------
+
+#endif // _STRESS_H_INCLUDED
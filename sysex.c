@@ -3,8 +3,81 @@
 #include "constants.h"
 
 #include "midi.h"
+#include "key.h"
+#include "timer.h"
+#include "telemetry.h"
 
-SysExFn sysExCommandMap[8] = {0,};
+static void sysExCmdPing (SysEx_t* sysex, uint8_t* command);
+
+// The ping command is always available, the rest are installed by the
+// modules that handle them.
+SysExFn sysExCommandMap[SYSEX_MAX_COMMANDS] = {
+    [SYSEX_COMMAND_PING] = (SysExFn)sysExCmdPing,
+};
+
+// Commands whose handlers take the payload a chunk at a time, one bit each.
+static uint16_t s_stream_commands = 0;
+
+// Receiver state, kept between USB packets and main loop passes so a
+// message can be spread over as many of them as it likes.
+typedef enum {
+    SYSEX_STATE_IDLE,       // Waiting for an F0.
+    SYSEX_STATE_HEADER,     // Reading the manufacturer id and command.
+    SYSEX_STATE_BUFFER,     // Buffering the payload for a message handler.
+    SYSEX_STATE_STREAM,     // Passing the payload on to a stream handler.
+    SYSEX_STATE_SKIP        // Not for us, or too big. Wait for the end.
+} sysex_state_t;
+
+static SysEx_t s_sysex;
+static uint8_t s_sysex_state = SYSEX_STATE_IDLE;
+
+// Latency probe. Replies at once with the device time the ping was handled
+// and the time the reply was sent, so the host can take the time spent on
+// the device out of the round trip, plus how long ago the last pad edge
+// was seen. Times are 16-bit values split into three 7-bit bytes, high bits
+// first:
+//
+//   F0 00 mid mid 06 00 seq F7                          - request
+//   F0 00 mid mid 06 01 seq tick[3] rx[3] tx[3] age[3] F7  - response
+//
+// seq is echoed back so the host can match the replies up, tick is the key
+// read tick (1ms) of the request, rx and tx the free-running timer
+// (TIMER_TICK_CYCLES cycles each) at receive and send and age the key read
+// ticks since the last pad press or release.
+//
+static void sysExCmdPing (SysEx_t* sysex, uint8_t* command)
+{
+    uint16_t rx = timer_now();
+    if (*command != 0x0) return;
+
+    // Take the edge first, so it can't be newer than the tick.
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t edge = g_key_edge_tick;
+    SREG = sreg;
+    uint16_t tick = key_tick();
+    uint16_t age = tick - edge;
+    // Anything after the request byte and before the F7 is the sequence.
+    uint8_t seq = (sysex_payload_size(sysex) > 1) ? command[1] : 0;
+
+    uint8_t payload[] = {0xf0, 0x00, MANUFACTURER_ID >> 8, MANUFACTURER_ID & 0x7f,
+                                SYSEX_COMMAND_PING,
+                                0x01, // 0x0 = request, 0x1 = response
+                                seq,
+                                tick >> 14, (tick >> 7) & 0x7f, tick & 0x7f,
+                                rx >> 14, (rx >> 7) & 0x7f, rx & 0x7f,
+                                0, 0, 0,
+                                age >> 14, (age >> 7) & 0x7f, age & 0x7f,
+                                0xf7};
+    uint16_t tx = timer_now();
+    payload[13] = tx >> 14;
+    payload[14] = (tx >> 7) & 0x7f;
+    payload[15] = tx & 0x7f;
+    midi_stream_sysex(sizeof(payload), payload);
+
+    // Don't wait for the end of the pass or the next frame.
+    midi_flush_now();
+}
 
 void sysex_handle (SysEx_t* sysex)
 {
@@ -13,7 +86,8 @@ void sysex_handle (SysEx_t* sysex)
         sysex->mid_ex2 == (MANUFACTURER_ID & 0x7f)) {
         // This message is meant for us.
 
-        if (sysExCommandMap[sysex->command]) {
+        if (sysex->command < SYSEX_MAX_COMMANDS &&
+            sysExCommandMap[sysex->command]) {
             sysExCommandMap[sysex->command](sysex, sysex->payload);
         }
     }
@@ -35,7 +109,100 @@ void sysex_handle (SysEx_t* sysex)
 }
 
 
-void sysex_install_ (uint8_t cmd, SysExFn fn)
+// Is this message for one of our stream handlers?
+//
+static bool sysex_is_stream (SysEx_t* sysex)
 {
+    return sysex->mid == 0x0 &&
+           sysex->mid_ex1 == (MANUFACTURER_ID >> 8) &&
+           sysex->mid_ex2 == (MANUFACTURER_ID & 0x7f) &&
+           sysex->command < SYSEX_MAX_COMMANDS &&
+           sysExCommandMap[sysex->command] &&
+           (s_stream_commands & (1 << sysex->command));
+}
+
+// Hand a chunk of payload to the stream handler of the current message.
+//
+static void sysex_stream (uint8_t* chunk, uint8_t size, uint8_t flags)
+{
+    s_sysex.flags = flags;
+    ((SysExStreamFn)sysExCommandMap[s_sysex.command])(&s_sysex, chunk, size);
+    s_sysex.offset += size;
+    s_sysex.length += size;
+}
+
+// Feed the data bytes of a USB-MIDI SysEx packet (1 to 3 of them) to the
+// receiver. Messages are picked out of the stream byte by byte, so it
+// doesn't matter how the host splits them up.
+//
+void sysex_receive (uint8_t* data, uint8_t size)
+{
+    // Where the stream handler's chunk starts in this packet.
+    uint8_t first = 0;
+
+    for (uint8_t i=0; i<size; ++i) {
+        uint8_t byte = data[i];
+
+        if (byte & 0x80) {
+            // A status byte ends any message in progress, but only an F7
+            // ends it properly.
+            bool end = (byte == 0xf7);
+            if (s_sysex_state == SYSEX_STATE_STREAM) {
+                sysex_stream(&data[first], i - first,
+                             end ? SYSEX_CHUNK_LAST : SYSEX_CHUNK_ABORT);
+            } else if (s_sysex_state == SYSEX_STATE_BUFFER && end) {
+                s_sysex.data[s_sysex.length++] = byte;
+                sysex_handle(&s_sysex);
+            }
+            s_sysex_state = SYSEX_STATE_IDLE;
+
+            if (byte == 0xf0) {
+                s_sysex.header = byte;
+                s_sysex.length = 1;
+                s_sysex_state = SYSEX_STATE_HEADER;
+            }
+            continue;
+        }
+
+        switch (s_sysex_state) {
+        case SYSEX_STATE_HEADER:
+            s_sysex.data[s_sysex.length++] = byte;
+            if (s_sysex.length == SYSEX_HEADER_SIZE) {
+                s_sysex.offset = 0;
+                if (sysex_is_stream(&s_sysex)) {
+                    s_sysex_state = SYSEX_STATE_STREAM;
+                    first = i + 1;
+                } else {
+                    s_sysex_state = SYSEX_STATE_BUFFER;
+                }
+            }
+            break;
+        case SYSEX_STATE_BUFFER:
+            // Leave room for the F7.
+            if (s_sysex.length < sizeof(s_sysex.data) - 1) {
+                s_sysex.data[s_sysex.length++] = byte;
+            } else {
+                TELEMETRY_COUNT(sysex_drops);
+                s_sysex_state = SYSEX_STATE_SKIP;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (s_sysex_state == SYSEX_STATE_STREAM && first < size) {
+        sysex_stream(&data[first], size - first, 0);
+    }
+}
+
+void sysex_install_ (uint8_t cmd, SysExFn fn, bool stream)
+{
+    if (cmd >= SYSEX_MAX_COMMANDS) return;
     sysExCommandMap[cmd] = fn;
+    if (stream) {
+        s_stream_commands |= (1 << cmd);
+    } else {
+        s_stream_commands &= ~(1 << cmd);
+    }
 }
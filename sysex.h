@@ -23,16 +23,39 @@
 #ifndef _SYSEX_H_INCLUDED
 #define _SYSEX_H_INCLUDED
 
+#include <stdbool.h>
 #include <stdint.h>
 
-#define STR_COMBINE(a,b) a##b
-#define SYSEX_READ(n) if (index < SYSEX_MAX_PAYLOAD) {sysEx.data[index++] = STR_COMBINE(input_event.Data,n);} else {index = 0; continue;} do {} while (0)
-#define SYSEX_END() sysEx.length = index; sysex_handle (&sysEx); index = 0
-
 // SysEx constants -----------------------------------------------
 
+// Largest payload buffered for a handler installed with sysex_install().
+// Longer messages are dropped, commands that need more should be installed
+// with sysex_install_stream() instead.
 #define SYSEX_MAX_PAYLOAD 32
 
+// F0, the three manufacturer id bytes and the command.
+#define SYSEX_HEADER_SIZE 5
+
+// Size of the command map, commands outside it are ignored.
+#define SYSEX_MAX_COMMANDS 16
+
+// SysEx command numbers
+#define SYSEX_COMMAND_PUSH_CONF 0x1
+#define SYSEX_COMMAND_PULL_CONF 0x2
+#define SYSEX_COMMAND_SYSTEM    0x3
+#define SYSEX_COMMAND_COMBO     0x4
+#define SYSEX_COMMAND_PROFILE   0x5
+#define SYSEX_COMMAND_PING      0x6
+#define SYSEX_COMMAND_LED_FRAME 0x7
+#define SYSEX_COMMAND_CURVE     0x8
+#define SYSEX_COMMAND_TELEMETRY 0x9
+#define SYSEX_COMMAND_STRESS    0xA
+#define SYSEX_COMMAND_CONFIG    0xB
+
+// Flags passed to stream handlers with each chunk.
+#define SYSEX_CHUNK_LAST  0x01  // The F7 came straight after this chunk.
+#define SYSEX_CHUNK_ABORT 0x02  // The message was cut off, forget it.
+
 // SysEx types     -----------------------------------------------
 
 // SysEx message structure
@@ -50,18 +73,34 @@ typedef struct {
             // Message payload
             uint8_t payload[SYSEX_MAX_PAYLOAD];
         };
-        uint8_t data[SYSEX_MAX_PAYLOAD + 5];
+        uint8_t data[SYSEX_MAX_PAYLOAD + SYSEX_HEADER_SIZE];
     };
-    uint8_t length;
+    uint16_t length;   // Message handlers: bytes from the F0 to the F7.
+    uint16_t offset;   // Stream handlers: payload bytes before this chunk.
+    uint8_t flags;     // Stream handlers: SYSEX_CHUNK_ flags.
 } SysEx_t;
 
-// SysEx command handler function
+// Bytes of payload in a whole message, not counting the final F7.
+static inline uint8_t sysex_payload_size(const SysEx_t* sysex)
+{
+    return sysex->length - SYSEX_HEADER_SIZE - 1;
+}
+
+// SysEx command handler function, called with the whole message once the
+// F7 has arrived. The payload runs up to and includes the F7.
 typedef void (*SysExFn)(SysEx_t*, void*);
 
+// SysEx stream handler function, called with each chunk of the payload as
+// it arrives (not including the F7). Only the header of the SysEx_t is
+// filled in, there is no buffered payload.
+typedef void (*SysExStreamFn)(SysEx_t*, uint8_t*, uint8_t);
+
 // SysEx functions -----------------------------------------------
 
-#define sysex_install(cmd,fn) sysex_install_(cmd, (SysExFn)fn)
-void sysex_install_ (uint8_t cmd, SysExFn fn);
+#define sysex_install(cmd,fn) sysex_install_(cmd, (SysExFn)fn, false)
+#define sysex_install_stream(cmd,fn) sysex_install_(cmd, (SysExFn)fn, true)
+void sysex_install_ (uint8_t cmd, SysExFn fn, bool stream);
+void sysex_receive (uint8_t* data, uint8_t size);
 void sysex_handle (SysEx_t* sysex);
 
 #endif // _SYSEX_H_INCLUDED
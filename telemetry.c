@@ -0,0 +1,168 @@
+// Health counters for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#include "telemetry.h"
+#include "constants.h"
+#include "eeprom.h"
+#include "key.h"
+#include "midi.h"
+#include "sysex.h"
+
+// Each counter is bumped where the trouble happens:
+//
+//   in_waits, in_drops    midi_queue_packet(), when both IN banks and the
+//                         RAM queue are full
+//   sysex_drops           sysex_receive(), when a message overflows the
+//                         buffer
+//   key_delays, key_losses  the key read interrupt, when the event queue is
+//                         full (see key.c)
+//   loop_max, loop_slow   telemetry_watchdog(), from the main loop
+//   wdt_resets, bor_resets  telemetry_setup(), from the reset flags
+//
+// The main loop gaps are timed with the key read tick, so they're good to a
+// millisecond. The menu runs from the main loop like everything else, so
+// its passes are timed along with the rest.
+
+// Globals ---------------------------------------------------------------------
+
+telemetry_t g_telemetry;
+
+static uint16_t s_watchdog_tick;      // Key read tick of the last reset...
+static bool s_watchdog_timed = false; // ...once there has been one.
+
+static void sysExCmdTelemetry(SysEx_t* sysex, uint8_t* command);
+
+// Functions -------------------------------------------------------------------
+
+#ifdef TELEMETRY_PERSIST
+// The reset counters are kept low byte first. Erased EEPROM reads as a
+// count of zero.
+//
+static uint16_t telemetry_load(const uint16_t address)
+{
+    uint16_t count = eeprom_read(address) | (eeprom_read(address + 1) << 8);
+    return (count == 0xffff) ? 0 : count;
+}
+
+static void telemetry_save(void)
+{
+    eeprom_write(EE_TELEMETRY_WDT_RESETS, g_telemetry.wdt_resets & 0xff);
+    eeprom_write(EE_TELEMETRY_WDT_RESETS + 1, g_telemetry.wdt_resets >> 8);
+    eeprom_write(EE_TELEMETRY_BOR_RESETS, g_telemetry.bor_resets & 0xff);
+    eeprom_write(EE_TELEMETRY_BOR_RESETS + 1, g_telemetry.bor_resets >> 8);
+}
+#endif // TELEMETRY_PERSIST
+
+// Count the reset we've just come out of. Call with the reset flags read
+// at the top of main(), after eeprom_setup().
+//
+void telemetry_setup(const uint8_t mcusr)
+{
+    g_telemetry.reset_cause = mcusr &
+        ((1 << WDRF) | (1 << BORF) | (1 << EXTRF) | (1 << PORF));
+#ifdef TELEMETRY_PERSIST
+    g_telemetry.wdt_resets = telemetry_load(EE_TELEMETRY_WDT_RESETS);
+    g_telemetry.bor_resets = telemetry_load(EE_TELEMETRY_BOR_RESETS);
+#endif
+    if (mcusr & (1 << WDRF)) TELEMETRY_COUNT(wdt_resets);
+    if (mcusr & (1 << BORF)) TELEMETRY_COUNT(bor_resets);
+#ifdef TELEMETRY_PERSIST
+    if (mcusr & ((1 << WDRF) | (1 << BORF))) telemetry_save();
+#endif
+    sysex_install(SYSEX_COMMAND_TELEMETRY, sysExCmdTelemetry);
+}
+
+// The main loop has just reset the watchdog. Time the gap since the last
+// time it did.
+//
+void telemetry_watchdog(void)
+{
+    uint16_t now = key_tick();
+
+    if (s_watchdog_timed) {
+        uint16_t gap = now - s_watchdog_tick;
+        if (gap > g_telemetry.loop_max) g_telemetry.loop_max = gap;
+        if (gap >= TELEMETRY_SLOW_MS) TELEMETRY_COUNT(loop_slow);
+    }
+    s_watchdog_tick = now;
+    s_watchdog_timed = true;
+}
+
+// Read or clear the counters:
+//
+//   F0 00 mid mid 09 00 F7   read
+//   F0 00 mid mid 09 02 F7   clear, then read
+//
+// The reply holds each 16-bit counter in the order of telemetry_t, split
+// into three 7-bit bytes, high bits first, then the reset flags and the
+// watchdog timeout in ms:
+//
+//   F0 00 mid mid 09 01 counters[TELEMETRY_COUNTERS x 3] reset_cause timeout F7
+//
+static void sysExCmdTelemetry(SysEx_t* sysex, uint8_t* command)
+{
+    if (*command == TELEMETRY_SYSEX_CLEAR) {
+        // The key counters belong to the key read interrupt.
+        uint8_t sreg = SREG;
+        cli();
+        uint8_t reset_cause = g_telemetry.reset_cause;
+        uint8_t* bytes = (uint8_t*)&g_telemetry;
+        for (uint8_t i=0; i<sizeof(g_telemetry); ++i) bytes[i] = 0;
+        g_telemetry.reset_cause = reset_cause;
+        SREG = sreg;
+        s_watchdog_timed = false;
+#ifdef TELEMETRY_PERSIST
+        telemetry_save();
+#endif
+    } else if (*command != TELEMETRY_SYSEX_READ) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    telemetry_t telemetry = g_telemetry;
+    SREG = sreg;
+
+    uint8_t payload[6 + TELEMETRY_COUNTERS * 3 + 3];
+    uint8_t* out = payload;
+    *out++ = 0xf0;
+    *out++ = 0x00;
+    *out++ = MANUFACTURER_ID >> 8;
+    *out++ = MANUFACTURER_ID & 0x7f;
+    *out++ = SYSEX_COMMAND_TELEMETRY;
+    *out++ = 0x01; // 0x0 = request, 0x1 = response
+    const uint16_t* counter = &telemetry.in_waits;
+    for (uint8_t i=0; i<TELEMETRY_COUNTERS; ++i) {
+        *out++ = counter[i] >> 14;
+        *out++ = (counter[i] >> 7) & 0x7f;
+        *out++ = counter[i] & 0x7f;
+    }
+    *out++ = telemetry.reset_cause;
+    *out++ = TELEMETRY_WDT_MS;
+    *out++ = 0xf7;
+    midi_stream_sysex(sizeof(payload), payload);
+}
+
+// ----------------------------------------------------------------------------
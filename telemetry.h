@@ -0,0 +1,78 @@
+// Health counters for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _TELEMETRY_H_INCLUDED
+#define _TELEMETRY_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counters of the things that go wrong quietly, so that after a show we can
+// tell a congested USB bus from a busy main loop or a hardware fault. They
+// are read (and cleared) over SysEx, see sysExCmdTelemetry().
+
+// The watchdog timeout set by wdt_enable(WDTO_120MS), and the gap between
+// resets of it that counts as a slow pass.
+#define TELEMETRY_WDT_MS  120
+#define TELEMETRY_SLOW_MS (TELEMETRY_WDT_MS / 2)
+
+// The counters at the start of telemetry_t, all uint16_t.
+#define TELEMETRY_COUNTERS 9
+
+// Telemetry SysEx commands.
+#define TELEMETRY_SYSEX_READ  0x0
+#define TELEMETRY_SYSEX_CLEAR 0x2
+
+// Types ----------------------------------------------------------------------
+
+typedef struct {
+    uint16_t in_waits;     // Waits for the host to take an IN endpoint bank.
+    uint16_t in_drops;     // Events dropped because it never did.
+    uint16_t sysex_drops;  // SysEx messages too long for the buffer.
+    uint16_t key_delays;   // Key edges held back by a full event queue...
+    uint16_t key_losses;   // ...and the ones undone before there was room.
+    uint16_t loop_max;     // Longest gap between watchdog resets (ms).
+    uint16_t loop_slow;    // Gaps of TELEMETRY_SLOW_MS or more.
+    uint16_t wdt_resets;   // Watchdog resets. With TELEMETRY_PERSIST these
+    uint16_t bor_resets;   // and the brown-outs are kept in the EEPROM.
+    uint8_t reset_cause;   // MCUSR after the last reset.
+} telemetry_t;
+
+// Globals ---------------------------------------------------------------------
+
+extern telemetry_t g_telemetry;
+
+// Functions -------------------------------------------------------------------
+
+// Count one more, sticking at the top rather than wrapping round to zero.
+#define TELEMETRY_COUNT(counter) \
+    do { if (g_telemetry.counter != 0xffff) ++g_telemetry.counter; } while (0)
+#define TELEMETRY_ADD(counter, n) \
+    do { uint16_t sum = g_telemetry.counter + (n); \
+         g_telemetry.counter = (sum < g_telemetry.counter) ? 0xffff : sum; \
+    } while (0)
+
+void telemetry_setup(const uint8_t mcusr);
+void telemetry_watchdog(void);
+
+// ----------------------------------------------------------------------------
+
+#endif // _TELEMETRY_H_INCLUDED
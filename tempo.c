@@ -0,0 +1,209 @@
+// Tempo tracker for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "tempo.h"
+#include "key.h"
+
+// Locks on to the MIDI clock from the host and predicts where in the beat
+// we are right now, so the LEDs can follow the beat smoothly rather than
+// stepping whenever a clock byte happens to get through.
+//
+// Clocks are timestamped with the key read tick as they come off the USB
+// endpoint, which is only good to a millisecond or so and bunches up when
+// the host sends several in one frame. A phase locked loop smooths that
+// out: each clock moves the estimate of when the last clock really
+// happened a quarter of the way towards when it arrived, and nudges the
+// estimated period by 1/32nd of the difference. Clocks that arrive about a
+// whole number of periods late are counted as dropped ones, and a run of
+// clocks that doesn't fit at all (the tempo jumped) starts the lock again.
+
+// Globals ---------------------------------------------------------------------
+
+enum {
+    TEMPO_IDLE = 0,  // No clock yet.
+    TEMPO_FIRST,     // One clock, waiting for a second to time.
+    TEMPO_LOCKED     // Tracking the tempo.
+};
+
+static uint8_t s_tempo_state = TEMPO_IDLE;
+static uint16_t s_tempo_period;        // Time between clocks (1/256 ms).
+static uint16_t s_tempo_last_ms;       // Estimated time of the last clock...
+static uint8_t s_tempo_last_frac;      // ...and the 1/256ths of a ms.
+static uint8_t s_tempo_clock = 0;      // Clocks into the beat at the last one.
+static uint8_t s_tempo_odd = 0;        // Clocks in a row that didn't fit.
+
+// tempo_position() only changes once a millisecond.
+static uint16_t s_tempo_cached_ms;
+static uint16_t s_tempo_cached_position;
+static bool s_tempo_cached = false;
+
+// Functions -------------------------------------------------------------------
+
+// Time since the estimated last clock, in 1/256ths of a millisecond.
+//
+static int32_t tempo_since(const uint16_t now)
+{
+    return ((int32_t)(int16_t)(now - s_tempo_last_ms) << 8) - s_tempo_last_frac;
+}
+
+// Take a clock that has just arrived.
+//
+static void tempo_clock(void)
+{
+    uint16_t now = key_tick();
+    int32_t since = tempo_since(now);
+    uint16_t period = s_tempo_period;
+    s_tempo_cached = false;
+
+    // Lost the clock for too long, start again from this one.
+    if (s_tempo_state == TEMPO_LOCKED &&
+        since > (int32_t)TEMPO_COAST_CLOCKS * period) {
+        s_tempo_state = TEMPO_IDLE;
+    }
+
+    if (s_tempo_state != TEMPO_LOCKED) {
+        // Time the first gap between clocks for a starting tempo.
+        if (s_tempo_state == TEMPO_FIRST &&
+            since >= TEMPO_PERIOD_MIN && since <= TEMPO_PERIOD_MAX) {
+            s_tempo_period = since;
+            s_tempo_odd = 0;
+            s_tempo_state = TEMPO_LOCKED;
+        } else {
+            s_tempo_state = TEMPO_FIRST;
+        }
+        s_tempo_last_ms = now;
+        s_tempo_last_frac = 0;
+        s_tempo_clock = (s_tempo_clock + 1) % TEMPO_CLOCKS_PER_BEAT;
+        return;
+    }
+
+    // How many clocks have gone by since the last one? Normally one, but
+    // more if some went missing on the way.
+    uint8_t clocks = 1;
+    if (since > (int32_t)period + period / 2) {
+        clocks = (since + period / 2) / period;
+    }
+    int32_t error = since - (int32_t)clocks * period;
+    int32_t limit = period / 4;
+    if (clocks != 1 || error > limit || error < -limit) {
+        if (++s_tempo_odd >= TEMPO_RELOCK_CLOCKS) {
+            // The tempo has changed too far to follow, time it again.
+            s_tempo_state = TEMPO_FIRST;
+            s_tempo_last_ms = now;
+            s_tempo_last_frac = 0;
+            s_tempo_clock = (s_tempo_clock + 1) % TEMPO_CLOCKS_PER_BEAT;
+            return;
+        }
+        if (error > limit) error = limit;
+        if (error < -limit) error = -limit;
+    } else {
+        s_tempo_odd = 0;
+    }
+
+    // Move the estimate on by the clocks that went by, pulled a quarter of
+    // the way towards when this one actually arrived.
+    uint32_t step = s_tempo_last_frac + (uint32_t)clocks * period + (error >> 2);
+    s_tempo_last_ms += step >> 8;
+    s_tempo_last_frac = step & 0xff;
+    s_tempo_clock = (s_tempo_clock + clocks) % TEMPO_CLOCKS_PER_BEAT;
+
+    // And follow any drift in the tempo.
+    int32_t next = (int32_t)period + (error >> 5);
+    if (next < TEMPO_PERIOD_MIN) next = TEMPO_PERIOD_MIN;
+    if (next > TEMPO_PERIOD_MAX) next = TEMPO_PERIOD_MAX;
+    s_tempo_period = next;
+}
+
+// Handle a MIDI System Real Time message. Clocks drive the tracker, Start
+// and Stop put us back at the top of a beat: the next clock is the first
+// of a new beat.
+//
+void tempo_realtime(const uint8_t status)
+{
+    switch (status) {
+    case 0xF8:  // Clock
+        tempo_clock();
+        break;
+    case 0xFA:  // Start
+    case 0xFC:  // Stop
+        s_tempo_clock = TEMPO_CLOCKS_PER_BEAT - 1;
+        s_tempo_cached = false;
+        break;
+    }
+}
+
+// Is the tracker following a tempo?
+//
+bool tempo_locked(void)
+{
+    return s_tempo_state == TEMPO_LOCKED;
+}
+
+// The tracked tempo in tenths of a BPM, or zero if there isn't one.
+//
+uint16_t tempo_bpm(void)
+{
+    if (s_tempo_state != TEMPO_LOCKED) return 0;
+    return (uint16_t)(600000UL * 256 / TEMPO_CLOCKS_PER_BEAT / s_tempo_period);
+}
+
+// The predicted position within the current beat, in 1/256ths of a clock
+// (0 to TEMPO_POSITION_MAX-1). Without a tempo to go on it only changes as
+// the clocks come in.
+//
+uint16_t tempo_position(void)
+{
+    if (s_tempo_state != TEMPO_LOCKED) return s_tempo_clock << 8;
+
+    uint16_t now = key_tick();
+    if (s_tempo_cached && now == s_tempo_cached_ms) {
+        return s_tempo_cached_position;
+    }
+
+    uint16_t period = s_tempo_period;
+    int32_t since = tempo_since(now);
+    if (since < 0) since = 0;
+    if (since > (int32_t)TEMPO_COAST_CLOCKS * period) {
+        // The clock has stopped, stay put until it comes back.
+        s_tempo_state = TEMPO_IDLE;
+        return s_tempo_clock << 8;
+    }
+    uint16_t clocks = ((uint32_t)since << 8) / period;
+    uint16_t position = ((s_tempo_clock << 8) + clocks) % TEMPO_POSITION_MAX;
+
+    s_tempo_cached_ms = now;
+    s_tempo_cached_position = position;
+    s_tempo_cached = true;
+    return position;
+}
+
+// The predicted phase of the current beat, 0 at the beat to 255 just
+// before the next one.
+//
+uint8_t tempo_phase(void)
+{
+    return tempo_position() / TEMPO_CLOCKS_PER_BEAT;
+}
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,56 @@
+// Tempo tracker for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _TEMPO_H_INCLUDED
+#define _TEMPO_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// MIDI clock runs at 24 clocks per beat.
+#define TEMPO_CLOCKS_PER_BEAT 24
+
+// Position within a beat, in 1/256ths of a clock.
+#define TEMPO_POSITION_MAX (TEMPO_CLOCKS_PER_BEAT * 256)
+
+// Tempos the tracker will lock to, as the time between clocks in 1/256ths
+// of a millisecond.
+#define TEMPO_PERIOD(bpm) ((uint16_t)(60000UL * 256 / ((bpm) * TEMPO_CLOCKS_PER_BEAT)))
+#define TEMPO_PERIOD_MIN TEMPO_PERIOD(300)
+#define TEMPO_PERIOD_MAX TEMPO_PERIOD(30)
+
+// How many clocks in a row can go missing before the tracker gives up, and
+// how many clocks in a row that don't fit the tempo make it start again.
+#define TEMPO_COAST_CLOCKS 24
+#define TEMPO_RELOCK_CLOCKS 4
+
+// Functions -------------------------------------------------------------------
+
+void tempo_realtime(const uint8_t status);
+
+bool tempo_locked(void);
+uint16_t tempo_bpm(void);
+uint16_t tempo_position(void);
+uint8_t tempo_phase(void);
+
+// ----------------------------------------------------------------------------
+
+#endif // _TEMPO_H_INCLUDED
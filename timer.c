@@ -0,0 +1,39 @@
+// Free-running cycle timer for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+
+#include <avr/io.h>
+
+#include "timer.h"
+
+// Functions -------------------------------------------------------------------
+
+// Start Timer1 running freely in normal mode. The count is never reset or
+// reloaded, so led.c uses compare A for the LED brightness planes without
+// getting in the way of anything timing with timer_now().
+//
+void timer_setup(void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11);  // clk/8
+    TCCR1C = 0;
+    TCNT1 = 0;
+}
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,53 @@
+// Free-running cycle timer for DJTechTools Midifighter
+//
+//   Copyright (C) 2012 DJTechTools
+//
+//   This file is part of the Midifighter Firmware.
+//
+//   The Midifighter Firmware is free software: you can redistribute it
+//   and/or modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation, either version 3 of the
+//   License, or (at your option) any later version.
+//
+//   The Midifighter Firmware is distributed in the hope that it will be
+//   useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with the Midifighter Firmware.  If not, see
+//   <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _TIMER_H_INCLUDED
+#define _TIMER_H_INCLUDED
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+// Timer1 counts continuously at F_CPU/8, so one tick is 8 CPU cycles
+// (0.5us at 16MHz) and the 16-bit count wraps every 32.768ms. Differences
+// between two readings are correct across a wrap as long as the interval
+// is shorter than that.
+#define TIMER_TICK_CYCLES 8
+
+// Functions -------------------------------------------------------------------
+
+void timer_setup(void);
+
+// Read the current tick count. A 16-bit timer read goes through the TEMP
+// register, so an interrupt that also reads the timer between the two byte
+// reads would corrupt the value.
+static inline uint16_t timer_now(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t now = TCNT1;
+    SREG = sreg;
+    return now;
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _TIMER_H_INCLUDED
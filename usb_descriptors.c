@@ -218,7 +218,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
                                      .Type = DTYPE_Endpoint },
             .EndpointAddress     = (ENDPOINT_DESCRIPTOR_DIR_OUT | MIDI_STREAM_OUT_EPNUM),
             .Attributes          = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-            .EndpointSize        = MIDI_STREAM_EPSIZE,
+            .EndpointSize        = MIDI_STREAM_OUT_EPSIZE,
             .PollingIntervalMS   = 0
         },
         .Refresh                  = 0,
@@ -239,7 +239,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
                                      .Type = DTYPE_Endpoint },
             .EndpointAddress     = (ENDPOINT_DESCRIPTOR_DIR_IN | MIDI_STREAM_IN_EPNUM),
             .Attributes          = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-            .EndpointSize        = MIDI_STREAM_EPSIZE,
+            .EndpointSize        = MIDI_STREAM_IN_EPSIZE,
             .PollingIntervalMS   = 0
         },
         .Refresh                  = 0,
@@ -42,9 +42,12 @@
 // Midifighter)
 #define MIDI_STREAM_IN_EPNUM 2
 
-// The size of a USB endpoint, 64 bytes, which will fit 16 normal USB-MIDI
-// packets.
-#define MIDI_STREAM_EPSIZE 64
+// The size of the IN endpoint, 64 bytes, which will fit 16 normal USB-MIDI
+// packets. The IN endpoint is double banked, so to fit the 176 bytes of
+// USB DPRAM (8 for the control endpoint, 2x64 for IN) the OUT endpoint is
+// limited to 32 bytes, 8 packets at a time.
+#define MIDI_STREAM_IN_EPSIZE 64
+#define MIDI_STREAM_OUT_EPSIZE 32
 
 
 // USB Descriptor -------------------------------------------------------------